@@ -65,6 +65,7 @@ def copy_vdf_client(build_dir, install_dir):
     shutil.copy("src/prover_test", install_dir)
     shutil.copy("src/1weso_test", install_dir)
     shutil.copy("src/2weso_test", install_dir)
+    shutil.copy("src/vdf_loadgen", install_dir)
 
 
 def copy_vdf_bench(build_dir, install_dir):
@@ -5,8 +5,8 @@
 int segments = 7;
 int thread_count = 3;
 
-int gcd_base_bits=50;
-int gcd_128_max_iter=3;
+int gcd_base_bits=cel_gcd_base_bits;
+int gcd_128_max_iter=cel_gcd_128_max_iter;
 
 void CheckProof(integer& D, Proof& proof, uint64_t iteration) {
     form x = form::generator(D);
@@ -24,8 +24,8 @@ int main() {
     debug_mode = true;
     if(hasAVX2())
     {
-      gcd_base_bits=63;
-      gcd_128_max_iter=2;
+      gcd_base_bits=avx2_gcd_base_bits;
+      gcd_128_max_iter=avx2_gcd_128_max_iter;
     }
     std::vector<uint8_t> challenge_hash({0, 0, 1, 2, 3, 3, 4, 4});
     integer D = CreateDiscriminant(challenge_hash, 1024);
@@ -47,20 +47,21 @@ int main() {
     TwoWesolowskiCallback* weso = new TwoWesolowskiCallback(D);
     FastStorage* fast_storage = NULL;
     std::thread vdf_worker(repeated_square, f, D, L, weso, fast_storage, std::ref(stopped));
+    TwoWesoPlanner planner(D, weso);
     // Test 1 - 1 million iters.
     uint64_t iteration = 1000000;
-    Proof proof = ProveTwoWeso(D, f, 1000000, 0, weso, 0, stopped);
+    Proof proof = ProveTwoWeso(D, f, 1000000, 0, weso, planner, 0, stopped);
     CheckProof(D, proof, iteration);
     // Test 2 - 15 million iters.
     iteration = 15000000;
-    proof = ProveTwoWeso(D, f, iteration, 0, weso, 0, stopped);
+    proof = ProveTwoWeso(D, f, iteration, 0, weso, planner, 0, stopped);
     CheckProof(D, proof, iteration);
     // Test 3 - 100 million iters.
     iteration = 100000000;
-    proof = ProveTwoWeso(D, f, iteration, 0, weso, 0, stopped);
+    proof = ProveTwoWeso(D, f, iteration, 0, weso, planner, 0, stopped);
     CheckProof(D, proof, iteration);
     // Test stopping gracefully.
     stopped = true;
     vdf_worker.join();
-    free(weso);
+    delete(weso);
 }
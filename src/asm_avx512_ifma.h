@@ -623,12 +623,12 @@ void add(reg_alloc regs, avx512_integer in_a, avx512_integer in_b, avx512_intege
 
         //temp_1 has the address of the table entry
         APPEND_M(str( "SHL `temp_0, 5" )); //multiply by 32 to convert the index to a byte offset
-        #ifdef CHIAOSX
+        if (position_independent) {
             APPEND_M(str( "LEA `temp_1, [RIP+avx512_add_table]" )); //base of the table
             APPEND_M(str( "ADD `temp_1, `temp_0")); //address of the table entry
-        #else
+        } else {
             APPEND_M(str( "LEA `temp_1, [avx512_add_table+`temp_0]" ));
-        #endif
+        }
 
         APPEND_M(str( "MOV `out_sign, [`temp_1]" ));
         APPEND_M(str( "VPBROADCASTQ `A, [`temp_1+8]" ));
@@ -81,11 +81,11 @@ string track_asm(string comment, string jump_to = "") {
     APPEND_M(str( "MOV RAX, [asm_tracking_data+#]", to_hex(8*(id-1)) ));
     APPEND_M(str( "LEA RAX, [RAX+1]" ));
     APPEND_M(str( "MOV [asm_tracking_data+#], RAX", to_hex(8*(id-1)) ));
-#ifdef CHIAOSX
-    APPEND_M(str( "LEA RAX, [RIP+comment_label] " ));
-#else
-    APPEND_M(str( "MOV RAX, OFFSET FLAT:#", comment_label ));
-#endif
+    if (position_independent) {
+        APPEND_M(str( "LEA RAX, [RIP+#]", comment_label ));
+    } else {
+        APPEND_M(str( "MOV RAX, OFFSET FLAT:#", comment_label ));
+    }
     APPEND_M(str( "MOV [asm_tracking_data_comments+#], RAX", to_hex(8*(id-1)) ));
     APPEND_M(str( "MOV RAX, [track_asm_rax]" ));
 
@@ -116,11 +116,11 @@ string constant_address_uint64(uint64 value_bits_0, uint64 value_bits_1, bool us
         APPEND_M(str( ".quad #", to_hex(value_bits_1) )); //lane 1
         APPEND_M(str( ".text" ));
     }
-#ifdef CHIAOSX
-    return (use_brackets)? str( "[RIP+#]", name ) : name;
-#else
-    return (use_brackets)? str( "[#]", name ) : name;
-#endif
+    if (position_independent) {
+        return (use_brackets)? str( "[RIP+#]", name ) : name;
+    } else {
+        return (use_brackets)? str( "[#]", name ) : name;
+    }
 }
 
 string constant_address_double(double value_0, double value_1, bool use_brackets=true) {
@@ -148,11 +148,11 @@ string constant_address_avx512_uint64(array<uint64, 8> value, bool use_brackets=
         }
         APPEND_M(str( ".text" ));
     }
-#ifdef CHIAOSX
-    return (use_brackets)? str( "ZMMWORD PTR [RIP+#]", name ) : name;
-#else
-    return (use_brackets)? str( "ZMMWORD PTR [#]", name ) : name;
-#endif
+    if (position_independent) {
+        return (use_brackets)? str( "ZMMWORD PTR [RIP+#]", name ) : name;
+    } else {
+        return (use_brackets)? str( "ZMMWORD PTR [#]", name ) : name;
+    }
 }
 
 string constant_address_avx512_uint64(uint64 value, bool use_brackets=true) {
@@ -140,6 +140,12 @@ void gcd_base_continued_fraction(
     reg_scalar c_table_delta_minus_1=regs.bind_scalar(m, "c_table_delta_minus_1");
     APPEND_M(str( "MOV `c_table_delta_minus_1, #", constant_address_uint64(c_table.delta-1, c_table.delta-1) ));
 
+    //position independent code can't put the table's address in an instruction, so it's kept here
+    if (position_independent) {
+        regs.bind_scalar(m, "table_base");
+        APPEND_M(str( "LEA `table_base, [RIP+")+asmprefix+str("gcd_base_table]" ));
+    }
+
     string exit_label=m.alloc_label();
     string loop_label=m.alloc_label();
 
@@ -185,14 +191,13 @@ void gcd_base_continued_fraction(
 
         //m_0: column 0
         //m_1: column 1
-#ifdef CHIAOSX
-        APPEND_M(str( "LEA RSI,[RIP+")+asmprefix+str("gcd_base_table]"));
-        APPEND_M(str( "MOVAPD `m_0, [`q_scalar+RSI]" ));
-        APPEND_M(str( "MOVAPD `m_1, [16+`q_scalar+RSI]" ));
-#else
-        APPEND_M(str( "MOVAPD `m_0, [")+asmprefix+str("gcd_base_table+`q_scalar]" ));
-        APPEND_M(str( "MOVAPD `m_1, [")+asmprefix+str("gcd_base_table+16+`q_scalar]" ));
-#endif
+        if (position_independent) {
+            APPEND_M(str( "MOVAPD `m_0, [`q_scalar+`table_base]" ));
+            APPEND_M(str( "MOVAPD `m_1, [16+`q_scalar+`table_base]" ));
+        } else {
+            APPEND_M(str( "MOVAPD `m_0, [")+asmprefix+str("gcd_base_table+`q_scalar]" ));
+            APPEND_M(str( "MOVAPD `m_1, [")+asmprefix+str("gcd_base_table+16+`q_scalar]" ));
+        }
 
         //if (ab[1]<=ab_threshold) goto exit_label
         //this also tests ab[0], which is >= ab[1] so this does nothing
@@ -57,12 +57,12 @@ void divide_table(reg_alloc regs, reg_scalar a, reg_scalar b, reg_scalar q, reg_
     APPEND_M(str( "#:", b_shift_label ));
 
     APPEND_M(str( "SARX RAX, `b, `q" )); // b_approx = b>>b_shift
-#ifdef CHIAOSX
-    APPEND_M(str( "LEA RCX, [RIP+divide_table]" )); // b_approx_inverse = divide_table[b_approx]
-    APPEND_M(str( "MOV RAX, [RCX+RAX*8]"));
-#else
-    APPEND_M(str( "MOV RAX, [divide_table+RAX*8]" )); // b_approx_inverse = divide_table[b_approx]
-#endif
+    if (position_independent) {
+        APPEND_M(str( "LEA RDX, [RIP+divide_table]" )); // b_approx_inverse = divide_table[b_approx]; r isn't set yet
+        APPEND_M(str( "MOV RAX, [RDX+RAX*8]"));
+    } else {
+        APPEND_M(str( "MOV RAX, [divide_table+RAX*8]" )); // b_approx_inverse = divide_table[b_approx]
+    }
 
     APPEND_M(str( "IMUL `a" )); // q = (b_approx_inverse*a)>>64
     APPEND_M(str( "SARX `q, RDX, `q" )); // q = q>>b_shift
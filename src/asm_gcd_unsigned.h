@@ -468,6 +468,7 @@ void gcd_unsigned(
             APPEND_M(str( "JE ")+asmprefix+str("multiply_uv_size_#", mapped_size ));
         }
 #else
+        //position independent code stores each target's offset from the table instead of its address
         for (int end_index=0;end_index<int_size;++end_index) {
             int size=end_index+1;
             
@@ -476,12 +477,24 @@ void gcd_unsigned(
                 ++mapped_size;
             }
 
-            APPEND_M(str( ".quad ")+asmprefix+str("multiply_uv_size_#", mapped_size ));
+            if (position_independent) {
+                APPEND_M(str( ".long ")+asmprefix+str("multiply_uv_size_#-#", mapped_size, jump_table_label ));
+            } else {
+                APPEND_M(str( ".quad ")+asmprefix+str("multiply_uv_size_#", mapped_size ));
+            }
         }
         APPEND_M(str( ".text" ));
 
         APPEND_M(str( "MOV `tmp, `spill_a_end_index" ));
-        APPEND_M(str( "JMP QWORD PTR [#+`tmp*8]", jump_table_label ));
+        if (position_independent) {
+            reg_scalar tmp_table=regs.bind_scalar(m, "tmp_table");
+            APPEND_M(str( "LEA `tmp_table, [RIP+#]", jump_table_label ));
+            APPEND_M(str( "MOVSXD `tmp, DWORD PTR [`tmp_table+`tmp*4]" ));
+            APPEND_M(str( "ADD `tmp, `tmp_table" ));
+            APPEND_M(str( "JMP `tmp" ));
+        } else {
+            APPEND_M(str( "JMP QWORD PTR [#+`tmp*8]", jump_table_label ));
+        }
 #endif
     }
     for (int size=4;size<=int_size;size+=4) {
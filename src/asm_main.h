@@ -476,13 +476,22 @@ void compile_asm_avx512_multiply(int in_a_num_limbs, int in_b_num_limbs, int out
 //
 
 #ifdef COMPILE_ASM
+void write_asm_file(std::string filename) {
+    ofstream out( filename );
+    out << m.format_res_text();
+#ifndef CHIAOSX
+    //the code doesn't need an executable stack; without this note, a shared library made from it asks for one
+    out << ".section .note.GNU-stack,\"\",@progbits\n";
+#endif
+}
+
 void compile_asm(std::string filename) {
     compile_asm_gcd_base();
     compile_asm_gcd_128();
     compile_asm_gcd_unsigned();
+    schedule_asm();
 
-    ofstream out( filename );
-    out << m.format_res_text();
+    write_asm_file(filename);
 }
 
 void compile_asm_avx512(std::string filename) {
@@ -490,9 +499,9 @@ void compile_asm_avx512(std::string filename) {
     for_each_asm_avx512_func_to_gmp_integer(compile_asm_avx512_to_gmp_integer)
     for_each_asm_avx512_func_add(compile_asm_avx512_add)
     for_each_asm_avx512_func_multiply(compile_asm_avx512_multiply)
+    schedule_asm();
 
-    ofstream out( filename );
-    out << m.format_res_text();
+    write_asm_file(filename);
 }
 #endif
 
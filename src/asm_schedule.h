@@ -0,0 +1,634 @@
+#ifndef ASM_SCHEDULE_H
+#define ASM_SCHEDULE_H
+
+//optional list scheduling pass over the generated instructions. the generators emit instructions in
+//the order they are appended, which is usually the order the values are needed. this reorders each
+//basic block so the critical path goes first and long latency instructions (loads, mul, ifma) start
+//as soon as their inputs are ready, using a latency and port table for one microarchitecture
+//
+//only the dependencies that can be read from the text are kept: registers (including partial
+//writes), the carry/overflow/other flags, and memory. gcd_unsigned shares memory with the master
+//thread and relies on the order of its stores, so a store keeps its place relative to every other
+//memory access unless both are spill slots ([RSP+displacement]) at least 64 bytes apart
+//labels, directives, jumps, push/pop and anything not in the table end a block and are not moved
+
+namespace asm_code {
+
+
+//name of the table to schedule for. empty to output the instructions in the order they were appended
+string schedule_uarch;
+
+struct schedule_uarch_table {
+    string name;
+    int issue_width;
+    int load_latency; //added to the latency of instructions with a memory source
+    string load_ports;
+    string store_ports;
+
+    //one line per mnemonic: "MNEMONIC LATENCY UOPS PORTS". ports are hex digits
+    //a mnemonic ending in "*" matches any suffix (used for the condition codes)
+    string ops;
+};
+
+const vector<schedule_uarch_table> schedule_uarch_tables={
+    //skylake and cascade lake (client and server). 512-bit uops go to port 0 (0 and 1 fused) or 5
+    {"skylake", 4, 4, "23", "4",
+        "MOV 1 1 0156\n"
+        "LEA 1 1 15\n"
+        "ADD 1 1 0156\n" "SUB 1 1 0156\n" "AND 1 1 0156\n" "OR 1 1 0156\n" "XOR 1 1 0156\n"
+        "CMP 1 1 0156\n" "TEST 1 1 0156\n" "NOT 1 1 0156\n" "NEG 1 1 0156\n" "INC 1 1 0156\n" "DEC 1 1 0156\n"
+        "STC 1 1 0156\n"
+        "ADC 1 1 06\n" "SBB 1 1 06\n" "ADCX 1 1 06\n" "ADOX 1 1 06\n"
+        "CMOV* 1 1 06\n" "SET* 1 1 06\n"
+        "SHL 1 1 06\n" "SHR 1 1 06\n" "SAR 1 1 06\n" "SARX 1 1 06\n" "SHRD 3 2 16\n"
+        "BSR 3 1 1\n"
+        "MUL 4 2 15\n" "MULX 4 2 15\n" "IMUL 3 1 1\n" "IDIV 42 4 0156\n"
+        "MOVQ 2 1 05\n" "MOVAPD 1 1 015\n" "MOVDQU 1 1 015\n" "MOVDQA 1 1 015\n"
+        "ANDPD 1 1 015\n" "ORPD 1 1 015\n" "XORPD 1 1 015\n" "SHUFPD 1 1 5\n"
+        "ADDPD 4 1 01\n" "SUBPD 4 1 01\n" "MULPD 4 1 01\n" "SUBSD 4 1 01\n" "DIVSD 14 1 0\n"
+        "CMPLTPD 4 1 01\n" "CMPLEPD 4 1 01\n" "CMPNLEPD 4 1 01\n"
+        "UCOMISD 3 1 0\n" "ROUNDSD 8 2 01\n" "CVTTSD2SI 6 2 01\n" "CVTSI2SD 5 2 015\n"
+        "PXOR 1 1 015\n" "PAND 1 1 015\n" "PADDQ 1 1 015\n" "PSRAD 1 1 01\n" "PSHUFD 1 1 5\n" "PTEST 3 2 05\n"
+        "VMOVQ 2 1 05\n" "VMOVDQU 1 1 015\n" "VPTEST 3 2 05\n" "VPOR 1 1 015\n" "VPSUBQ 1 1 015\n"
+        "VPERMQ 3 1 5\n" "VPMULDQ 5 1 01\n" "VFMADD231PD 4 1 01\n"
+        "VMOVDQU64 1 1 05\n" "VMOVDQA64 1 1 05\n" "VPBROADCASTQ 3 1 5\n"
+        "VPADDQ 1 1 05\n" "VPXORQ 1 1 05\n" "VPORQ 1 1 05\n" "VPANDQ 1 1 05\n" "VPANDNQ 1 1 05\n"
+        "VPMAXUQ 1 1 05\n" "VPABSQ 1 1 05\n" "VPSLLVQ 1 1 0\n" "VPSRLVQ 1 1 0\n" "VPSRAQ 1 1 0\n"
+        "VPERMI2Q 3 1 5\n" "VPCMPUQ 3 1 5\n" "VPTESTMQ 3 1 5\n" "KMOVQ 3 1 0\n"
+    },
+
+    //ice lake and later intel server cores: 5 wide, two store ports, ifma on port 0 for 512 bits
+    {"icelake", 5, 5, "23", "49",
+        "MOV 1 1 0156\n"
+        "LEA 1 1 15\n"
+        "ADD 1 1 0156\n" "SUB 1 1 0156\n" "AND 1 1 0156\n" "OR 1 1 0156\n" "XOR 1 1 0156\n"
+        "CMP 1 1 0156\n" "TEST 1 1 0156\n" "NOT 1 1 0156\n" "NEG 1 1 0156\n" "INC 1 1 0156\n" "DEC 1 1 0156\n"
+        "STC 1 1 0156\n"
+        "ADC 1 1 06\n" "SBB 1 1 06\n" "ADCX 1 1 06\n" "ADOX 1 1 06\n"
+        "CMOV* 1 1 06\n" "SET* 1 1 06\n"
+        "SHL 1 1 06\n" "SHR 1 1 06\n" "SAR 1 1 06\n" "SARX 1 1 06\n" "SHRD 3 2 16\n"
+        "BSR 3 1 1\n"
+        "MUL 4 2 15\n" "MULX 4 2 15\n" "IMUL 3 1 1\n" "IDIV 15 4 0156\n"
+        "MOVQ 2 1 05\n" "MOVAPD 1 1 015\n" "MOVDQU 1 1 015\n" "MOVDQA 1 1 015\n"
+        "ANDPD 1 1 015\n" "ORPD 1 1 015\n" "XORPD 1 1 015\n" "SHUFPD 1 1 15\n"
+        "ADDPD 4 1 01\n" "SUBPD 4 1 01\n" "MULPD 4 1 01\n" "SUBSD 4 1 01\n" "DIVSD 14 1 0\n"
+        "CMPLTPD 4 1 01\n" "CMPLEPD 4 1 01\n" "CMPNLEPD 4 1 01\n"
+        "UCOMISD 3 1 0\n" "ROUNDSD 8 2 01\n" "CVTTSD2SI 6 2 01\n" "CVTSI2SD 5 2 015\n"
+        "PXOR 1 1 015\n" "PAND 1 1 015\n" "PADDQ 1 1 015\n" "PSRAD 1 1 01\n" "PSHUFD 1 1 15\n" "PTEST 3 2 05\n"
+        "VMOVQ 2 1 05\n" "VMOVDQU 1 1 015\n" "VPTEST 3 2 05\n" "VPOR 1 1 015\n" "VPSUBQ 1 1 015\n"
+        "VPERMQ 3 1 5\n" "VPMULDQ 5 1 01\n" "VFMADD231PD 4 1 01\n"
+        "VMOVDQU64 1 1 05\n" "VMOVDQA64 1 1 05\n" "VPBROADCASTQ 3 1 5\n"
+        "VPADDQ 1 1 05\n" "VPXORQ 1 1 05\n" "VPORQ 1 1 05\n" "VPANDQ 1 1 05\n" "VPANDNQ 1 1 05\n"
+        "VPMAXUQ 1 1 05\n" "VPABSQ 1 1 05\n" "VPSLLVQ 1 1 0\n" "VPSRLVQ 1 1 0\n" "VPSRAQ 1 1 0\n"
+        "VPMADD52LUQ 4 1 0\n" "VPMADD52HUQ 4 1 0\n"
+        "VPERMI2Q 3 1 5\n" "VPCMPUQ 3 1 5\n" "VPTESTMQ 3 1 5\n" "KMOVQ 3 1 0\n"
+    },
+
+    //zen 2 and 3. integer alus are ports 0-3, the fp pipes are ports 8-b. no avx-512
+    {"zen3", 5, 4, "45", "6",
+        "MOV 1 1 0123\n"
+        "LEA 1 1 0123\n"
+        "ADD 1 1 0123\n" "SUB 1 1 0123\n" "AND 1 1 0123\n" "OR 1 1 0123\n" "XOR 1 1 0123\n"
+        "CMP 1 1 0123\n" "TEST 1 1 0123\n" "NOT 1 1 0123\n" "NEG 1 1 0123\n" "INC 1 1 0123\n" "DEC 1 1 0123\n"
+        "STC 1 1 0123\n"
+        "ADC 1 1 0123\n" "SBB 1 1 0123\n" "ADCX 1 1 0123\n" "ADOX 1 1 0123\n"
+        "CMOV* 1 1 03\n" "SET* 1 1 03\n"
+        "SHL 1 1 12\n" "SHR 1 1 12\n" "SAR 1 1 12\n" "SARX 1 1 12\n" "SHRD 4 4 12\n"
+        "BSR 4 4 0123\n"
+        "MUL 3 2 1\n" "MULX 4 2 1\n" "IMUL 3 1 1\n" "IDIV 45 2 2\n"
+        "MOVQ 3 1 89ab\n" "MOVAPD 1 1 89ab\n" "MOVDQU 1 1 89ab\n" "MOVDQA 1 1 89ab\n"
+        "ANDPD 1 1 89ab\n" "ORPD 1 1 89ab\n" "XORPD 1 1 89ab\n" "SHUFPD 1 1 9a\n"
+        "ADDPD 3 1 ab\n" "SUBPD 3 1 ab\n" "MULPD 3 1 89\n" "SUBSD 3 1 ab\n" "DIVSD 13 1 9\n"
+        "CMPLTPD 1 1 89\n" "CMPLEPD 1 1 89\n" "CMPNLEPD 1 1 89\n"
+        "UCOMISD 3 2 89\n" "ROUNDSD 3 1 89\n" "CVTTSD2SI 4 2 9a\n" "CVTSI2SD 4 2 9a\n"
+        "PXOR 1 1 89ab\n" "PAND 1 1 89ab\n" "PADDQ 1 1 89ab\n" "PSRAD 1 1 9a\n" "PSHUFD 1 1 9a\n" "PTEST 3 2 89\n"
+        "VMOVQ 3 1 89ab\n" "VMOVDQU 1 1 89ab\n" "VPTEST 3 2 89\n" "VPOR 1 1 89ab\n" "VPSUBQ 1 1 89ab\n"
+        "VPERMQ 6 2 9a\n" "VPMULDQ 3 1 89\n" "VFMADD231PD 5 1 89\n"
+    },
+};
+
+//dependency resources. memory is handled separately
+const int schedule_resource_vector=16;
+const int schedule_resource_mask=48;
+const int schedule_resource_cf=56;
+const int schedule_resource_of=57;
+const int schedule_resource_other_flags=58;
+const int schedule_num_resources=59;
+
+struct schedule_memory_access {
+    bool valid=false;
+    bool simple=true; //base register plus displacement
+    int base=-1;
+    int64 displacement=0;
+};
+
+struct schedule_instruction {
+    int index=-1; //into the block
+    vector<int> reads;
+    vector<int> writes;
+    schedule_memory_access memory;
+    bool memory_read=false;
+    bool memory_write=false;
+
+    int latency=1;
+    int uops=1;
+    string ports;
+
+    vector<pair<int, int>> successors; //index, latency
+    int num_predecessors=0;
+    int height=0; //longest latency path from the start of this instruction to the end of the block
+};
+
+//register name to resource, or -1
+int schedule_register(const string& name) {
+    static map<string, int> names;
+    if (names.empty()) {
+        for (int x=0;x<16;++x) {
+            names[scalar_register_names_64.at(x)]=x;
+            names[scalar_register_names_32.at(x)]=x;
+            names[scalar_register_names_16.at(x)]=x;
+            names[scalar_register_names_8.at(x)]=x;
+        }
+        names["AH"]=reg_rax.value;
+        names["DH"]=reg_rdx.value;
+        names["CH"]=reg_rcx.value;
+        names["BH"]=reg_rbx.value;
+        for (int x=0;x<32;++x) {
+            names[str( "XMM#", x )]=schedule_resource_vector+x;
+            names[str( "YMM#", x )]=schedule_resource_vector+x;
+            names[str( "ZMM#", x )]=schedule_resource_vector+x;
+        }
+        for (int x=0;x<8;++x) {
+            names[str( "k#", x )]=schedule_resource_mask+x;
+        }
+    }
+
+    auto i=names.find(name);
+    return (i==names.end())? -1 : i->second;
+}
+
+//splits into identifiers (letters, digits and underscores)
+vector<string> schedule_tokens(const string& s) {
+    vector<string> res;
+    string c;
+    for (char x : s+" ") {
+        if ((x>='0' && x<='9') || (x>='A' && x<='Z') || (x>='a' && x<='z') || x=='_') {
+            c+=x;
+        } else
+        if (!c.empty()) {
+            res.push_back(c);
+            c.clear();
+        }
+    }
+    return res;
+}
+
+schedule_memory_access schedule_parse_memory(const string& operand) {
+    schedule_memory_access res;
+    res.valid=true;
+
+    string address=operand.substr(operand.find('[')+1);
+    address=address.substr(0, address.find(']'));
+
+    string term;
+    int sign=1;
+    auto add_term=[&](int next_sign) {
+        if (!term.empty()) {
+            int r=schedule_register(term);
+            if (term.find('*')!=string::npos || (r!=-1 && res.base!=-1)) {
+                res.simple=false; //index
+            } else
+            if (r!=-1) {
+                res.base=r;
+            } else
+            if (term[0]>='0' && term[0]<='9') {
+                res.displacement+=sign*int64(strtoull(term.c_str(), nullptr, 0));
+            } else {
+                res.simple=false; //symbol
+            }
+        }
+        term.clear();
+        sign=next_sign;
+    };
+    for (char c : address) {
+        if (c=='+') {
+            add_term(sign);
+            sign=1;
+        } else
+        if (c=='-') {
+            add_term(-1);
+            sign=-1;
+        } else
+        if (c!=' ') {
+            term+=c;
+        }
+    }
+    add_term(1);
+
+    if (res.base==-1) {
+        res.simple=false;
+    }
+    return res;
+}
+
+//true if the two accesses have to stay in program order. loads can always be reordered with each other
+bool schedule_memory_ordered(const schedule_instruction& a, const schedule_instruction& b) {
+    if (!a.memory_write && !b.memory_write) {
+        return false;
+    }
+    //if rsp were written between the two accesses, they would already be ordered by the register
+    //dependencies
+    const schedule_memory_access& x=a.memory;
+    const schedule_memory_access& y=b.memory;
+    if (!x.simple || !y.simple || x.base!=reg_rsp.value || y.base!=reg_rsp.value) {
+        return true;
+    }
+    int64 distance=x.displacement-y.displacement;
+    return distance>-64 && distance<64;
+}
+
+//returns false if the instruction has to stay where it is
+bool schedule_parse(const string& text, const schedule_uarch_table& uarch, schedule_instruction& res) {
+    string s=text;
+    while (!s.empty() && s.back()==' ') {
+        s.pop_back();
+    }
+    if (s.empty() || s[0]=='.' || s[0]=='#' || (s.find(':')!=string::npos && s.find("OFFSET FLAT:")==string::npos)) {
+        return false;
+    }
+
+    string mnemonic=s.substr(0, s.find(' '));
+    vector<string> operands;
+    if (s.find(' ')!=string::npos) {
+        string c;
+        for (char x : s.substr(s.find(' ')+1)+",") {
+            if (x==',') {
+                operands.push_back(c);
+                c.clear();
+            } else {
+                c+=x;
+            }
+        }
+    }
+
+    //latency and ports
+    bool found=false;
+    {
+        istringstream ops(uarch.ops);
+        string name;
+        int latency;
+        int uops;
+        string ports;
+        while (ops >> name >> latency >> uops >> ports) {
+            bool match=(name.back()=='*')?
+                mnemonic.compare(0, name.size()-1, name, 0, name.size()-1)==0 :
+                mnemonic==name;
+            if (match) {
+                res.latency=latency;
+                res.uops=uops;
+                res.ports=ports;
+                found=true;
+                break;
+            }
+        }
+    }
+    if (!found) {
+        return false;
+    }
+
+    auto starts_with=[&](const char* prefix) {
+        return mnemonic.compare(0, strlen(prefix), prefix)==0;
+    };
+    auto is_one_of=[&](const vector<string>& names) {
+        return find(names.begin(), names.end(), mnemonic)!=names.end();
+    };
+
+    bool multiply_divide=(is_one_of({"MUL", "DIV", "IDIV"}) || (mnemonic=="IMUL" && operands.size()==1));
+    bool only_reads=is_one_of({"CMP", "TEST", "PTEST", "VPTEST", "UCOMISD"}) || multiply_divide;
+    bool writes_op1=(mnemonic=="MULX");
+    bool only_writes=(
+        is_one_of({"MOV", "MOVAPD", "MOVQ", "MOVDQU", "MOVDQA", "LEA", "CVTTSD2SI", "PSHUFD", "SARX", "MULX", "KMOVQ"}) ||
+        (starts_with("V") && !is_one_of({"VPERMI2Q", "VPMADD52LUQ", "VPMADD52HUQ", "VFMADD231PD", "VPTEST"}))
+    );
+
+    //flags
+    vector<int> all_flags={schedule_resource_cf, schedule_resource_of, schedule_resource_other_flags};
+    if (is_one_of({"ADD", "SUB", "AND", "OR", "XOR", "CMP", "TEST", "NEG", "BSR", "MUL", "IMUL", "DIV", "IDIV", "PTEST", "VPTEST", "UCOMISD"})) {
+        res.writes=all_flags;
+    } else
+    if (is_one_of({"SHL", "SHR", "SAR", "SHRD"})) {
+        //the flags aren't changed if the count is 0
+        res.reads=all_flags;
+        res.writes=all_flags;
+    } else
+    if (is_one_of({"ADC", "SBB"})) {
+        res.reads={schedule_resource_cf};
+        res.writes=all_flags;
+    } else
+    if (is_one_of({"INC", "DEC"})) {
+        res.writes={schedule_resource_of, schedule_resource_other_flags};
+    } else
+    if (mnemonic=="ADCX" || mnemonic=="STC") {
+        if (mnemonic=="ADCX") {
+            res.reads={schedule_resource_cf};
+        }
+        res.writes={schedule_resource_cf};
+    } else
+    if (mnemonic=="ADOX") {
+        res.reads={schedule_resource_of};
+        res.writes={schedule_resource_of};
+    } else
+    if (starts_with("CMOV") || starts_with("SET")) {
+        res.reads=all_flags;
+    }
+
+    if (multiply_divide) {
+        res.reads.push_back(reg_rax.value);
+        if (mnemonic=="DIV" || mnemonic=="IDIV") {
+            res.reads.push_back(reg_rdx.value);
+        }
+        res.writes.push_back(reg_rax.value);
+        res.writes.push_back(reg_rdx.value);
+    }
+    if (mnemonic=="MULX") {
+        res.reads.push_back(reg_rdx.value);
+    }
+
+    for (int x=0;x<operands.size();++x) {
+        const string& operand=operands[x];
+        bool is_destination=(x==0 && !only_reads) || (x==1 && writes_op1);
+
+        if (operand.find('[')!=string::npos) {
+            if (res.memory.valid) {
+                return false;
+            }
+            res.memory=schedule_parse_memory(operand);
+            string address=operand.substr(operand.find('['));
+            for (const string& t : schedule_tokens(address)) {
+                if (schedule_register(t)!=-1) {
+                    res.reads.push_back(schedule_register(t));
+                }
+            }
+            if (is_destination) {
+                res.memory_write=true;
+                if (!only_writes) {
+                    res.memory_read=true;
+                }
+            } else {
+                res.memory_read=true;
+            }
+            continue;
+        }
+
+        int reg=-1;
+        for (const string& t : schedule_tokens(operand)) {
+            int r=schedule_register(t);
+            if (r==-1) {
+                continue;
+            }
+            if (reg==-1) {
+                reg=r;
+            } else {
+                res.reads.push_back(r); //write mask
+            }
+        }
+        if (reg==-1) {
+            continue;
+        }
+
+        if (!is_destination) {
+            res.reads.push_back(reg);
+            continue;
+        }
+
+        //writes that keep part of the old value also read it: 8 and 16 bit registers, legacy sse
+        //(which keeps the upper bits of the ymm/zmm register) and merge masking
+        string name=schedule_tokens(operand).at(0);
+        bool partial=false;
+        if (reg<schedule_resource_vector) {
+            partial=(name!=scalar_register_names_64.at(reg) && name!=scalar_register_names_32.at(reg));
+        } else
+        if (reg<schedule_resource_mask) {
+            partial=!starts_with("V");
+        }
+        if (operand.find("{k")!=string::npos && operand.find("{z}")==string::npos) {
+            partial=true;
+        }
+
+        if (!only_writes || partial) {
+            res.reads.push_back(reg);
+        }
+        res.writes.push_back(reg);
+    }
+
+    if (res.memory_read) {
+        res.latency+=uarch.load_latency;
+    }
+    return true;
+}
+
+//estimated cycles for the block. with keep_order, the instructions issue in the order given
+//(this is how the unscheduled code is estimated); otherwise order is set to the issue order
+int schedule_block(vector<schedule_instruction>& block, const schedule_uarch_table& uarch, bool keep_order, vector<int>& order) {
+    int n=block.size();
+    vector<int> num_predecessors(n);
+    vector<int> earliest(n, 0);
+    vector<bool> issued(n, false);
+    for (int x=0;x<n;++x) {
+        num_predecessors[x]=block[x].num_predecessors;
+    }
+
+    order.clear();
+    int cycle=0;
+    int end_cycle=0;
+    while (order.size()<n) {
+        set<char> used_ports;
+        int width=uarch.issue_width;
+
+        while (width>0) {
+            int best=-1;
+            vector<char> best_ports;
+
+            for (int x=(keep_order)? order.size() : 0;x<n;++x) {
+                const schedule_instruction& c=block[x];
+                if (issued[x]) {
+                    continue;
+                }
+                bool ready=(num_predecessors[x]==0 && earliest[x]<=cycle);
+
+                vector<char> ports;
+                if (ready) {
+                    //each uop needs a free port. an instruction with more uops than ports can
+                    //always go into an empty cycle
+                    set<char> free_ports;
+                    for (char p : c.ports) {
+                        if (!used_ports.count(p)) {
+                            free_ports.insert(p);
+                        }
+                    }
+                    if (free_ports.size()>=c.uops) {
+                        ports.assign(free_ports.begin(), free_ports.end());
+                        ports.resize(c.uops);
+                    } else
+                    if (!used_ports.empty()) {
+                        ready=false;
+                    }
+
+                    const string& memory_ports=(c.memory_write)? uarch.store_ports : uarch.load_ports;
+                    if (ready && (c.memory_read || c.memory_write)) {
+                        char memory_port=0;
+                        for (char p : memory_ports) {
+                            if (!used_ports.count(p)) {
+                                memory_port=p;
+                                break;
+                            }
+                        }
+                        if (memory_port==0) {
+                            ready=false;
+                        } else {
+                            ports.push_back(memory_port);
+                        }
+                    }
+                }
+
+                if (keep_order) {
+                    if (ready) {
+                        best=x;
+                        best_ports=ports;
+                    }
+                    break;
+                }
+
+                if (ready && (best==-1 || c.height>block[best].height)) {
+                    best=x;
+                    best_ports=ports;
+                }
+            }
+
+            if (best==-1) {
+                break;
+            }
+
+            issued[best]=true;
+            order.push_back(best);
+            --width;
+            for (char p : best_ports) {
+                used_ports.insert(p);
+            }
+            end_cycle=max(end_cycle, cycle+block[best].latency);
+            for (pair<int, int> s : block[best].successors) {
+                --num_predecessors[s.first];
+                earliest[s.first]=max(earliest[s.first], cycle+s.second);
+            }
+        }
+
+        ++cycle;
+    }
+
+    return max(cycle, end_cycle);
+}
+
+//reorders res_text. returns the estimated cycles of all of the blocks before and after
+pair<int, int> schedule_res_text(vector<vector<string>>& res_text, const schedule_uarch_table& uarch) {
+    pair<int, int> res(0, 0);
+
+    int start=0;
+    while (start<res_text.size()) {
+        vector<schedule_instruction> block;
+        int end=start;
+        while (end<res_text.size()) {
+            schedule_instruction c;
+            if (!schedule_parse(res_text[end].at(1), uarch, c)) {
+                break;
+            }
+            c.index=block.size();
+            block.push_back(c);
+            ++end;
+        }
+
+        if (block.size()>=2) {
+            //dependencies, in program order
+            vector<int> last_write(schedule_num_resources, -1);
+            vector<vector<int>> reads_since_write(schedule_num_resources);
+            auto add_edge=[&](int from, int to, int latency) {
+                if (from==-1 || from==to) {
+                    return;
+                }
+                block[from].successors.emplace_back(to, latency);
+                ++block[to].num_predecessors;
+            };
+
+            for (int x=0;x<block.size();++x) {
+                schedule_instruction& c=block[x];
+
+                for (int r : c.reads) {
+                    if (last_write[r]!=-1) {
+                        add_edge(last_write[r], x, block[last_write[r]].latency);
+                    }
+                    reads_since_write[r].push_back(x);
+                }
+                for (int r : c.writes) {
+                    add_edge(last_write[r], x, 0);
+                    for (int y : reads_since_write[r]) {
+                        add_edge(y, x, 0);
+                    }
+                    reads_since_write[r].clear();
+                    last_write[r]=x;
+                }
+
+                if (c.memory_read || c.memory_write) {
+                    for (int y=0;y<x;++y) {
+                        const schedule_instruction& p=block[y];
+                        if ((p.memory_read || p.memory_write) && schedule_memory_ordered(p, c)) {
+                            add_edge(y, x, (p.memory_write && c.memory_read)? 1 : 0);
+                        }
+                    }
+                }
+            }
+
+            for (int x=block.size()-1;x>=0;--x) {
+                schedule_instruction& c=block[x];
+                c.height=c.latency;
+                for (pair<int, int> s : c.successors) {
+                    c.height=max(c.height, s.second+block[s.first].height);
+                }
+            }
+
+            vector<int> order;
+            res.first+=schedule_block(block, uarch, true, order);
+            res.second+=schedule_block(block, uarch, false, order);
+
+            vector<vector<string>> text(res_text.begin()+start, res_text.begin()+end);
+            for (int x=0;x<order.size();++x) {
+                res_text[start+x]=text.at(order[x]);
+            }
+        }
+
+        start=max(end, start+1);
+    }
+
+    return res;
+}
+
+//applies the pass to everything appended so far if schedule_uarch is set
+void schedule_asm() {
+    if (schedule_uarch.empty()) {
+        return;
+    }
+
+    for (const schedule_uarch_table& uarch : schedule_uarch_tables) {
+        if (uarch.name==schedule_uarch) {
+            pair<int, int> cycles=schedule_res_text(m.res_text, uarch);
+            cerr << "Scheduled for " << uarch.name << ": " << cycles.first << " -> " << cycles.second
+                 << " estimated in-order cycles over all blocks\n";
+            return;
+        }
+    }
+    assert(false);
+}
+
+
+}
+
+// end Headerguard ASM_SCHEDULE_H
+#endif
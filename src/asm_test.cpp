@@ -0,0 +1,656 @@
+// Runs each build of the generated gcd kernels (cel, avx2) and the avx512 integer kernels on
+// random and adversarial inputs, checks every result against the C++ code they were generated
+// from (or against GMP) and reports the cycles per call.
+#include "vdf.h"
+
+#include <unistd.h>
+
+int segments = 7;
+int thread_count = 3;
+int gcd_base_bits=cel_gcd_base_bits;
+int gcd_128_max_iter=cel_gcd_128_max_iter;
+
+int num_cases = 2000;
+std::string filter;
+bool verbose = false;
+// Each timed call is the fastest of this many runs on the same input.
+const int timing_reps = 8;
+// Mismatches printed per kernel, unless verbose.
+const int max_printed = 5;
+
+typedef fixed_integer<uint64, gcd_size> gcd_int;
+
+// One build of the gcd kernels. compile_asm builds each with its own parameters, which the C++
+// references read from the same globals at run time.
+struct KernelVariant {
+    const char* name;
+    int gcd_base_bits;
+    int gcd_128_max_iter;
+    // gcd_128 then finds its quotients with the divide table instead of gcd_base, so it can group
+    // them differently from the C++ gcd_128; its results are checked for validity instead.
+    bool divide_table;
+    int (*gcd_base)(double*, double*, double*, uint64*, double*, uint64*);
+    int (*gcd_128)(asm_code::asm_func_gcd_128_data*);
+    int (*gcd_unsigned)(asm_code::asm_func_gcd_unsigned_data*);
+};
+
+const KernelVariant variants[] = {
+    {"cel", cel_gcd_base_bits, cel_gcd_128_max_iter, false,
+     asm_code::asm_cel_func_gcd_base, asm_code::asm_cel_func_gcd_128, asm_code::asm_cel_func_gcd_unsigned},
+    {"avx2", avx2_gcd_base_bits, avx2_gcd_128_max_iter, true,
+     asm_code::asm_avx2_func_gcd_base, asm_code::asm_avx2_func_gcd_128, asm_code::asm_avx2_func_gcd_unsigned},
+};
+
+struct KernelStats {
+    std::string kernel;
+    std::string variant;
+    int cases = 0;
+    // Wrong results. 'differs' counts results that are valid but not the reference's.
+    int mismatches = 0;
+    int differs = 0;
+    // Calls that returned no result, which the callers handle by falling back to the C++ code.
+    int gave_up = 0;
+    std::vector<uint64> cycles;
+
+    void Mismatch(const std::string& input) {
+        if (verbose || mismatches < max_printed)
+            printf("MISMATCH %s/%s: %s\n", kernel.c_str(), variant.c_str(), input.c_str());
+        mismatches++;
+    }
+};
+
+std::vector<KernelStats> all_stats;
+
+bool Selected(const std::string& kernel) {
+    return filter.empty() || kernel.find(filter) != std::string::npos;
+}
+
+// The references print when they fall back to slower paths; that is expected here.
+struct QuietStderr {
+    std::streambuf* old;
+    QuietStderr() : old(std::cerr.rdbuf(nullptr)) {}
+    ~QuietStderr() {
+        std::cerr.rdbuf(old);
+        std::cerr.clear();
+    }
+};
+
+uint64 CounterOverhead() {
+    uint64 best = ~0ull;
+    for (int i = 0; i < 1000; i++) {
+        uint64 start = get_time_cycles();
+        best = std::min(best, get_time_cycles() - start);
+    }
+    return best;
+}
+
+uint64 counter_overhead;
+
+template<class func_type> uint64 MinCycles(func_type call) {
+    uint64 best = ~0ull;
+    for (int i = 0; i < timing_reps; i++) {
+        uint64 start = get_time_cycles();
+        call();
+        best = std::min(best, get_time_cycles() - start);
+    }
+    return best > counter_overhead ? best - counter_overhead : 0;
+}
+
+uint64 RandomWord(int bits) {
+    return mpz_get_ui(rand_integer(bits).impl);
+}
+
+// Uniform below 2^bits with the top bit set.
+integer RandomBits(int bits) {
+    return (integer(1) << (bits - 1)) + rand_integer(bits - 1);
+}
+
+// Uniform in [0, bound).
+integer RandomBelow(const integer& bound) {
+    return rand_integer(bound.num_bits() + 64) % bound;
+}
+
+integer ToInteger(uint128 v) {
+    return integer(std::vector<uint64>{uint64(v), uint64(v >> 64)});
+}
+
+uint128 ToUint128(const integer& v) {
+    std::vector<uint64> limbs = v.to_vector();
+    limbs.resize(2, 0);
+    return uint128(limbs[0]) | (uint128(limbs[1]) << 64);
+}
+
+// The largest consecutive Fibonacci numbers below 2^bits; every quotient is 1.
+std::pair<integer, integer> Fibonacci(int bits) {
+    integer a(1), b(1);
+    while ((a + b).num_bits() <= bits) {
+        integer c = a + b;
+        b = a;
+        a = c;
+    }
+    return {a, b};
+}
+
+std::string Describe(const std::string& label, std::initializer_list<integer> values) {
+    std::string res = label + ":";
+    for (const integer& v : values)
+        res += " " + v.to_string();
+    return res;
+}
+
+//
+// gcd_base: a few continued fraction steps on doubles.
+//
+
+struct GcdBaseInput {
+    std::string label;
+    double a, b, threshold;
+    bool is_lehmer;
+};
+
+std::vector<GcdBaseInput> GcdBaseInputs(int bits) {
+    std::vector<GcdBaseInput> res;
+    auto add = [&](std::string label, integer a, integer b, integer threshold) {
+        for (bool is_lehmer : {false, true}) {
+            double a_double = mpz_get_d(a.impl), b_double = mpz_get_d(b.impl);
+            res.push_back({label, std::max(a_double, b_double), std::min(a_double, b_double),
+                           mpz_get_d(threshold.impl), is_lehmer});
+        }
+    };
+    integer top = integer(1) << (bits - 1);
+    auto fib = Fibonacci(bits);
+    add("fibonacci", fib.first, fib.second, integer(0));
+    add("large quotient", top + integer(12345), integer(3), integer(0));
+    add("a==b", top + integer(1), top + integer(1), integer(0));
+    add("b==0", top, integer(0), integer(0));
+    add("b==threshold+1", top, integer(1000001), integer(1000000));
+    add("b==threshold", top, integer(1000000), integer(1000000));
+    add("all ones", (top << 1) - integer(1), (top << 1) - integer(2), integer(0));
+    add("top bit", top, top - integer(1), integer(0));
+    for (int i = 0; i < num_cases; i++) {
+        integer a = RandomBits(1 + RandomWord(20) % bits);
+        integer b = RandomBelow(a + integer(1));
+        integer threshold = RandomWord(1) ? RandomBelow(b + integer(1)) : integer(0);
+        double a_double = mpz_get_d(a.impl);
+        res.push_back({"random", a_double, std::min(a_double, mpz_get_d(b.impl)),
+                       mpz_get_d(threshold.impl), bool(RandomWord(1))});
+    }
+    return res;
+}
+
+void TestGcdBase(const KernelVariant& variant) {
+    KernelStats stats{"gcd_base", variant.name};
+    for (const GcdBaseInput& in : GcdBaseInputs(variant.gcd_base_bits)) {
+        vector2 ab{in.a, in.b};
+        matrix2 uv;
+        bool progress;
+        {
+            QuietStderr quiet;
+            progress = gcd_base_continued_fraction(ab, uv, in.is_lehmer, in.threshold);
+        }
+
+        double asm_ab[2], asm_u[2], asm_v[2], asm_threshold[2];
+        uint64 asm_is_lehmer[2], asm_no_progress;
+        int error_code;
+        auto call = [&]() {
+            asm_ab[0] = in.a;
+            asm_ab[1] = in.b;
+            asm_is_lehmer[0] = asm_is_lehmer[1] = in.is_lehmer ? ~0ull : 0ull;
+            asm_threshold[0] = asm_threshold[1] = in.threshold;
+            error_code = variant.gcd_base(asm_ab, asm_u, asm_v, asm_is_lehmer, asm_threshold, &asm_no_progress);
+        };
+        stats.cycles.push_back(MinCycles(call));
+        stats.cases++;
+
+        if (error_code != 0 || asm_ab[0] != ab[0] || asm_ab[1] != ab[1] ||
+            asm_u[0] != uv[0][0] || asm_u[1] != uv[1][0] || asm_v[0] != uv[0][1] || asm_v[1] != uv[1][1] ||
+            asm_no_progress != uint64(!progress)) {
+            std::ostringstream out;
+            out.precision(17);
+            out << in.label << ": a=" << in.a << " b=" << in.b << " threshold=" << in.threshold
+                << " is_lehmer=" << in.is_lehmer;
+            stats.Mismatch(out.str());
+        }
+    }
+    all_stats.push_back(stats);
+}
+
+//
+// gcd_128: gcd_base applied repeatedly to the top bits of two 128 bit numbers.
+//
+
+struct Gcd128Input {
+    std::string label;
+    uint128 a, b, threshold;
+    bool is_lehmer;
+};
+
+std::vector<Gcd128Input> Gcd128Inputs() {
+    std::vector<Gcd128Input> res;
+    auto add = [&](std::string label, integer a, integer b, integer threshold) {
+        for (bool is_lehmer : {false, true}) {
+            // gcd_unsigned only asks for lehmer steps on a full 128 bit head.
+            if (is_lehmer && a.num_bits() != 128)
+                continue;
+            res.push_back({label, ToUint128(a), ToUint128(b), ToUint128(threshold), is_lehmer});
+        }
+    };
+    integer top = integer(1) << 127;
+    auto fib = Fibonacci(128);
+    add("fibonacci", fib.first, fib.second, integer(0));
+    add("fibonacci 64", Fibonacci(64).first, Fibonacci(64).second, integer(0));
+    add("large quotient", top + integer(12345), integer(5), integer(0));
+    add("large quotient 64", top + integer(12345), (integer(1) << 64) + integer(1), integer(0));
+    add("a==b", top + integer(1), top + integer(1), integer(0));
+    add("b==0", top, integer(0), integer(0));
+    add("b==threshold+1", top, (integer(1) << 64) + integer(1), integer(1) << 64);
+    add("b==threshold", top, integer(1) << 64, integer(1) << 64);
+    add("all ones", (top << 1) - integer(1), (top << 1) - integer(2), integer(0));
+    add("top bit", top, top - integer(1), integer(0));
+    add("small", integer(7), integer(3), integer(0));
+    for (int i = 0; i < num_cases; i++) {
+        bool is_lehmer = RandomWord(1);
+        integer a = RandomBits(is_lehmer ? 128 : 1 + RandomWord(20) % 128);
+        integer b = RandomBelow(a + integer(1));
+        integer threshold = RandomWord(1) ? RandomBits(1 + RandomWord(20) % a.num_bits()) : integer(0);
+        if (threshold >= a)
+            threshold = integer(0);
+        res.push_back({"random", ToUint128(a), ToUint128(b), ToUint128(threshold), is_lehmer});
+    }
+    return res;
+}
+
+// The conditions the C++ gcd_128 checks before accepting a matrix: it has determinant 1 if even
+// and -1 if odd, takes ab to a pair with a>=b>=0 and a above the threshold, and for lehmer inputs
+// passes the Jebelean test.
+bool Gcd128ResultValid(const Gcd128Input& in, const asm_code::asm_func_gcd_128_data& out) {
+    integer u0 = ToInteger(out.u_0), u1 = ToInteger(out.u_1), v0 = ToInteger(out.v_0), v1 = ToInteger(out.v_1);
+    if (out.no_progress)
+        return out.u_0 == 1 && out.v_0 == 0 && out.u_1 == 0 && out.v_1 == 1 && out.parity == 0;
+    if (out.parity > 1)
+        return false;
+    bool even = out.parity == 0;
+    integer a = ToInteger(in.a), b = ToInteger(in.b);
+    integer a_new = even ? u0 * a - v0 * b : v0 * b - u0 * a;
+    integer b_new = even ? v1 * b - u1 * a : u1 * a - v1 * b;
+    if (u0 * v1 - v0 * u1 != integer(even ? 1 : -1))
+        return false;
+    if (!(b_new >= integer(0) && a_new >= b_new && a_new > ToInteger(in.threshold)))
+        return false;
+    if (in.is_lehmer) {
+        if (even)
+            return b_new >= u1 && a_new - b_new >= v1 + v0;
+        return b_new >= v1 && a_new - b_new >= u1 + u0;
+    }
+    return true;
+}
+
+void TestGcd128(const KernelVariant& variant) {
+    KernelStats stats{"gcd_128", variant.name};
+    for (const Gcd128Input& in : Gcd128Inputs()) {
+        array<uint128, 2> ab{in.a, in.b};
+        array<array<uint64, 2>, 2> uv;
+        int parity;
+        bool progress;
+        {
+            QuietStderr quiet;
+            progress = gcd_128(ab, uv, parity, in.is_lehmer, in.threshold);
+        }
+
+        asm_code::asm_func_gcd_128_data data;
+        int error_code;
+        auto call = [&]() {
+            data.ab_start_0_0 = uint64(in.a);
+            data.ab_start_0_8 = uint64(in.a >> 64);
+            data.ab_start_1_0 = uint64(in.b);
+            data.ab_start_1_8 = uint64(in.b >> 64);
+            data.is_lehmer = uint64(in.is_lehmer);
+            data.ab_threshold_0 = uint64(in.threshold);
+            data.ab_threshold_8 = uint64(in.threshold >> 64);
+            error_code = variant.gcd_128(&data);
+        };
+        stats.cycles.push_back(MinCycles(call));
+        stats.cases++;
+
+        bool same = error_code == 0 && data.u_0 == uv[0][0] && data.u_1 == uv[1][0] && data.v_0 == uv[0][1] &&
+                    data.v_1 == uv[1][1] && data.parity == uint64(parity) && data.no_progress == uint64(!progress);
+        if (same)
+            continue;
+        if (error_code == 0 && variant.divide_table && Gcd128ResultValid(in, data)) {
+            stats.differs++;
+            continue;
+        }
+        stats.Mismatch(Describe(in.label + (in.is_lehmer ? " (lehmer)" : ""),
+                                {ToInteger(in.a), ToInteger(in.b), ToInteger(in.threshold)}));
+    }
+    all_stats.push_back(stats);
+}
+
+//
+// gcd_unsigned: a partial gcd of multi-limb numbers, stopping at the first remainder not above
+// the threshold. The matrices it outputs are replayed here, so any grouping of the quotients
+// has to land on the same remainders and cofactors as the C++ code.
+//
+
+struct GcdUnsignedInput {
+    std::string label;
+    integer a, b, threshold;
+};
+
+std::vector<GcdUnsignedInput> GcdUnsignedInputs() {
+    // Enough headroom that the cofactors fit in gcd_size limbs.
+    const int max_bits = 64 * gcd_size - 256;
+    std::vector<GcdUnsignedInput> res;
+    integer top = integer(1) << (max_bits - 1);
+    auto fib = Fibonacci(max_bits);
+    res.push_back({"fibonacci", fib.first, fib.second, integer(0)});
+    res.push_back({"fibonacci to half", fib.first, fib.second, root(fib.first, 2)});
+    res.push_back({"large quotient", (integer(12345) << 600) + integer(6789), integer(12345), integer(0)});
+    res.push_back({"large quotient 2", top + integer(1), (integer(1) << 200) + integer(3), integer(1) << 100});
+    res.push_back({"a==b", top + integer(1), top + integer(1), integer(1) << 100});
+    res.push_back({"b==threshold+1", top, (integer(1) << 300) + integer(1), integer(1) << 300});
+    res.push_back({"b==threshold", top, integer(1) << 300, integer(1) << 300});
+    res.push_back({"threshold==a-1", top, top - integer(1), top - integer(1)});
+    res.push_back({"all ones", (top << 1) - integer(1), top - integer(1), integer(0)});
+    res.push_back({"top bit", top, top - integer(1), integer(0)});
+    res.push_back({"one limb", integer(1000003), integer(999983), integer(0)});
+    res.push_back({"two limbs", RandomBits(128), RandomBits(127), integer(0)});
+    for (int i = 0; i < num_cases; i++) {
+        integer a = RandomBits(1 + RandomWord(20) % max_bits);
+        integer b = RandomBelow(a + integer(1));
+        // Usually about the square root, as in the reductions.
+        integer threshold = RandomWord(2) ? root(a, 2) : RandomBelow(a);
+        res.push_back({"random", a, b, threshold});
+    }
+    return res;
+}
+
+void TestGcdUnsigned(const KernelVariant& variant) {
+    KernelStats stats{"gcd_unsigned", variant.name};
+    for (const GcdUnsignedInput& in : GcdUnsignedInputs()) {
+        array<gcd_int, 2> ab{gcd_int(in.a), gcd_int(in.b)};
+        array<gcd_int, 2> uv{gcd_int(integer(1)), gcd_int(integer(0))};
+        int parity = 1;
+        {
+            QuietStderr quiet;
+            gcd_unsigned(ab, uv, parity, gcd_int(in.threshold));
+        }
+
+        gcd_int asm_a, asm_b, asm_a_2, asm_b_2, asm_threshold(in.threshold);
+        uint64 uv_counter_start = 1234, uv_counter;
+        alignas(64) array<array<uint64, 8>, gcd_max_iterations + 1> asm_uv;
+        asm_code::asm_func_gcd_unsigned_data data;
+        int error_code;
+        auto call = [&]() {
+            asm_a = gcd_int(in.a);
+            asm_b = gcd_int(in.b);
+            uv_counter = uv_counter_start;
+            data.a = &asm_a[0];
+            data.b = &asm_b[0];
+            data.a_2 = &asm_a_2[0];
+            data.b_2 = &asm_b_2[0];
+            data.threshold = &asm_threshold[0];
+            data.uv_counter_start = uv_counter_start;
+            data.out_uv_counter_addr = &uv_counter;
+            data.out_uv_addr = (uint64*)&asm_uv[1];
+            data.iter = -2;
+            data.a_end_index = (in.a.num_bits() + 63) / 64 - 1;
+            error_code = variant.gcd_unsigned(&data);
+        };
+        stats.cycles.push_back(MinCycles(call));
+        stats.cases++;
+
+        if (error_code != 0) {
+            stats.gave_up++;
+            continue;
+        }
+
+        bool valid = data.iter >= 0 && data.iter <= gcd_max_iterations &&
+                     uv_counter == uv_counter_start + data.iter - 1;
+        integer a = in.a, b = in.b, u0(1), u1(0);
+        int replay_parity = 1;
+        for (int i = 0; valid && i <= data.iter; i++) {
+            const array<uint64, 8>& entry = asm_uv[i];
+            // Entry i-1 holds the exit flag of step i.
+            if (entry[5] != uint64(i == data.iter)) {
+                valid = false;
+                break;
+            }
+            if (i == data.iter)
+                break;
+            const array<uint64, 8>& m = asm_uv[i + 1];
+            if (m[4] > 1) {
+                valid = false;
+                break;
+            }
+            integer m00 = ToInteger(m[0]), m10 = ToInteger(m[1]), m01 = ToInteger(m[2]), m11 = ToInteger(m[3]);
+            bool even = m[4] == 0;
+            integer a_new = even ? m00 * a - m01 * b : m01 * b - m00 * a;
+            integer b_new = even ? m11 * b - m10 * a : m10 * a - m11 * b;
+            a = a_new;
+            b = b_new;
+            integer u0_new = m00 * u0 + m01 * u1;
+            u1 = m10 * u0 + m11 * u1;
+            u0 = u0_new;
+            replay_parity *= even ? 1 : -1;
+        }
+        bool is_even = ((data.iter - 1) & 1) == 0;
+        if (valid) {
+            valid = a == integer(ab[0]) && b == integer(ab[1]) && u0 == integer(uv[0]) && u1 == integer(uv[1]) &&
+                    replay_parity == parity && integer(is_even ? asm_a_2 : asm_a) == a &&
+                    integer(is_even ? asm_b_2 : asm_b) == b;
+        }
+        if (!valid)
+            stats.Mismatch(Describe(in.label, {in.a, in.b, in.threshold}));
+    }
+    all_stats.push_back(stats);
+}
+
+//
+// avx512: conversions and arithmetic on 52 bit limbs, checked against GMP.
+//
+
+template<class intnx> void SetMpz(intnx& out, const integer& v) {
+    mpz_set(out._(), v.impl);
+}
+
+template<class intnx> integer FromMpz(const intnx& v) {
+    integer res;
+    mpz_set(res.impl, v._());
+    return res;
+}
+
+// The values that stress sign handling and carries across the 52 bit limbs come first.
+const int num_avx512_special = 9;
+
+// Signed values of up to 'bits' bits: the special ones, then random ones.
+std::vector<std::pair<std::string, integer>> Avx512Values(int bits) {
+    std::vector<std::pair<std::string, integer>> res;
+    integer ones = (integer(1) << bits) - integer(1);
+    integer limb_ones = (integer(1) << (52 * (bits / 52))) - integer(1);
+    for (auto& v : std::vector<std::pair<std::string, integer>>{
+             {"zero", integer(0)}, {"one", integer(1)}, {"minus one", integer(-1)},
+             {"all ones", ones}, {"minus all ones", -ones},
+             {"top bit", integer(1) << (bits - 1)}, {"minus top bit", -(integer(1) << (bits - 1))},
+             {"52 bit limbs all ones", limb_ones}, {"minus 52 bit limbs all ones", -limb_ones}})
+        res.push_back(v);
+    for (int i = 0; i < num_cases; i++) {
+        integer v = rand_integer(1 + RandomWord(20) % bits);
+        res.push_back({"random", RandomWord(1) ? -v : v});
+    }
+    return res;
+}
+
+template<class intnx, class avx512_intnx> void TestAvx512Convert(const std::string& kernel, int bits) {
+    if (!Selected(kernel))
+        return;
+    KernelStats stats{kernel, "avx512"};
+    for (auto& in : Avx512Values(bits)) {
+        intnx a, out;
+        SetMpz(a, in.second);
+        avx512_intnx a_avx512;
+        stats.cycles.push_back(MinCycles([&]() { a_avx512 = a; }));
+        a_avx512.assign(out);
+        stats.cases++;
+        if (FromMpz(out) != in.second)
+            stats.Mismatch(Describe(in.first, {in.second}));
+    }
+    all_stats.push_back(stats);
+}
+
+template<class intnx, class avx512_intnx> void TestAvx512Add(const std::string& kernel, int bits, bool subtract) {
+    if (!Selected(kernel))
+        return;
+    KernelStats stats{kernel, "avx512"};
+    auto values = Avx512Values(bits);
+    std::vector<std::pair<int, int>> pairs;
+    for (int i = 0; i < num_avx512_special; i++) {
+        for (int j = 0; j < num_avx512_special; j++)
+            pairs.emplace_back(i, j);
+    }
+    for (int i = num_avx512_special; i < values.size(); i++)
+        pairs.emplace_back(i, RandomWord(30) % values.size());
+    for (auto& p : pairs) {
+        auto& x = values[p.first];
+        auto& y = values[p.second];
+        // Also against itself and its negation, which cancel to zero.
+        for (const integer& b : {y.second, x.second, -x.second}) {
+            intnx a_mpz, b_mpz, out;
+            SetMpz(a_mpz, x.second);
+            SetMpz(b_mpz, b);
+            avx512_intnx a_avx512, b_avx512, c_avx512;
+            a_avx512 = a_mpz;
+            b_avx512 = b_mpz;
+            stats.cycles.push_back(MinCycles([&]() {
+                if (subtract)
+                    c_avx512.set_sub(a_avx512, b_avx512);
+                else
+                    c_avx512.set_add(a_avx512, b_avx512);
+            }));
+            c_avx512.assign(out);
+            stats.cases++;
+            if (FromMpz(out) != (subtract ? x.second - b : x.second + b))
+                stats.Mismatch(Describe(x.first + (subtract ? " - " : " + ") + y.first, {x.second, b}));
+        }
+    }
+    all_stats.push_back(stats);
+}
+
+template<class intax, class avx512_intax, int a_bits, class intbx, class avx512_intbx, int b_bits,
+         class intcx, class avx512_intcx>
+void TestAvx512Multiply(const std::string& kernel) {
+    if (!Selected(kernel))
+        return;
+    KernelStats stats{kernel, "avx512"};
+    auto a_values = Avx512Values(a_bits), b_values = Avx512Values(b_bits);
+    for (int i = 0; i < a_values.size(); i++) {
+        auto& x = a_values[i];
+        // Special values meet each other; everything also meets a random value.
+        for (auto* y : {&b_values[i], &b_values[RandomWord(30) % b_values.size()]}) {
+            intax a_mpz;
+            intbx b_mpz;
+            intcx out;
+            SetMpz(a_mpz, x.second);
+            SetMpz(b_mpz, y->second);
+            avx512_intax a_avx512;
+            avx512_intbx b_avx512;
+            avx512_intcx c_avx512;
+            a_avx512 = a_mpz;
+            b_avx512 = b_mpz;
+            stats.cycles.push_back(MinCycles([&]() { c_avx512.set_mul(a_avx512, b_avx512); }));
+            c_avx512.assign(out);
+            stats.cases++;
+            if (FromMpz(out) != x.second * y->second)
+                stats.Mismatch(Describe(x.first + " * " + y->first, {x.second, y->second}));
+        }
+    }
+    all_stats.push_back(stats);
+}
+
+void TestAvx512() {
+    TestAvx512Convert<int1x, avx512_int1x>("avx512_convert_512", 512);
+    TestAvx512Convert<int2x, avx512_int2x>("avx512_convert_1024", 1024);
+    TestAvx512Convert<int3x, avx512_int3x>("avx512_convert_1536", 1536);
+    TestAvx512Convert<int4x, avx512_int4x>("avx512_convert_2048", 2048);
+    TestAvx512Add<int1x, avx512_int1x>("avx512_add_512", 511, false);
+    TestAvx512Add<int2x, avx512_int2x>("avx512_add_1024", 1023, false);
+    TestAvx512Add<int4x, avx512_int4x>("avx512_add_2048", 2047, false);
+    TestAvx512Add<int2x, avx512_int2x>("avx512_sub_1024", 1023, true);
+    TestAvx512Multiply<int1x, avx512_int1x, 512, int1x, avx512_int1x, 512, int2x, avx512_int2x>("avx512_mul_512x512");
+    TestAvx512Multiply<int1x, avx512_int1x, 512, int2x, avx512_int2x, 1024, int3x, avx512_int3x>("avx512_mul_512x1024");
+    TestAvx512Multiply<int2x, avx512_int2x, 1024, int2x, avx512_int2x, 1024, int4x, avx512_int4x>("avx512_mul_1024x1024");
+}
+
+//
+//
+
+uint64 Median(std::vector<uint64> v) {
+    if (v.empty())
+        return 0;
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+}
+
+static void usage(const char* progname) {
+    fprintf(stderr, "Usage: %s [-n RANDOM_CASES] [-s SEED] [-f KERNEL_FILTER] [-v]\n", progname);
+}
+
+int main(int argc, char** argv) {
+    init_gmp();
+    allow_integer_constructor=true; //make sure the old gmp allocator isn't used
+    set_rounding_mode();
+
+    int seed = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:f:v")) != -1) {
+        switch (opt) {
+            case 'n': num_cases = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'v': verbose = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    rand_integer(0, seed);
+    counter_overhead = CounterOverhead();
+
+    std::vector<std::string> skipped;
+    for (const KernelVariant& variant : variants) {
+        if (!strcmp(variant.name, "avx2") && !hasAVX2()) {
+            skipped.push_back("avx2 gcd kernels (no AVX2)");
+            continue;
+        }
+        gcd_base_bits = variant.gcd_base_bits;
+        gcd_128_max_iter = variant.gcd_128_max_iter;
+        if (Selected("gcd_base"))
+            TestGcdBase(variant);
+        if (Selected("gcd_128"))
+            TestGcd128(variant);
+        if (Selected("gcd_unsigned"))
+            TestGcdUnsigned(variant);
+    }
+    if (__builtin_cpu_supports("avx512ifma"))
+        TestAvx512();
+    else
+        skipped.push_back("avx512 kernels (no AVX-512 IFMA)");
+
+    int mismatches = 0;
+    printf("%-22s %-8s %8s %9s %8s %8s %14s %14s\n", "kernel", "variant", "cases", "mismatch", "differs",
+           "gave_up", "cycles median", "cycles mean");
+    for (KernelStats& stats : all_stats) {
+        uint64 total = 0;
+        for (uint64 c : stats.cycles)
+            total += c;
+        printf("%-22s %-8s %8d %9d %8d %8d %14llu %14.1f\n", stats.kernel.c_str(), stats.variant.c_str(),
+               stats.cases, stats.mismatches, stats.differs, stats.gave_up,
+               (unsigned long long)Median(stats.cycles), stats.cycles.empty() ? 0.0 : double(total) / stats.cycles.size());
+        mismatches += stats.mismatches;
+    }
+    for (const std::string& s : skipped)
+        printf("skipped: %s\n", s.c_str());
+    if (mismatches > 0) {
+        printf("%d mismatches\n", mismatches);
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+# Tunes the gcd parameters of parameters.h for this machine. Each candidate is built in a scratch
+# copy of this directory (compile_asm regenerates the asm with it), timed with
+# `vdf_bench square_asm`, and must reach the same form as the defaults. The parameters of the
+# kernels this CPU runs are swept one at a time, keeping the fastest value, until a pass changes
+# nothing. The winner is checked with asm_test and written to tuned_parameters.h, which
+# parameters.h picks up; rebuild afterwards (make -f Makefile.vdf-client clean all).
+
+import argparse
+import datetime
+import os
+import platform
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+
+SRC_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# The macros each build of the kernels depends on, and the values tried for each. The avx2 build
+# finds its quotients with the divide table, so the continued fraction table doesn't matter there.
+PARAMETERS = {
+    "cel": [
+        ("CEL_GCD_BASE_BITS", range(44, 54)),
+        ("GCD_BASE_MAX_ITER", range(3, 9)),
+        ("CEL_GCD_128_MAX_ITER", range(2, 6)),
+        ("GCD_TABLE_NUM_EXPONENT_BITS", range(2, 5)),
+        ("GCD_TABLE_NUM_FRACTION_BITS", range(6, 12)),
+    ],
+    "avx2": [
+        ("AVX2_GCD_BASE_BITS", range(56, 64)),
+        ("AVX2_GCD_128_MAX_ITER", range(1, 5)),
+        ("DIVIDE_TABLE_INDEX_BITS", range(9, 14)),
+        ("GCD_BASE_MAX_ITER_DIVIDE_TABLE", range(12, 21)),
+    ],
+}
+
+
+def defaults():
+    with open(os.path.join(SRC_DIR, "parameters.h")) as f:
+        text = f.read()
+    return {name: int(value) for name, value in re.findall(r"#define (\w+) (\d+)\n", text)}
+
+
+def cpu_flags():
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("flags"):
+                    return set(line.split(":")[1].split())
+    except OSError:
+        pass
+    try:
+        out = subprocess.check_output(["sysctl", "-n", "machdep.cpu.leaf7_features"], text=True)
+        return set(out.lower().split())
+    except (OSError, subprocess.CalledProcessError):
+        return set()
+
+
+def cpu_model():
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    return line.split(":")[1].strip()
+    except OSError:
+        pass
+    return platform.processor() or "unknown CPU"
+
+
+# Same test as hasAVX2() in parameters.h.
+def detect_variant():
+    flags = cpu_flags()
+    return "avx2" if "avx2" in flags and "adx" in flags else "cel"
+
+
+class Tuner:
+    def __init__(self, args, variant):
+        self.args = args
+        self.variant = variant
+        self.results = {}
+        self.reference_form = None
+        self.scratch = tempfile.mkdtemp(prefix="chiavdf_autotune_")
+        self.build_dir = os.path.join(self.scratch, "src")
+        shutil.copytree(SRC_DIR, self.build_dir, ignore=shutil.ignore_patterns(
+            "*.o", "*.s", "tuned_parameters.h", "compile_asm", "vdf_client", "vdf_bench", "asm_test"))
+
+    def close(self):
+        shutil.rmtree(self.scratch, ignore_errors=True)
+
+    def build(self, config, targets):
+        with open(os.path.join(self.build_dir, "tuned_parameters.h"), "w") as f:
+            f.write(header(config))
+        for name in os.listdir(self.build_dir):
+            if (name.endswith(".o") and name != "lzcnt.o") or name.endswith(".s") or name in targets + ["compile_asm"]:
+                os.remove(os.path.join(self.build_dir, name))
+        proc = subprocess.run(["make", "-f", "Makefile.vdf-client", "-j", str(self.args.jobs)] + targets,
+                              cwd=self.build_dir, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+        return proc.returncode == 0
+
+    def pin(self):
+        if self.args.cpus and hasattr(os, "sched_setaffinity"):
+            os.sched_setaffinity(0, [int(c) for c in self.args.cpus.split(",")])
+
+    # Median iterations per second, or None if the build or a run fails or ends on another form.
+    def measure(self, config):
+        key = tuple(sorted(config.items()))
+        if key in self.results:
+            return self.results[key]
+        ips = None
+        if self.build(config, ["vdf_bench"]):
+            runs = []
+            for _ in range(self.args.runs):
+                try:
+                    proc = subprocess.run(["./vdf_bench", "square_asm", str(self.args.iters)], cwd=self.build_dir,
+                                          stdout=subprocess.PIPE, text=True, timeout=self.args.timeout,
+                                          preexec_fn=self.pin)
+                except subprocess.TimeoutExpired:
+                    break
+                ms = re.search(r"Time: (\d+) ms", proc.stdout)
+                form = re.findall(r"^[abc] = (\S+)$", proc.stdout, re.M)
+                if proc.returncode != 0 or not ms or len(form) != 3:
+                    break
+                if self.reference_form is None:
+                    self.reference_form = form
+                if form != self.reference_form:
+                    break
+                runs.append(self.args.iters * 1000.0 / max(int(ms.group(1)), 1))
+            if len(runs) == self.args.runs:
+                ips = statistics.median(runs)
+        self.results[key] = ips
+        print("  %-60s %s" % (describe(config), "%.0f ips" % ips if ips else "failed"), flush=True)
+        return ips
+
+    def check(self, config):
+        if not self.build(config, ["asm_test"]):
+            return False
+        return subprocess.run(["./asm_test", "-n", "300"], cwd=self.build_dir,
+                              stdout=subprocess.DEVNULL).returncode == 0
+
+
+def describe(config):
+    return " ".join("%s=%d" % (name, value) for name, value in config.items())
+
+
+def header(config, comment=""):
+    lines = [comment] if comment else []
+    lines += ["#define %s %d" % (name, value) for name, value in config.items()]
+    return "\n".join(lines) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Tune the gcd parameters for this machine.")
+    parser.add_argument("--variant", choices=["auto", "cel", "avx2"], default="auto",
+                        help="kernels to tune (default: the ones this CPU runs; the others aren't timed)")
+    parser.add_argument("--iters", type=int, default=200000, help="squarings per timed run")
+    parser.add_argument("--runs", type=int, default=3, help="timed runs per candidate; the median counts")
+    parser.add_argument("--passes", type=int, default=3, help="most sweeps over all the parameters")
+    parser.add_argument("--min-gain", type=float, default=0.5,
+                        help="percent a value has to be faster by to replace the current one (run to run noise)")
+    parser.add_argument("--cpus", help="comma separated CPUs to run the benchmark on")
+    parser.add_argument("--jobs", type=int, default=os.cpu_count() or 1, help="parallel build jobs")
+    parser.add_argument("--timeout", type=int, default=120, help="seconds before a run counts as failed")
+    parser.add_argument("--output", default=os.path.join(SRC_DIR, "tuned_parameters.h"))
+    args = parser.parse_args()
+
+    variant = detect_variant() if args.variant == "auto" else args.variant
+    names = [name for name, _ in PARAMETERS[variant]]
+    config = {name: value for name, value in defaults().items() if name in names}
+
+    tuner = Tuner(args, variant)
+    try:
+        print("Tuning the %s kernels on %s" % (variant, cpu_model()), flush=True)
+        baseline = tuner.measure(config)
+        if baseline is None:
+            print("vdf_bench doesn't build or run with the defaults")
+            return 1
+        best = baseline
+        for _ in range(args.passes):
+            changed = False
+            for name, values in PARAMETERS[variant]:
+                for value in values:
+                    if value == config[name]:
+                        continue
+                    ips = tuner.measure(dict(config, **{name: value}))
+                    if ips and ips > best * (1 + args.min_gain / 100.0):
+                        config[name] = value
+                        best = ips
+                        changed = True
+            if not changed:
+                break
+
+        print("Defaults: %.0f ips; tuned: %.0f ips (%+.1f%%) with %s" %
+              (baseline, best, 100.0 * (best / baseline - 1), describe(config)))
+        if not tuner.check(config):
+            print("asm_test fails with the tuned parameters; not writing %s" % args.output)
+            return 2
+        comment = ("// Written by autotune.py on %s for the %s kernels on %s.\n"
+                   "// vdf_bench square_asm: %.0f ips with the defaults, %.0f ips with these." %
+                   (datetime.date.today().isoformat(), variant, cpu_model(), baseline, best))
+        with open(args.output, "w") as f:
+            f.write(header(config, comment))
+        print("Wrote %s; rebuild with make -f Makefile.vdf-client clean all" % args.output)
+        return 0
+    finally:
+        tuner.close()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -2,6 +2,7 @@
 #define CALLBACK_H
 
 #include "util.h"
+#include "metrics.h"
 
 // Applies to n-weso.
 const int kWindowSize = 20;
@@ -20,6 +21,7 @@ public:
     }
 
     virtual ~WesolowskiCallback() {
+        StopStoreThread();
         delete(vdfo);
         delete(reducer);
     }
@@ -60,23 +62,153 @@ public:
         }
     }
 
+    // Same as SetForm, but once StartStoreThread() was called it only copies the limbs of a and b
+    // into a ring; c and the reduction are done by the store thread. Keeps GMP work and allocations
+    // off the squaring thread.
+    void StoreForm(int type, void *data, form* mulf) {
+        if (store_thread == NULL) {
+            SetForm(type, data, mulf);
+            return ;
+        }
+        const mpz_struct* a;
+        const mpz_struct* b;
+        if (type == NL_SQUARESTATE) {
+            square_state_type *square_state=(square_state_type *)data;
+            if (square_state->phase_start.corruption_flag) {
+                // Let SetForm report it.
+                WaitForStoredForms();
+                SetForm(type, data, mulf);
+                return ;
+            }
+            a = square_state->phase_start.a()._();
+            b = square_state->phase_start.b()._();
+        } else {
+            vdf_original::form *f=(vdf_original::form *)data;
+            a = f->a;
+            b = f->b;
+        }
+
+        FormSnapshot* snapshot = snapshots.Reserve();
+        if (snapshot == NULL || abs(a->_mp_size) > kSnapshotLimbs || abs(b->_mp_size) > kSnapshotLimbs) {
+            // Older snapshots might target the same form, so they have to land first.
+            WaitForStoredForms();
+            SetForm(type, data, mulf);
+            return ;
+        }
+        snapshot->target = mulf;
+        snapshot->a_size = a->_mp_size;
+        snapshot->b_size = b->_mp_size;
+        memcpy(snapshot->a, a->_mp_d, abs(a->_mp_size) * sizeof(mp_limb_t));
+        memcpy(snapshot->b, b->_mp_d, abs(b->_mp_size) * sizeof(mp_limb_t));
+        snapshots.Push();
+        // Pairs with the fence in StoreThread: either it sees the new snapshot before going to
+        // sleep, or we see it waiting and wake it up.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (store_thread_waiting.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lk(store_mutex);
+            store_cv.notify_one();
+        }
+    }
+
+    void StartStoreThread() {
+        store_thread = new std::thread([=] { StoreThread(); });
+    }
+
+    // Stops and joins the store thread, dropping the snapshots it didn't get to. Derived classes
+    // call it before freeing the forms the snapshots point into.
+    void StopStoreThread() {
+        if (store_thread == NULL)
+            return ;
+        {
+            std::lock_guard<std::mutex> lk(store_mutex);
+            store_thread_stopped = true;
+        }
+        store_cv.notify_one();
+        store_thread->join();
+        delete(store_thread);
+        store_thread = NULL;
+    }
+
+    // Must be called by the squaring thread before publishing 'iterations', so readers only
+    // see forms that are fully written.
+    void WaitForStoredForms() {
+        while (!snapshots.Empty()) {
+            std::this_thread::yield();
+        }
+    }
+
     virtual void OnIteration(int type, void *data, uint64_t iteration) = 0;
 
     form* forms;
+    // RAM taken by 'forms' (and the checkpoints), as counted in vdf_metrics.
+    int64_t store_bytes = 0;
     int64_t iterations = 0;
     integer D;
     integer L;
     PulmarkReducer* reducer;
     vdf_original* vdfo;
+
+  private:
+    // Big enough for a and b of a 2048 bit discriminant (int2x).
+    static const int kSnapshotLimbs = 24;
+
+    struct FormSnapshot {
+        form* target;
+        // Signed limb counts, like mpz_struct._mp_size.
+        int a_size;
+        int b_size;
+        mp_limb_t a[kSnapshotLimbs];
+        mp_limb_t b[kSnapshotLimbs];
+    };
+
+    void StoreThread() {
+        PulmarkReducer store_reducer;
+        integer a_4;
+        integer remainder;
+        while (!store_thread_stopped) {
+            FormSnapshot* snapshot = snapshots.Front();
+            if (snapshot == NULL) {
+                std::unique_lock<std::mutex> lk(store_mutex);
+                store_thread_waiting.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                store_cv.wait(lk, [&] { return store_thread_stopped || snapshots.Front() != NULL; });
+                store_thread_waiting.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            form* f = snapshot->target;
+            memcpy(mpz_limbs_write(f->a.impl, abs(snapshot->a_size) + 1), snapshot->a, abs(snapshot->a_size) * sizeof(mp_limb_t));
+            mpz_limbs_finish(f->a.impl, snapshot->a_size);
+            memcpy(mpz_limbs_write(f->b.impl, abs(snapshot->b_size) + 1), snapshot->b, abs(snapshot->b_size) * sizeof(mp_limb_t));
+            mpz_limbs_finish(f->b.impl, snapshot->b_size);
+
+            // c = (b^2 - D) / 4a
+            mpz_mul(f->c.impl, f->b.impl, f->b.impl);
+            mpz_sub(f->c.impl, f->c.impl, D.impl);
+            mpz_mul_2exp(a_4.impl, f->a.impl, 2);
+            mpz_fdiv_qr(f->c.impl, remainder.impl, f->c.impl, a_4.impl);
+            if (mpz_sgn(remainder.impl) != 0 || mpz_sgn(f->a.impl) <= 0 || mpz_sgn(f->c.impl) < 0) {
+                cout << "square_state->assign failed" << endl;
+            }
+            store_reducer.reduce(*f);
+            snapshots.Pop();
+        }
+    }
+
+    SpscRing<FormSnapshot, 256> snapshots;
+    std::thread* store_thread = NULL;
+    std::atomic<bool> store_thread_stopped{false};
+    // Set while the store thread sleeps on store_cv, so StoreForm only notifies when it has to.
+    std::atomic<bool> store_thread_waiting{false};
+    std::mutex store_mutex;
+    std::condition_variable store_cv;
 };
 
 class OneWesolowskiCallback: public WesolowskiCallback {
   public:
     OneWesolowskiCallback(integer& D, uint64_t wanted_iter) : WesolowskiCallback(D) {
-        uint32_t k, l;
         this->wanted_iter = wanted_iter;
         if (wanted_iter >= (1 << 16)) {
-            ApproximateParameters(wanted_iter, k, l);
+            reserved_forms = DefaultPlanner().ChooseSingle(wanted_iter, k, l);
         } else {
             k = 10;
             l = 1;
@@ -84,11 +216,17 @@ class OneWesolowskiCallback: public WesolowskiCallback {
         kl = k * l;
         uint64_t space_needed = wanted_iter / (k * l) + 100;
         forms = (form*) calloc(space_needed, sizeof(form));
+        store_bytes = space_needed * kFormBytes;
+        vdf_metrics.store_bytes.Add(store_bytes);
         form f = form::generator(D);
         forms[0] = f;
+        StartStoreThread();
     }
 
     ~OneWesolowskiCallback() {
+        StopStoreThread();
+        vdf_metrics.store_bytes.Add(-store_bytes);
+        DefaultPlanner().Release(reserved_forms);
         free(forms);
     }
 
@@ -100,30 +238,76 @@ class OneWesolowskiCallback: public WesolowskiCallback {
         if (iteration % kl == 0) {
             uint64_t pos = iteration / kl;
             form* mulf = &forms[pos];
-            SetForm(type, data, mulf);
+            StoreForm(type, data, mulf);
         }
         if (iteration == wanted_iter) {
-            SetForm(type, data, &result);
+            StoreForm(type, data, &result);
         }
     }
 
     uint64_t wanted_iter;
+    // The prover has to use the same k and l.
+    uint32_t k;
+    uint32_t l;
     uint32_t kl;
     form result;
+
+  private:
+    uint64_t reserved_forms = 0;
+};
+
+// Collects every 10th form of a trailing segment shorter than 2^16, for when it has to be
+// recomputed from its checkpoint. intermediates[0] must be set to the checkpoint by the caller.
+class TrailingSegmentCallback: public WesolowskiCallback {
+  public:
+    TrailingSegmentCallback(integer& D, uint64_t start, uint64_t length, std::vector<form>& intermediates)
+        : WesolowskiCallback(D), intermediates(intermediates) {
+        this->start = start;
+        this->length = length;
+        intermediates.resize(length / 10 + 1);
+    }
+
+    void OnIteration(int type, void *data, uint64_t iteration) {
+        iteration++;
+        if (iteration <= start || iteration > start + length)
+            return ;
+
+        uint64_t power = iteration - start;
+        if (power % 10 == 0) {
+            SetForm(type, data, &intermediates[power / 10]);
+        }
+        if (power == length) {
+            SetForm(type, data, &result);
+        }
+    }
+
+    std::vector<form>& intermediates;
+    uint64_t start;
+    uint64_t length;
+    form result;
 };
 
 class TwoWesolowskiCallback: public WesolowskiCallback {
   public:
     TwoWesolowskiCallback(integer& D) : WesolowskiCallback(D) {
-        int space_needed = kSwitchIters / 10 + (kMaxItersAllowed - kSwitchIters) / 100;
+        // Switch to every 100th form earlier if every 10th one up to kSwitchIters doesn't fit in
+        // half the budget.
+        switch_threshold = std::min((uint64_t)kSwitchIters, DefaultPlanner().MemoryForms() / 2 * 10);
+        switch_threshold = std::max(switch_threshold - switch_threshold % 100, (uint64_t)100);
+        int space_needed = switch_threshold / 10 + (kMaxItersAllowed - switch_threshold) / 100;
         forms = (form*) calloc(space_needed, sizeof(form));
+        store_bytes = space_needed * kFormBytes;
+        vdf_metrics.store_bytes.Add(store_bytes);
         form f = form::generator(D);
         forms[0] = f;
         kl = 10;
         switch_iters = -1;
+        StartStoreThread();
     }
 
     ~TwoWesolowskiCallback() {
+        StopStoreThread();
+        vdf_metrics.store_bytes.Add(-store_bytes);
         free(forms);
     }
 
@@ -149,16 +333,38 @@ class TwoWesolowskiCallback: public WesolowskiCallback {
         return kl == 100;
     }
 
+    // Every 100th form is stored from the first checkpoint at or after this.
+    uint64_t SwitchIters() {
+        return switch_threshold;
+    }
+
+    // Intermediates of [start, start + length) are all stored at multiples of this.
+    // 'start' must be a multiple of 100.
+    uint32_t GetStride(uint64_t start, uint64_t length) {
+        return (start + length <= switch_threshold) ? 10 : 100;
+    }
+
+    // Measured VDF speed, or a conservative guess until there is enough data.
+    double IterationsPerSecond() {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        if (iterations < (1 << 20) || seconds < 1)
+            return kDefaultIterationsPerSecond;
+        return iterations / seconds;
+    }
+
     void OnIteration(int type, void *data, uint64_t iteration) {
         iteration++;
         if (iteration % kl == 0) {
             uint64_t pos = GetPosition(iteration);
             form* mulf = &forms[pos];
-            SetForm(type, data, mulf);
+            StoreForm(type, data, mulf);
         }
     }
 
   private:
+    const double kDefaultIterationsPerSecond = 150000;
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    uint64_t switch_threshold;
     uint64_t switch_index;
     int64_t switch_iters;
     uint32_t kl;
@@ -168,68 +374,99 @@ class FastAlgorithmCallback : public WesolowskiCallback {
   public:
     FastAlgorithmCallback(int segments, integer& D, bool multi_proc_machine) : WesolowskiCallback(D) {
         form f = form::generator(D);
-        buckets_begin.push_back(0);
-        buckets_begin.push_back(bucket_size1 * window_size);
         this->segments = segments;
         this->multi_proc_machine = multi_proc_machine;
-        for (int i = 0; i < segments - 2; i++) {
-            buckets_begin.push_back(buckets_begin[buckets_begin.size() - 1] + bucket_size2 * window_size);
+        PlanBuckets(DefaultPlanner());
+        buckets_begin.push_back(0);
+        for (int i = 0; i < segments - 1; i++) {
+            buckets_begin.push_back(buckets_begin[i] + bucket_size[i] * window_size);
         }
-        int space_needed = window_size * (bucket_size1 + bucket_size2 * (segments - 1));
+        int space_needed = buckets_begin[segments - 1] + bucket_size[segments - 1] * window_size;
         forms = (form*) calloc(space_needed, sizeof(form));
         checkpoints = (form*) calloc((1 << 18), sizeof(form));
+        store_bytes = (space_needed + (1 << 18)) * kFormBytes;
+        vdf_metrics.store_bytes.Add(store_bytes);
 
         y_ret = form::generator(D);
         for (int i = 0; i < segments; i++)
             forms[buckets_begin[i]] = f;
         checkpoints[0] = f;
+        StartStoreThread();
     }
 
     ~FastAlgorithmCallback() {
+        StopStoreThread();
+        vdf_metrics.store_bytes.Add(-store_bytes);
         free(checkpoints);
         free(forms);
     }
 
+    // Starts over with a new discriminant, keeping the stores (and the limbs their forms already
+    // allocated) and the store thread. Nothing may be squaring or proving with it meanwhile.
+    void Reset(integer& D) {
+        WaitForStoredForms();
+        this->D = D;
+        this->L = root(-D, 4);
+        iterations = 0;
+        form f = form::generator(D);
+        y_ret = f;
+        for (int i = 0; i < segments; i++)
+            forms[buckets_begin[i]] = f;
+        checkpoints[0] = f;
+    }
+
+    // Prove calls waiting for 'iterations' to pass their trailing segment. While there are any,
+    // every checkpoint wakes the prover event loop, not only those at 2^16 boundaries.
+    std::atomic<int> iteration_waiters{0};
+
     int GetPosition(uint64_t exponent, int bucket) {
         uint64_t power_2 = 1LL << (16 + 2 * bucket);
         int position = buckets_begin[bucket];
-        int size = (bucket == 0) ? bucket_size1 : bucket_size2;
-        int kl = (bucket == 0) ? 10 : (12 * (power_2 >> 18));
-        position += ((exponent / power_2) % window_size) * size;
-        position += (exponent % power_2) / kl;
+        position += ((exponent / power_2) % window_size) * bucket_size[bucket];
+        position += (exponent % power_2) / (bucket_k[bucket] * bucket_l[bucket]);
         return position;
     }
 
+    // k and l the provers of this bucket's segments use; intermediates are stored every k * l.
+    void GetBucketParameters(int bucket, uint32_t& k, uint32_t& l) {
+        k = bucket_k[bucket];
+        l = bucket_l[bucket];
+    }
+
     form *GetForm(uint64_t exponent, int bucket) {
         uint64_t pos = GetPosition(exponent, bucket);
         return &(forms[pos]);
     }
 
-    // We need to store: 
-    // 2^16 * k + 10 * l
-    // 2^(18 + 2*m) * k + 12 * 2^(2*m) * l
+    // Stores the form in every bucket that keeps an intermediate at this iteration.
+    // 'setter' does the conversion, so FastStorage threads can use their own reducer.
+    void StoreIntermediates(WesolowskiCallback* setter, int type, void *data, uint64_t iteration) {
+        for (int i = 0; i < segments; i++) {
+            uint64_t power_2 = 1LL << (16 + 2LL * i);
+            if ((iteration % power_2) % (bucket_k[i] * bucket_l[i]) == 0) {
+                form* mulf = GetForm(iteration, i);
+                setter->StoreForm(type, data, mulf);
+            }
+        }
+    }
+
+    // We need to store, for bucket m:
+    // 2^(16 + 2*m) * k + kl_m * l
     void OnIteration(int type, void *data, uint64_t iteration) {
         iteration++;
         if (multi_proc_machine) {
             if (iteration % (1 << 15) == 0) {
-                SetForm(type, data, &y_ret);
+                StoreForm(type, data, &y_ret);
             }
         } else {
             // If 'multi_proc_machine' is 0, we store the intermediates
             // right away.
-            for (int i = 0; i < segments; i++) {
-                uint64_t power_2 = 1LL << (16 + 2LL * i);
-                int kl = (i == 0) ? 10 : (12 * (power_2 >> 18));
-                if ((iteration % power_2) % kl == 0) {
-                    form* mulf = GetForm(iteration, i);
-                    SetForm(type, data, mulf);
-                }
-            }
+            StoreIntermediates(this, type, data, iteration);
         }
 
         if (iteration % (1 << 16) == 0) {
             form* mulf = (&checkpoints[(iteration / (1 << 16))]);
-            SetForm(type, data, mulf);
+            StoreForm(type, data, mulf);
         }
     }
 
@@ -237,13 +474,50 @@ class FastAlgorithmCallback : public WesolowskiCallback {
     form* checkpoints;
     form y_ret;
     int segments;
-    // The intermediate values size of a 2^16 segment.
-    const int bucket_size1 = 6554;
-    // The intermediate values size of a >= 2^18 segment.
-    const int bucket_size2 = 21846;
     // Assume provers won't be left behind by more than this # of segments.
     const int window_size = kWindowSize;
     bool multi_proc_machine;
+
+  private:
+    // Bucket 0 keeps every 10th form: FastStorage and the trailing segment proofs rely on it.
+    // The other buckets split half of what's left of the budget after it and the checkpoints; the
+    // rest is for the provers and everything else.
+    void PlanBuckets(ParameterPlanner& planner) {
+        bucket_k.push_back(10);
+        bucket_l.push_back(1);
+        bucket_size.push_back((1 << 16) / 10 + 1);
+        uint64_t fixed = (1 << 18) + (uint64_t)window_size * bucket_size[0];
+        uint64_t free_forms = (planner.MemoryForms() > fixed) ? planner.MemoryForms() - fixed : 0;
+        uint64_t segment_forms = free_forms / 2 / std::max(segments - 1, 1) / window_size;
+        for (int i = 1; i < segments; i++) {
+            uint64_t power_2 = 1LL << (16 + 2 * i);
+            uint32_t k, l;
+            planner.Choose(power_2, segment_forms, 1, k, l);
+            bucket_k.push_back(k);
+            bucket_l.push_back(l);
+            bucket_size.push_back((power_2 + k * l - 1) / (k * l));
+        }
+    }
+
+    std::vector<uint32_t> bucket_k;
+    std::vector<uint32_t> bucket_l;
+    // The intermediate values size of one segment of each bucket.
+    std::vector<int> bucket_size;
+};
+
+// Recomputes the intermediates of one 2^15 block for FastStorage, away from the main VDF thread.
+class IntermediatesCallback: public WesolowskiCallback {
+  public:
+    IntermediatesCallback(FastAlgorithmCallback* weso) : WesolowskiCallback(weso->D) {
+        this->weso = weso;
+    }
+
+    void OnIteration(int type, void *data, uint64_t iteration) {
+        iteration++;
+        weso->StoreIntermediates(this, type, data, iteration);
+    }
+
+    FastAlgorithmCallback* weso;
 };
 
 #endif // CALLBACK_H
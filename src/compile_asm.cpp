@@ -2,13 +2,20 @@
 
 #include "include.h"
 
+#include "parameters.h"
+
 bool use_divide_table=false;
-int gcd_base_bits=50;
-int gcd_128_max_iter=3;
+int gcd_base_bits=cel_gcd_base_bits;
+int gcd_128_max_iter=cel_gcd_128_max_iter;
 std::string asmprefix="cel_";
 bool enable_all_instructions=false;
-
-#include "parameters.h"
+// Constants, tables and jump targets are addressed relative to RIP, so the output can go into a
+// shared library or a PIE. Mach-O needs this anyway.
+#ifdef CHIAOSX
+bool position_independent=true;
+#else
+bool position_independent=false;
+#endif
 
 #define COMPILE_ASM
 
@@ -37,9 +44,13 @@ bool enable_all_instructions=false;
 #include "asm_gcd_128.h"
 #include "asm_gcd_unsigned.h"
 #include "asm_avx512_ifma.h"
+#include "asm_schedule.h"
 
 #include "asm_main.h"
 
+//usage: compile_asm [cel|avx2|avx512] [-s UARCH] [-p]
+//-s reorders the instructions for one of the tables in asm_schedule.h
+//-p makes position independent code, written to *_pic.s (e.g. asm_compiled_pic.s)
 int main(int argc, char** argv) {
     set_rounding_mode();
 
@@ -47,22 +58,60 @@ int main(int argc, char** argv) {
     
     bool compile_avx512=false;
 
-    if((argc==2)&&(strcmp(argv[1],"avx2")==0))
+    bool pic_output=false;
+
+    int arg=1;
+    if((argc>=2)&&(strcmp(argv[1],"avx2")==0))
     {
        use_divide_table=true;
-       gcd_base_bits=63;
-       gcd_128_max_iter=2;
+       gcd_base_bits=avx2_gcd_base_bits;
+       gcd_128_max_iter=avx2_gcd_128_max_iter;
        asmprefix="avx2_";
        enable_all_instructions=true;
        filename="avx2_asm_compiled.s";
-    }
-
-    if((argc==2)&&(strcmp(argv[1],"avx512")==0))
+       ++arg;
+    } else
+    if((argc>=2)&&(strcmp(argv[1],"avx512")==0))
     {
         enable_all_instructions=true;
         asmprefix="avx512_";
         filename="avx512_asm_compiled.s";
         compile_avx512=true;
+        ++arg;
+    } else
+    if((argc>=2)&&(strcmp(argv[1],"cel")==0))
+    {
+        ++arg;
+    }
+
+    for (;arg<argc;++arg) {
+        if (strcmp(argv[arg],"-s")==0 && arg+1<argc) {
+            asm_code::schedule_uarch=argv[arg+1];
+            ++arg;
+        } else
+        if (strcmp(argv[arg],"-p")==0) {
+            pic_output=true;
+        } else {
+            break;
+        }
+    }
+    bool known_uarch=asm_code::schedule_uarch.empty();
+    for (const auto& uarch : asm_code::schedule_uarch_tables) {
+        known_uarch|=(uarch.name==asm_code::schedule_uarch);
+    }
+    if (arg!=argc || !known_uarch) {
+        cerr << "usage: " << argv[0] << " [cel|avx2|avx512] [-s UARCH] [-p]\n";
+        cerr << "UARCH is one of:";
+        for (const auto& uarch : asm_code::schedule_uarch_tables) {
+            cerr << " " << uarch.name;
+        }
+        cerr << "\n";
+        return 1;
+    }
+
+    if (pic_output) {
+        position_independent=true;
+        filename=filename.substr(0, filename.size()-2)+"_pic.s";
     }
 
     if (compile_avx512) {
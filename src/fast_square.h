@@ -0,0 +1,86 @@
+#ifndef FAST_SQUARE_H
+#define FAST_SQUARE_H
+
+// The fast squaring code (vdf_fast.h and the generated asm gcd kernels) and fast_square_engine on
+// top of it. Programs that include this link the asm objects and define gcd_base_bits and
+// gcd_128_max_iter, set for the kernels they run (see parameters.h).
+
+#include "include.h"
+
+#include <x86intrin.h>
+
+#include "parameters.h"
+
+#include "bit_manipulation.h"
+#include "double_utility.h"
+#include "integer.h"
+
+#include "asm_main.h"
+
+#include "vdf_new.h"
+#include "picosha2.h"
+
+#include "gpu_integer.h"
+#include "gpu_integer_divide.h"
+
+#include "gcd_base_continued_fractions.h"
+//#include "gcd_base_divide_table.h"
+#include "gcd_128.h"
+#include "gcd_unsigned.h"
+
+#include "gpu_integer_gcd.h"
+
+#include "asm_types.h"
+
+#include "threading.h"
+#include "avx512_integer.h"
+#include "nucomp.h"
+#include "phase_profiler.h"
+#include "vdf_fast.h"
+
+#include "proof_common.h"
+#include <mutex>
+
+// Every concurrent fast squaring needs its own master/slave counter pair. Pair 0 belongs to the
+// main VDF loop.
+const int kMaxSquaringPairs = 100;
+bool pairindex_used[kMaxSquaringPairs] = {true};
+std::mutex pairindex_mutex;
+
+// Returns -1 if all pairs are taken.
+int AcquirePairIndex() {
+    std::lock_guard<std::mutex> lk(pairindex_mutex);
+    for (int i = 1; i < kMaxSquaringPairs; i++) {
+        if (!pairindex_used[i]) {
+            pairindex_used[i] = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void ReleasePairIndex(int pairindex) {
+    std::lock_guard<std::mutex> lk(pairindex_mutex);
+    pairindex_used[pairindex] = false;
+}
+
+// fast_square_engine for FastPowFormNucomp and the provers: squares on a free counter pair, on the
+// calling thread. The gcd code needs truncated rounding; the caller's rounding mode is put back
+// after, since in a library the thread may be doing other floating point work.
+uint64_t FastSquareEngine(form& f, integer& D, integer& L, uint64_t iterations) {
+    int pairindex = AcquirePairIndex();
+    if (pairindex == -1)
+        return 0;
+    int rounding_mode = fegetround();
+    fesetround(FE_TOWARDZERO);
+    square_state_type square_state;
+    square_state.pairindex = pairindex;
+    uint64 done = repeated_square_fast_single_thread(square_state, f, D, L, 0, std::min<uint64_t>(iterations, checkpoint_interval), NULL);
+    fesetround(rounding_mode);
+    ReleasePairIndex(pairindex);
+    return (done == ~uint64(0)) ? 0 : done;
+}
+
+bool fast_square_engine_installed = (fast_square_engine = FastSquareEngine, true);
+
+#endif // FAST_SQUARE_H
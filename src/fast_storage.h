@@ -10,44 +10,103 @@
 #define FAST_STORAGE_H
 
 #include "vdf_new.h"
+#include "metrics.h"
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <ctime>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 extern bool new_event;
 extern std::mutex new_event_mutex;
 extern std::condition_variable new_event_cv;
 
+bool repeated_square_detached(form& f, const integer& D, const integer& L, uint64 base, uint64 iterations, WesolowskiCallback* weso, bool& stopped, bool two_threads);
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words must be plain 32 bit words");
+
+// Sleeps while *word is 'expected', for at most 'timeout_ms'. It may return early. Without futexes
+// (not Linux) it sleeps a millisecond, so waiters poll.
+void FutexWait(std::atomic<uint32_t>* word, uint32_t expected, int timeout_ms) {
+#ifdef __linux__
+    struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, expected, &timeout, NULL, 0);
+#else
+    if (word->load() == expected)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+}
+
+// Wakes up to 'count' threads in FutexWait on 'word'.
+void FutexWake(std::atomic<uint32_t>* word, int count) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#endif
+}
+
+// Recomputes the intermediates of the checkpoints the VDF thread submits, on a pool of threads.
+// The VDF thread never locks or blocks here: it fills a queue slot and publishes it, and wakes a
+// worker with a futex only if one is asleep. Workers claim checkpoints with a CAS. They add threads
+// while a backlog remains and none of them is idle, and threads above kMinThreads exit once they've
+// been idle for kIdleSeconds.
 class FastStorage {
   public:
     FastStorage(FastAlgorithmCallback* weso) {
-        stopped = false;
         this->weso = weso;
         intermediates_stored = new bool[(1 << 19)];
         for (int i = 0; i < (1 << 19); i++)
             intermediates_stored[i] = 0;
+        pending_intermediates = new form[kQueueSize];
 
-        for (int i = 0; i < intermediates_threads; i++) {
-            storage_threads.push_back(std::thread([=] {CalculateIntermediatesThread(); }));
-        }
+        // The main VDF loop keeps 2 cores busy.
+        max_threads = std::max((int)std::thread::hardware_concurrency() - 2, kMinThreads);
+        std::lock_guard<std::mutex> lk(threads_mutex);
+        for (int i = 0; i < kMinThreads; i++)
+            StartThread();
     }
 
     ~FastStorage() {
+        stopped.store(true);
+        cancelled = true;
+        work_seq.fetch_add(1);
+        FutexWake(&work_seq, INT_MAX);
         {
-            std::lock_guard<std::mutex> lk(intermediates_mutex);
-            stopped = true;
-        }
-        intermediates_cv.notify_all();
-        for (int i = 0; i < storage_threads.size(); i++) {
-            storage_threads[i].join();
+            std::unique_lock<std::mutex> lk(threads_mutex);
+            threads_cv.wait(lk, [this] { return live_threads == 0; });
         }
         delete[] intermediates_stored;
+        delete[] pending_intermediates;
         std::cout << "Fast storage fully stopped.\n" << std::flush;
     }
 
+    // Readies the storage for the next challenge of its (reset) weso, keeping the threads. Work
+    // left from the last challenge is dropped. Only called while the VDF loop is stopped.
+    void Reset() {
+        paused.store(true);
+        cancelled = true;
+        {
+            std::unique_lock<std::mutex> lk(threads_mutex);
+            threads_cv.wait(lk, [this] { return busy_threads.load() == 0; });
+        }
+        claimed.store(submitted.load());
+        for (int i = 0; i < (1 << 19); i++)
+            intermediates_stored[i] = 0;
+        intermediates_iter = 0;
+        cancelled = false;
+        paused.store(false);
+        vdf_metrics.fast_storage_backlog.Set(0);
+    }
+
     void AddIntermediates(uint64_t iter) {
         int bucket = iter / (1 << 16);
         int subbucket = 0;
         if (iter % (1 << 16))
             subbucket = 1;
-        bool arrived_segment = false;
         bool has_event = false;
         {
             intermediates_stored[2 * bucket + subbucket] = true;
@@ -55,7 +114,8 @@ class FastStorage {
                 intermediates_stored[2 * bucket + 1] == true)
                     has_event = true;
         }
-        if (has_event) {
+        // A Prove call may be waiting for this block's intermediates.
+        if (has_event || weso->iteration_waiters.load() > 0) {
             {
                 std::lock_guard<std::mutex> lk(new_event_mutex);
                 new_event = true;
@@ -64,33 +124,39 @@ class FastStorage {
         }
     }
 
+    // The callback is made per block, so its D and L are the current challenge's.
     void CalculateIntermediatesInner(form y, uint64_t iter_begin) {
-        PulmarkReducer reducer;
-        integer& D = weso->D;
-        integer& L = weso->L;
-        int segments = weso->segments;
-        for (uint64_t iteration = iter_begin; iteration < iter_begin + (1 << 15); iteration++) {
-            for (int i = 0; i < segments; i++) {
-                uint64_t power_2 = 1LL << (16 + 2 * i);
-                int kl = (i == 0) ? 10 : (12 * (power_2 >> 18));
-                if ((iteration % power_2) % kl == 0) {
-                    if (stopped) return;
-                    form* mulf = weso->GetForm(iteration, i);
-                    weso->SetForm(NL_FORM, &y, mulf, /*reduced=*/false);
-                }
-            }
-            nudupl_form(y, y, D, L);
-            reducer.reduce(y);   
-        }
+        IntermediatesCallback callback(weso);
+        vdf_original::form f_in;
+        f_in.a[0]=y.a.impl[0];
+        f_in.b[0]=y.b.impl[0];
+        f_in.c[0]=y.c.impl[0];
+        weso->StoreIntermediates(&callback, NL_FORM, &f_in, iter_begin);
+
+        // This is throughput work, so use the fast algorithm interleaved on one thread and leave the
+        // other cores to more storage threads.
+        if (!repeated_square_detached(y, weso->D, weso->L, iter_begin, (1 << 15) - 1, &callback, cancelled, false))
+            return ;
         AddIntermediates(iter_begin);
     }
 
+    // Only called from the main VDF thread, once per 2^15 iterations.
     void SubmitCheckpoint(form y_ret, uint64_t iteration) {
-        {
-            std::lock_guard<std::mutex> lk(intermediates_mutex);
-            pending_intermediates[iteration] = y_ret;
-        }
-        intermediates_cv.notify_all();
+        uint64_t position = submitted.load(std::memory_order_relaxed);
+        pending_intermediates[position % kQueueSize] = y_ret;
+        pending_iters[position % kQueueSize] = iteration;
+        submitted.store(position + 1, std::memory_order_release);
+        vdf_metrics.fast_storage_backlog.Set(position + 1 - claimed.load(std::memory_order_relaxed));
+        // A worker going to sleep counts itself idle before it reads work_seq, so either it sees
+        // this submission or it is counted here.
+        work_seq.fetch_add(1);
+        if (idle_threads.load() > 0)
+            FutexWake(&work_seq, 1);
+    }
+
+    // True once the intermediates of the 2^15 block containing 'iter' are stored.
+    bool HasIntermediates(uint64_t iter) {
+        return intermediates_stored[2 * (iter / (1 << 16)) + ((iter % (1 << 16)) >= (1 << 15))];
     }
 
     uint64_t GetFinishedSegment() {
@@ -102,32 +168,120 @@ class FastStorage {
     } 
 
     void CalculateIntermediatesThread() {
-        while (!stopped) {
-            {
-                std::unique_lock<std::mutex> lk(intermediates_mutex);
-                intermediates_cv.wait(lk, [&] {
-                    return (!pending_intermediates.empty() || stopped);
-                });
-                if (!stopped) {
-                    uint64_t iter_begin = (*pending_intermediates.begin()).first;
-                    form y = (*pending_intermediates.begin()).second;
-                    pending_intermediates.erase(pending_intermediates.begin());
-                    lk.unlock();
-                    CalculateIntermediatesInner(y, iter_begin);
-                }
+        auto idle_since = std::chrono::steady_clock::now();
+        while (!stopped.load()) {
+            uint64_t position;
+            idle_threads.fetch_add(1);
+            uint32_t seq = work_seq.load();
+            bool has_work = Claim(position);
+            if (!has_work)
+                FutexWait(&work_seq, seq, kIdleWaitMs);
+            idle_threads.fetch_sub(1);
+            if (has_work) {
+                CalculateClaimed(position);
+                idle_since = std::chrono::steady_clock::now();
+            } else if (std::chrono::steady_clock::now() - idle_since >= std::chrono::seconds(kIdleSeconds) &&
+                       StopIdleThread()) {
+                return ;
             }
         }
+        std::lock_guard<std::mutex> lk(threads_mutex);
+        live_threads--;
+        threads_cv.notify_all();
     }
 
   private:
-    std::vector<std::thread> storage_threads;
+    // Takes the oldest unclaimed checkpoint. On success the thread stays counted in busy_threads
+    // until CalculateClaimed is done; Reset waits for that count to drop to 0.
+    bool Claim(uint64_t& position) {
+        busy_threads.fetch_add(1);
+        if (!paused.load()) {
+            position = claimed.load();
+            while (position < submitted.load(std::memory_order_acquire)) {
+                if (claimed.compare_exchange_weak(position, position + 1))
+                    return true;
+            }
+        }
+        DoneBusy();
+        return false;
+    }
+
+    void CalculateClaimed(uint64_t position) {
+        form y = pending_intermediates[position % kQueueSize];
+        uint64_t iter_begin = pending_iters[position % kQueueSize];
+        uint64_t submitted_now = submitted.load(std::memory_order_acquire);
+        if (submitted_now - position > kQueueSize) {
+            std::cout << "Warning: fast storage is " << submitted_now - position << " checkpoints behind. "
+                      << "Intermediates will be corrupted.\n";
+        }
+        // Nobody is left to take the rest of the backlog: add a thread.
+        uint64_t backlog = submitted_now - claimed.load();
+        if (backlog > 0 && idle_threads.load() == 0) {
+            std::lock_guard<std::mutex> lk(threads_mutex);
+            if (live_threads < max_threads && !stopped.load()) {
+                StartThread();
+                std::cout << "Fast storage backlog is " << backlog << " checkpoints. Using "
+                          << live_threads << " threads.\n";
+            }
+        }
+        CalculateIntermediatesInner(y, iter_begin);
+        DoneBusy();
+    }
+
+    void DoneBusy() {
+        if (busy_threads.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lk(threads_mutex);
+            threads_cv.notify_all();
+        }
+    }
+
+    // Called with threads_mutex held. The threads are detached; the destructor waits for
+    // live_threads to drop to 0 instead of joining them.
+    void StartThread() {
+        live_threads++;
+        std::thread([=] { CalculateIntermediatesThread(); }).detach();
+    }
+
+    // True if the calling idle thread may exit; it is then no longer counted.
+    bool StopIdleThread() {
+        std::lock_guard<std::mutex> lk(threads_mutex);
+        if (live_threads <= kMinThreads)
+            return false;
+        live_threads--;
+        std::cout << "Fast storage is idle. Using " << live_threads << " threads.\n";
+        threads_cv.notify_all();
+        return true;
+    }
+
+    // Checkpoints waiting for their intermediates. Single producer (the VDF thread),
+    // many consumers; slot i % kQueueSize holds the i-th submitted checkpoint.
+    static const int kQueueSize = 1 << 10;
+    form* pending_intermediates;
+    uint64_t pending_iters[kQueueSize];
+    std::atomic<uint64_t> submitted{0};
+    std::atomic<uint64_t> claimed{0};
+    // Bumped on every submission and on shutdown; idle workers sleep on it.
+    std::atomic<uint32_t> work_seq{0};
+    std::atomic<int> idle_threads{0};
+    // Threads in Claim or working on a claimed checkpoint.
+    std::atomic<int> busy_threads{0};
+    // Set by Reset so no checkpoint is claimed while it clears the queue.
+    std::atomic<bool> paused{false};
+    std::atomic<bool> stopped{false};
+    // Stops the squaring in flight, on shutdown or Reset.
+    bool cancelled = false;
+
     FastAlgorithmCallback* weso;
     bool* intermediates_stored;
-    bool stopped;
-    std::map<uint64_t, form> pending_intermediates;
-    int intermediates_threads = 6;
-    std::mutex intermediates_mutex;
-    std::condition_variable intermediates_cv;
+    static const int kMinThreads = 2;
+    // Wakeups of an idle thread, to see whether it has been idle long enough to exit.
+    static const int kIdleWaitMs = 1000;
+    static const int kIdleSeconds = 10;
+    int max_threads;
+    // live_threads is guarded by threads_mutex; threads_cv signals it and busy_threads changing.
+    std::mutex threads_mutex;
+    std::condition_variable threads_cv;
+    int live_threads = 0;
     uint64_t intermediates_iter = 0;
 };
 
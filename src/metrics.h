@@ -0,0 +1,188 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Live counters of the VDF worker, rendered in the Prometheus text format. Updates are relaxed
+// atomics, so the VDF loop and the provers can update them without slowing down.
+
+class MetricCounter {
+  public:
+    void Add(uint64_t n = 1) {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t Get() {
+        return value.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> value{0};
+};
+
+class MetricGauge {
+  public:
+    void Set(int64_t x) {
+        value.store(x, std::memory_order_relaxed);
+    }
+
+    void Add(int64_t n) {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t Get() {
+        return value.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<int64_t> value{0};
+};
+
+// Counts observations (in seconds) in fixed buckets.
+class MetricHistogram {
+  public:
+    MetricHistogram(std::vector<double> bounds) : bounds(bounds), counts(bounds.size() + 1) {
+        for (auto& count : counts)
+            count = 0;
+    }
+
+    void Observe(double seconds) {
+        int i = 0;
+        while (i < bounds.size() && seconds > bounds[i])
+            i++;
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add((uint64_t)(seconds * 1e6), std::memory_order_relaxed);
+    }
+
+    void Render(std::ostream& out, const std::string& name) {
+        uint64_t total = 0;
+        for (int i = 0; i <= bounds.size(); i++) {
+            total += counts[i].load(std::memory_order_relaxed);
+            out << name << "_bucket{le=\"";
+            if (i < bounds.size())
+                out << bounds[i];
+            else
+                out << "+Inf";
+            out << "\"} " << total << "\n";
+        }
+        out << name << "_sum " << sum_us.load(std::memory_order_relaxed) / 1e6 << "\n";
+        out << name << "_count " << total << "\n";
+    }
+
+  private:
+    std::vector<double> bounds;
+    std::deque<std::atomic<uint64_t>> counts;
+    std::atomic<uint64_t> sum_us{0};
+};
+
+// Keeps about one sample per second of a counter, enough to give its rate over the last few
+// minutes.
+class MetricRate {
+  public:
+    void Sample(uint64_t value) {
+        double now = std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        std::lock_guard<std::mutex> lk(m);
+        if (!samples.empty() && now - samples.back().first < 1)
+            return;
+        samples.emplace_back(now, value);
+        while (samples.size() > 2 && now - samples[1].first >= kMaxWindow)
+            samples.pop_front();
+    }
+
+    // Per second, between the latest sample and the oldest one at most 'window' seconds older.
+    double Rate(double window) {
+        std::lock_guard<std::mutex> lk(m);
+        if (samples.size() < 2)
+            return 0;
+        auto& last = samples.back();
+        for (auto& sample : samples) {
+            if (last.first - sample.first <= window + 0.5) {
+                if (sample.first == last.first)
+                    return 0;
+                return (last.second - sample.second) / (last.first - sample.first);
+            }
+        }
+        return 0;
+    }
+
+    static constexpr double kMaxWindow = 300;
+
+  private:
+    std::mutex m;
+    std::deque<std::pair<double, uint64_t>> samples;
+};
+
+// Segment buckets with their own gauge; the n-weso prover uses 8.
+const int kMaxMetricBuckets = 16;
+
+struct VdfMetrics {
+    // Squarings done, across challenges, and the iteration the current challenge is at.
+    MetricCounter iterations;
+    MetricGauge vdf_iteration;
+    MetricRate iteration_rate;
+    // Batches the fast algorithm gave up on and the slow one redid, and the iterations it took.
+    MetricCounter corruptions;
+    MetricCounter slow_fallbacks;
+    MetricCounter slow_iterations;
+    // n-weso prover state, per segment bucket.
+    MetricGauge buckets;
+    MetricGauge pending_segments[kMaxMetricBuckets];
+    MetricGauge active_provers;
+    MetricGauge paused_provers;
+    // Checkpoints submitted to the fast storage threads but not yet picked up.
+    MetricGauge fast_storage_backlog;
+    // RAM held by the intermediate form stores.
+    MetricGauge store_bytes;
+    // From the timelord's request for an iteration to sending its proof.
+    MetricHistogram proof_latency{{0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300}};
+
+    std::string Render() {
+        iteration_rate.Sample(iterations.Get());
+        std::ostringstream out;
+        Header(out, "vdf_iterations_total", "counter", "Squarings done by the VDF loop.");
+        out << "vdf_iterations_total " << iterations.Get() << "\n";
+        Header(out, "vdf_iteration", "gauge", "Iteration reached on the current challenge.");
+        out << "vdf_iteration " << vdf_iteration.Get() << "\n";
+        Header(out, "vdf_iterations_per_second", "gauge", "Squaring rate over a sliding window.");
+        for (int window : {10, 60, 300})
+            out << "vdf_iterations_per_second{window=\"" << window << "s\"} "
+                << iteration_rate.Rate(window) << "\n";
+        Header(out, "vdf_corruptions_total", "counter", "Batches the fast algorithm got wrong.");
+        out << "vdf_corruptions_total " << corruptions.Get() << "\n";
+        Header(out, "vdf_slow_fallbacks_total", "counter",
+               "Times the slow algorithm took over from the fast one.");
+        out << "vdf_slow_fallbacks_total " << slow_fallbacks.Get() << "\n";
+        Header(out, "vdf_slow_iterations_total", "counter", "Squarings done by the slow algorithm.");
+        out << "vdf_slow_iterations_total " << slow_iterations.Get() << "\n";
+        Header(out, "vdf_pending_segments", "gauge", "Segments waiting for a prover, per bucket.");
+        for (int i = 0; i < std::min(buckets.Get(), (int64_t)kMaxMetricBuckets); i++)
+            out << "vdf_pending_segments{bucket=\"" << i << "\"} " << pending_segments[i].Get() << "\n";
+        Header(out, "vdf_provers", "gauge", "Segment provers by state.");
+        out << "vdf_provers{state=\"active\"} " << active_provers.Get() << "\n";
+        out << "vdf_provers{state=\"paused\"} " << paused_provers.Get() << "\n";
+        Header(out, "vdf_fast_storage_backlog", "gauge", "Checkpoints waiting for a storage thread.");
+        out << "vdf_fast_storage_backlog " << fast_storage_backlog.Get() << "\n";
+        Header(out, "vdf_store_bytes", "gauge", "Approximate RAM held by the intermediate stores.");
+        out << "vdf_store_bytes " << store_bytes.Get() << "\n";
+        Header(out, "vdf_proof_latency_seconds", "histogram", "Time from request to proof sent.");
+        proof_latency.Render(out, "vdf_proof_latency_seconds");
+        return out.str();
+    }
+
+  private:
+    void Header(std::ostream& out, const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " " << type << "\n";
+    }
+};
+
+VdfMetrics vdf_metrics;
+
+#endif // METRICS_H
@@ -12,16 +12,57 @@
 //
 //
 
+//the tuned values below can be overridden by a tuned_parameters.h written by autotune.py for the
+//host it ran on. the defaults are the fastest on the machines in the tables at the end of this file
+#if __has_include("tuned_parameters.h")
+    #include "tuned_parameters.h"
+#endif
+
+#ifndef DIVIDE_TABLE_INDEX_BITS
+    #define DIVIDE_TABLE_INDEX_BITS 11
+#endif
+#ifndef GCD_BASE_MAX_ITER_DIVIDE_TABLE
+    #define GCD_BASE_MAX_ITER_DIVIDE_TABLE 16
+#endif
+#ifndef GCD_TABLE_NUM_EXPONENT_BITS
+    #define GCD_TABLE_NUM_EXPONENT_BITS 3
+#endif
+#ifndef GCD_TABLE_NUM_FRACTION_BITS
+    #define GCD_TABLE_NUM_FRACTION_BITS 7
+#endif
+#ifndef GCD_BASE_MAX_ITER
+    #define GCD_BASE_MAX_ITER 5
+#endif
+#ifndef CEL_GCD_BASE_BITS
+    #define CEL_GCD_BASE_BITS 50
+#endif
+#ifndef CEL_GCD_128_MAX_ITER
+    #define CEL_GCD_128_MAX_ITER 3
+#endif
+#ifndef AVX2_GCD_BASE_BITS
+    #define AVX2_GCD_BASE_BITS 63
+#endif
+#ifndef AVX2_GCD_128_MAX_ITER
+    #define AVX2_GCD_128_MAX_ITER 2
+#endif
+
 //divide table
-const int divide_table_index_bits=11;
+const int divide_table_index_bits=DIVIDE_TABLE_INDEX_BITS;
 const int gcd_num_quotient_bits=31; //excludes sign bit
 const int data_size=31;
-const int gcd_base_max_iter_divide_table=16;
+const int gcd_base_max_iter_divide_table=GCD_BASE_MAX_ITER_DIVIDE_TABLE;
 
 //continued fraction table
-const int gcd_table_num_exponent_bits=3;
-const int gcd_table_num_fraction_bits=7;
-const int gcd_base_max_iter=5;
+const int gcd_table_num_exponent_bits=GCD_TABLE_NUM_EXPONENT_BITS;
+const int gcd_table_num_fraction_bits=GCD_TABLE_NUM_FRACTION_BITS;
+const int gcd_base_max_iter=GCD_BASE_MAX_ITER;
+
+//gcd_base_bits and gcd_128_max_iter of each build of the gcd kernels. compile_asm builds the asm
+//with them and the programs set them for the build they run, which the c++ gcd code also uses
+const int cel_gcd_base_bits=CEL_GCD_BASE_BITS;
+const int cel_gcd_128_max_iter=CEL_GCD_128_MAX_ITER;
+const int avx2_gcd_base_bits=AVX2_GCD_BASE_BITS;
+const int avx2_gcd_128_max_iter=AVX2_GCD_128_MAX_ITER;
 
 extern bool use_divide_table;
 extern int gcd_base_bits;
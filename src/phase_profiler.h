@@ -0,0 +1,294 @@
+#ifndef PHASE_PROFILER_H
+#define PHASE_PROFILER_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Per phase counters of the fast squaring (square_state_type::call_phase), for the master and the
+// slave thread. Off until Enable() is called, and then only every Nth iteration is measured: each
+// phase call of that iteration is bracketed by two reads of a perf_event_open group for the calling
+// thread. A phase includes the time its thread spends waiting for the other one inside it.
+// Counters the kernel or CPU doesn't offer (e.g. in most VMs) are reported as n/a.
+
+enum PhaseEvent {
+    kPhaseTaskClock,
+    kPhaseCycles,
+    kPhaseInstructions,
+    kPhaseL1dMisses,
+    kPhaseLlcMisses,
+    kPhaseBranchMisses,
+    kNumPhaseEvents
+};
+
+const char* const kPhaseEventNames[kNumPhaseEvents] = {
+    "task_clock_ns", "cycles", "instructions", "l1d_read_misses", "llc_misses", "branch_misses"};
+
+// The counters of one thread, opened the first time the thread is sampled.
+class PhaseCounterGroup {
+  public:
+    ~PhaseCounterGroup() {
+        for (int fd : fds) {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+
+    // Fills values for the events in 'available' (a bit per PhaseEvent). False if nothing could be
+    // opened or read; 'error' then says why.
+    bool Read(uint64_t values[kNumPhaseEvents], unsigned& available, std::string& error) {
+#ifdef __linux__
+        if (!opened)
+            Open(error);
+        if (order.empty())
+            return false;
+        uint64_t buf[kNumPhaseEvents + 1];
+        size_t size = (order.size() + 1) * sizeof(uint64_t);
+        if (read(fds[order[0]], buf, size) != (ssize_t)size || buf[0] != order.size()) {
+            error = "reading the counters failed";
+            return false;
+        }
+        for (size_t i = 0; i < order.size(); i++)
+            values[order[i]] = buf[i + 1];
+        available = 0;
+        for (int event : order)
+            available |= 1u << event;
+        return true;
+#else
+        error = "perf_event_open is Linux only";
+        return false;
+#endif
+    }
+
+  private:
+#ifdef __linux__
+    // The task clock leads the group because it is there even without a PMU; a software leader with
+    // hardware members is moved to the hardware context by the kernel.
+    void Open(std::string& error) {
+        opened = true;
+        const int events[] = {kPhaseTaskClock, kPhaseCycles, kPhaseInstructions, kPhaseL1dMisses,
+                              kPhaseLlcMisses, kPhaseBranchMisses};
+        for (int event : events) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            switch (event) {
+                case kPhaseTaskClock:
+                    attr.type = PERF_TYPE_SOFTWARE;
+                    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+                    break;
+                case kPhaseCycles:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                    break;
+                case kPhaseInstructions:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                    break;
+                case kPhaseL1dMisses:
+                    attr.type = PERF_TYPE_HW_CACHE;
+                    attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                    break;
+                case kPhaseLlcMisses:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                    break;
+                case kPhaseBranchMisses:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                    break;
+            }
+            int leader = order.empty() ? -1 : fds[order[0]];
+            int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+            if (fd < 0) {
+                if (order.empty())
+                    error = std::string("perf_event_open: ") + strerror(errno);
+                continue;
+            }
+            fds[event] = fd;
+            order.push_back(event);
+        }
+    }
+#endif
+
+    bool opened = false;
+    int fds[kNumPhaseEvents] = {-1, -1, -1, -1, -1, -1};
+    std::vector<int> order;
+};
+
+class PhaseProfiler {
+  public:
+    static const int kMaxPhases = 8;
+
+    // Measures one iteration in 'every'; 0 turns it off.
+    void Enable(uint64_t every) {
+        this->every.store(every, std::memory_order_relaxed);
+    }
+
+    bool Enabled() {
+        return every.load(std::memory_order_relaxed) != 0;
+    }
+
+    bool Sampled(uint64_t iteration) {
+        uint64_t n = every.load(std::memory_order_relaxed);
+        return n != 0 && iteration % n == 0;
+    }
+
+    void Record(bool is_slave, int phase, const uint64_t begin[], const uint64_t end[], unsigned t_available) {
+        if (phase < 0 || phase >= kMaxPhases)
+            return;
+        samples[is_slave][phase].fetch_add(1, std::memory_order_relaxed);
+        for (int event = 0; event < kNumPhaseEvents; event++) {
+            if (t_available & (1u << event))
+                totals[is_slave][phase][event].fetch_add(end[event] - begin[event], std::memory_order_relaxed);
+        }
+        available.fetch_or(t_available, std::memory_order_relaxed);
+    }
+
+    void SetError(const std::string& t_error) {
+        std::lock_guard<std::mutex> lk(m);
+        if (error.empty())
+            error = t_error;
+    }
+
+    // Means per phase call, one line per thread and phase, or why there is nothing to show.
+    std::string Report() {
+        std::ostringstream out;
+        unsigned have = available.load(std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if (have == 0 && !error.empty())
+                return "phase counters unavailable: " + error + "\n";
+        }
+        char line[256];
+        snprintf(line, sizeof(line), "%-6s %5s %8s %10s %10s %12s %6s %10s %10s %10s\n", "thread", "phase",
+                 "samples", "time_ns", "cycles", "instructions", "ipc", "l1d_miss", "llc_miss", "br_miss");
+        out << line;
+        for (int is_slave = 0; is_slave < 2; is_slave++) {
+            for (int phase = 0; phase < kMaxPhases; phase++) {
+                uint64_t n = samples[is_slave][phase].load(std::memory_order_relaxed);
+                if (n == 0)
+                    continue;
+                std::string mean[kNumPhaseEvents];
+                for (int event = 0; event < kNumPhaseEvents; event++)
+                    mean[event] = (have & (1u << event)) ? std::to_string(Total(is_slave, phase, event) / n) : "n/a";
+                std::string ipc = "n/a";
+                if ((have & (1u << kPhaseCycles)) && (have & (1u << kPhaseInstructions)) &&
+                    Total(is_slave, phase, kPhaseCycles) != 0) {
+                    char buf[32];
+                    snprintf(buf, sizeof(buf), "%.2f",
+                             double(Total(is_slave, phase, kPhaseInstructions)) / Total(is_slave, phase, kPhaseCycles));
+                    ipc = buf;
+                }
+                snprintf(line, sizeof(line), "%-6s %5d %8llu %10s %10s %12s %6s %10s %10s %10s\n",
+                         is_slave ? "slave" : "master", phase, (unsigned long long)n, mean[kPhaseTaskClock].c_str(),
+                         mean[kPhaseCycles].c_str(), mean[kPhaseInstructions].c_str(), ipc.c_str(),
+                         mean[kPhaseL1dMisses].c_str(), mean[kPhaseLlcMisses].c_str(),
+                         mean[kPhaseBranchMisses].c_str());
+                out << line;
+            }
+        }
+        return out.str();
+    }
+
+    // Totals in the Prometheus text format, to go with VdfMetrics::Render().
+    std::string RenderMetrics() {
+        std::ostringstream out;
+        unsigned have = available.load(std::memory_order_relaxed);
+        out << "# HELP vdf_phase_samples_total Squaring phase calls measured by the phase profiler.\n";
+        out << "# TYPE vdf_phase_samples_total counter\n";
+        for (int is_slave = 0; is_slave < 2; is_slave++) {
+            for (int phase = 0; phase < kMaxPhases; phase++) {
+                uint64_t n = samples[is_slave][phase].load(std::memory_order_relaxed);
+                if (n != 0)
+                    out << "vdf_phase_samples_total{" << Labels(is_slave, phase) << "} " << n << "\n";
+            }
+        }
+        out << "# HELP vdf_phase_events_total Counter totals over the measured squaring phase calls.\n";
+        out << "# TYPE vdf_phase_events_total counter\n";
+        for (int is_slave = 0; is_slave < 2; is_slave++) {
+            for (int phase = 0; phase < kMaxPhases; phase++) {
+                if (samples[is_slave][phase].load(std::memory_order_relaxed) == 0)
+                    continue;
+                for (int event = 0; event < kNumPhaseEvents; event++) {
+                    if (have & (1u << event))
+                        out << "vdf_phase_events_total{" << Labels(is_slave, phase) << ",event=\""
+                            << kPhaseEventNames[event] << "\"} " << Total(is_slave, phase, event) << "\n";
+                }
+            }
+        }
+        return out.str();
+    }
+
+  private:
+    uint64_t Total(int is_slave, int phase, int event) {
+        return totals[is_slave][phase][event].load(std::memory_order_relaxed);
+    }
+
+    static std::string Labels(int is_slave, int phase) {
+        return std::string("thread=\"") + (is_slave ? "slave" : "master") + "\",phase=\"" + std::to_string(phase) + "\"";
+    }
+
+    std::atomic<uint64_t> every{0};
+    std::atomic<uint64_t> samples[2][kMaxPhases] = {};
+    std::atomic<uint64_t> totals[2][kMaxPhases][kNumPhaseEvents] = {};
+    std::atomic<unsigned> available{0};
+    std::mutex m;
+    std::string error;
+};
+
+PhaseProfiler phase_profiler;
+thread_local PhaseCounterGroup phase_counter_group;
+
+// Measures the enclosing phase call if 'sampled'. Abort() drops the sample (the phase failed).
+class PhaseProfileScope {
+  public:
+    PhaseProfileScope(bool sampled, bool is_slave, int phase) : active(sampled), is_slave(is_slave), phase(phase) {
+        if (active)
+            active = ReadCounters(begin);
+    }
+
+    ~PhaseProfileScope() {
+        if (!active)
+            return;
+        uint64_t end[kNumPhaseEvents] = {};
+        if (ReadCounters(end))
+            phase_profiler.Record(is_slave, phase, begin, end, available);
+    }
+
+    void Abort() {
+        active = false;
+    }
+
+  private:
+    bool ReadCounters(uint64_t values[kNumPhaseEvents]) {
+        std::string error;
+        if (phase_counter_group.Read(values, available, error))
+            return true;
+        phase_profiler.SetError(error);
+        return false;
+    }
+
+    bool active;
+    bool is_slave;
+    int phase;
+    unsigned available = 0;
+    // Only filled in while active.
+    uint64_t begin[kNumPhaseEvents];
+};
+
+#endif // PHASE_PROFILER_H
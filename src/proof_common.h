@@ -1,23 +1,68 @@
 #ifndef PROOF_COMMON_H
 #define PROOF_COMMON_H
 #include "Reducer.h"
+#include <atomic>
+#include <mutex>
+
+// Writes x to out[0, num_bytes) as big endian two's complement, keeping the low bytes if it
+// doesn't fit.
+void WriteIntegerBytes(const integer& x, uint8_t* out, uint64_t num_bytes) {
+    bool negative = mpz_sgn(x.impl) < 0;
+    integer magnitude(x);
+    if (negative) {
+        // -x - 1, whose bytes are the complement of those of x.
+        mpz_neg(magnitude.impl, magnitude.impl);
+        mpz_sub_ui(magnitude.impl, magnitude.impl, 1);
+    }
+    memset(out, 0, num_bytes);
+    size_t size = (mpz_sizeinbase(magnitude.impl, 2) + 7) / 8;
+    size_t count;
+    if (size <= num_bytes) {
+        mpz_export(out + num_bytes - size, &count, 1, 1, 1, 0, magnitude.impl);
+    } else {
+        std::vector<uint8_t> all(size);
+        mpz_export(all.data(), &count, 1, 1, 1, 0, magnitude.impl);
+        memcpy(out, all.data() + size - num_bytes, num_bytes);
+    }
+    if (negative) {
+        for (uint64_t i = 0; i < num_bytes; i++)
+            out[i] ^= 255;
+    }
+}
+
+// Reads a big endian two's complement (or, with is_signed false, plain) number from
+// bytes[0, num_bytes).
+integer ReadIntegerBytes(const uint8_t* bytes, uint64_t num_bytes, bool is_signed = true) {
+    integer res(0);
+    if (num_bytes == 0)
+        return res;
+    mpz_import(res.impl, num_bytes, 1, 1, 1, 0, bytes);
+    if (is_signed && (bytes[0] & (1 << 7))) {
+        integer modulus(1);
+        mpz_mul_2exp(modulus.impl, modulus.impl, 8 * num_bytes);
+        mpz_sub(res.impl, res.impl, modulus.impl);
+    }
+    return res;
+}
+
+// Big endian unsigned fields of the proof and wire formats (iterations, sizes).
+void WriteUint64Bytes(uint64_t x, uint8_t* out, int num_bytes) {
+    for (int i = num_bytes - 1; i >= 0; i--) {
+        out[i] = x & 255;
+        x >>= 8;
+    }
+}
+
+uint64_t ReadUint64Bytes(const uint8_t* bytes, int num_bytes) {
+    uint64_t res = 0;
+    for (int i = 0; i < num_bytes; i++)
+        res = (res << 8) | bytes[i];
+    return res;
+}
 
 std::vector<unsigned char> ConvertIntegerToBytes(integer x, uint64_t num_bytes) {
-    std::vector<unsigned char> bytes;
-    bool negative = false;
-    if (x < 0) {
-        x = abs(x);
-        x = x - integer(1);
-        negative = true;
-    }
-    for (int iter = 0; iter < num_bytes; iter++) {
-        auto byte = (x % integer(256)).to_vector();
-        if (negative)
-            byte[0] ^= 255;
-        bytes.push_back(byte[0]);
-        x = x / integer(256);
-    }
-    std::reverse(bytes.begin(), bytes.end());
+    std::vector<unsigned char> bytes(num_bytes);
+    WriteIntegerBytes(x, bytes.data(), num_bytes);
     return bytes;
 }
 
@@ -55,14 +100,155 @@ integer HashPrime(std::vector<uint8_t> seed, int length, vector<int> bitmask) {
     }
 }
 
-std::vector<unsigned char> SerializeForm(form &y, int int_size) {
+// Writes the reduced y to out[0, 2 * int_size) as a then b.
+void SerializeForm(form &y, int int_size, uint8_t* out) {
     y.reduce();
-    std::vector<unsigned char> res = ConvertIntegerToBytes(y.a, int_size);
-    std::vector<unsigned char> b_res = ConvertIntegerToBytes(y.b, int_size);
-    res.insert(res.end(), b_res.begin(), b_res.end());
+    WriteIntegerBytes(y.a, out, int_size);
+    WriteIntegerBytes(y.b, out + int_size, int_size);
+}
+
+std::vector<unsigned char> SerializeForm(form &y, int int_size) {
+    std::vector<unsigned char> res(2 * int_size);
+    SerializeForm(y, int_size, res.data());
     return res;
 }
 
+// Compressed forms. A reduced form is kept as a, plus the cofactor t of |b| at the first remainder
+// r < sqrt(a) of the extended gcd of (a, |b|), plus signs. Since r = t * |b| (mod a) and
+// b^2 = D (mod a), r is the square root of t^2 * D mod a, and |b| = r / t (mod a). With
+// g = gcd(a, t), that only fixes |b| modulo a / g, so b0 = |b| / (a / g) is kept as well.
+// Layout: flags (1) | g size (1) | g | b0 | a | |t|, where a and t take a fixed number of bytes
+// for D, and g and b0 are left out (g size 0) when g == 1.
+const int kCompressedBNegative = 1;
+const int kCompressedTNegative = 2;
+// b0 when g == 1.
+const int kCompressedBOne = 4;
+
+int CompressedASize(const integer& D) {
+    return ((D.num_bits() + 1) / 2 + 7) / 8;
+}
+
+int CompressedTSize(const integer& D) {
+    return (((D.num_bits() + 1) / 2 + 1) / 2 + 7) / 8;
+}
+
+int MaxCompressedFormSize(const integer& D) {
+    return 2 + 2 * CompressedTSize(D) + CompressedASize(D) + CompressedTSize(D);
+}
+
+// Appends the compressed encoding of y, which is reduced first.
+void CompressForm(form &y, const integer& D, std::vector<uint8_t>& out) {
+    y.reduce();
+    integer b_abs = abs(y.b);
+    integer r_prev(y.a), r(b_abs);
+    integer t_prev(0), t(1);
+    integer q, tmp;
+    // Stop at the first remainder with r^2 < a.
+    while (true) {
+        mpz_mul(tmp.impl, r.impl, r.impl);
+        if (mpz_cmp(tmp.impl, y.a.impl) < 0)
+            break;
+        mpz_fdiv_qr(q.impl, tmp.impl, r_prev.impl, r.impl);
+        mpz_swap(r_prev.impl, r.impl);
+        mpz_swap(r.impl, tmp.impl);
+        mpz_mul(tmp.impl, q.impl, t.impl);
+        mpz_sub(tmp.impl, t_prev.impl, tmp.impl);
+        mpz_swap(t_prev.impl, t.impl);
+        mpz_swap(t.impl, tmp.impl);
+    }
+    integer g;
+    mpz_gcd(g.impl, y.a.impl, t.impl);
+    integer b0 = b_abs / (y.a / g);
+
+    int a_size = CompressedASize(D);
+    int t_size = CompressedTSize(D);
+    bool g_is_one = (g == integer(1));
+    int g_size = g_is_one ? 0 : (g.num_bits() + 7) / 8;
+    size_t offset = out.size();
+    out.resize(offset + 2 + 2 * g_size + a_size + t_size);
+    uint8_t* bytes = out.data() + offset;
+    bytes[0] = (y.b < integer(0) ? kCompressedBNegative : 0) | (t < integer(0) ? kCompressedTNegative : 0) |
+               ((g_is_one && b0 == integer(1)) ? kCompressedBOne : 0);
+    bytes[1] = g_size;
+    bytes += 2;
+    if (!g_is_one) {
+        WriteIntegerBytes(g, bytes, g_size);
+        WriteIntegerBytes(b0, bytes + g_size, g_size);
+        bytes += 2 * g_size;
+    }
+    WriteIntegerBytes(y.a, bytes, a_size);
+    WriteIntegerBytes(abs(t), bytes + a_size, t_size);
+}
+
+// Reads one compressed form from bytes[0, len). Returns the number of bytes used, or 0 if they
+// aren't the encoding CompressForm gives a form of discriminant D.
+int DecompressForm(const uint8_t* bytes, int len, integer& D, form& out) {
+    int a_size = CompressedASize(D);
+    int t_size = CompressedTSize(D);
+    if (len < 2)
+        return 0;
+    int flags = bytes[0];
+    int g_size = bytes[1];
+    int size = 2 + 2 * g_size + a_size + t_size;
+    if (g_size > t_size || len < size)
+        return 0;
+    const uint8_t* p = bytes + 2;
+    integer g(1), b0((flags & kCompressedBOne) ? 1 : 0);
+    if (g_size > 0) {
+        g = ReadIntegerBytes(p, g_size, false);
+        b0 = ReadIntegerBytes(p + g_size, g_size, false);
+        p += 2 * g_size;
+    }
+    integer a = ReadIntegerBytes(p, a_size, false);
+    integer t = ReadIntegerBytes(p + a_size, t_size, false);
+    if (flags & kCompressedTNegative)
+        t = -t;
+    if (a <= integer(0) || t == integer(0))
+        return 0;
+
+    integer gcd;
+    mpz_gcd(gcd.impl, a.impl, t.impl);
+    if (!(gcd == g))
+        return 0;
+    // r^2 = t^2 * D mod a, with r < sqrt(a).
+    integer x, r;
+    mpz_mul(x.impl, t.impl, t.impl);
+    mpz_mul(x.impl, x.impl, D.impl);
+    mpz_mod(x.impl, x.impl, a.impl);
+    if (!mpz_perfect_square_p(x.impl))
+        return 0;
+    mpz_sqrt(r.impl, x.impl);
+    if (!mpz_divisible_p(r.impl, g.impl))
+        return 0;
+    integer a_reduced = a / g;
+    integer t_reduced = t / g;
+    integer b;
+    if (!mpz_invert(b.impl, t_reduced.impl, a_reduced.impl) && !(a_reduced == integer(1)))
+        return 0;
+    if (a_reduced == integer(1))
+        b = integer(0);
+    mpz_mul(b.impl, b.impl, (r / g).impl);
+    mpz_mod(b.impl, b.impl, a_reduced.impl);
+    mpz_addmul(b.impl, b0.impl, a_reduced.impl);
+    if (b > a)
+        return 0;
+    if (flags & kCompressedBNegative)
+        b = -b;
+    form f;
+    try {
+        f = form::from_abd(a, b, D);
+    } catch (std::exception& e) {
+        return 0;
+    }
+    // Every form has one encoding: anything CompressForm wouldn't have written is rejected.
+    std::vector<uint8_t> canonical;
+    CompressForm(f, D, canonical);
+    if (canonical.size() != size || memcmp(canonical.data(), bytes, size) != 0)
+        return 0;
+    out = f;
+    return size;
+}
+
 integer FastPow(uint64_t a, uint64_t b, integer& c) {
     integer res, a1 = integer(a);
     mpz_powm_ui(res.impl, a1.impl, b, c.impl);
@@ -71,9 +257,9 @@ integer FastPow(uint64_t a, uint64_t b, integer& c) {
 
 integer GetB(const integer& D, form &x, form& y) {
     int int_size = (D.num_bits() + 16) >> 4;
-    std::vector<unsigned char> serialization = SerializeForm(x, int_size);
-    std::vector<unsigned char> serialization_y = SerializeForm(y, int_size);
-    serialization.insert(serialization.end(), serialization_y.begin(), serialization_y.end());
+    std::vector<unsigned char> serialization(4 * int_size);
+    SerializeForm(x, int_size, serialization.data());
+    SerializeForm(y, int_size, serialization.data() + 2 * int_size);
     return HashPrime(serialization, 264, {263});
 }
 
@@ -105,31 +291,298 @@ class PulmarkReducer {
     }
 };
 
+// Optional engine for runs of squarings, set by binaries that link the fast squaring code (vdf.h).
+// Squares f in place up to 'iterations' times and returns how many squarings it did; 0 means it
+// declined. NULL means every squaring goes through nudupl_form.
+uint64_t (*fast_square_engine)(form& f, integer& D, integer& L, uint64_t iterations) = NULL;
+
+// After fast_square_engine declines (e.g. on the first squarings of the generator, which the fast
+// code doesn't handle, or with every counter pair taken), this many squarings are done with
+// nudupl_form before it's tried again.
+const uint64_t kFastSquareRetryInterval = 64;
+
+// Squares f 'iterations' times, through fast_square_engine when there is one. Whatever the engine
+// doesn't do is done with nudupl_form, one step at a time.
+// Even single squarings go to the engine: 11.1-11.4 us against 13.6-16.9 us with nudupl_form (1024 bits,
+// under init_gmp's allocator).
+void RepeatedSquareForm(form& f, integer &D, integer &L, uint64_t iterations, PulmarkReducer& reducer)
+{
+    int D_size = D.impl->_mp_size;
+    uint64_t engine_wait = 0;
+    while (iterations > 0) {
+        if (fast_square_engine != NULL && engine_wait == 0) {
+            reducer.reduce(f);
+            uint64_t done = fast_square_engine(f, D, L, iterations);
+            iterations -= done;
+            // It stopped early or declined: do the next squaring here, and the next
+            // kFastSquareRetryInterval if it declined outright.
+            engine_wait = (done == 0) ? kFastSquareRetryInterval : 1;
+            if (iterations == 0)
+                break;
+        }
+        nudupl_form(f, f, D, L);
+        if (f.a.impl->_mp_size > D_size) {
+            reducer.reduce(f);
+        }
+        iterations--;
+        if (engine_wait > 0)
+            engine_wait--;
+    }
+}
+
+// x^num_iterations, left to right: each run of zero bits (and the squaring before every set bit)
+// is one RepeatedSquareForm call.
 form FastPowFormNucomp(form x, integer &D, integer num_iterations, integer &L, PulmarkReducer& reducer)
 {
     form res = form::identity(D);
+    if (num_iterations == integer(0)) {
+        return res;
+    }
     int D_size = D.impl->_mp_size;
 
-    while (1) {
-        if (num_iterations.get_bit(0)) {
+    res = x;
+    uint64_t squarings = 0;
+    for (int bit = num_iterations.num_bits() - 2; bit >= 0; bit--) {
+        squarings++;
+        if (num_iterations.get_bit(bit)) {
+            RepeatedSquareForm(res, D, L, squarings, reducer);
+            squarings = 0;
             nucomp_form(res, res, x, D, L);
             if (res.a.impl->_mp_size > D_size) {
                 // Reduce only when 'a' has more limbs than D
                 reducer.reduce(res);
             }
         }
+    }
+    RepeatedSquareForm(res, D, L, squarings, reducer);
+    return res;
+}
+
+// Width-'window' NAF of e >= 0, least significant digit first. Nonzero digits are odd, below
+// 2^(window - 1) in absolute value, and at least 'window' positions apart.
+std::vector<int> WnafDigits(integer e, int window) {
+    std::vector<int> digits;
+    int modulus = 1 << window;
+    while (e > integer(0)) {
+        int digit = 0;
+        if (e.get_bit(0)) {
+            digit = mpz_fdiv_ui(e.impl, modulus);
+            if (digit >= modulus / 2)
+                digit -= modulus;
+            if (digit > 0)
+                mpz_sub_ui(e.impl, e.impl, digit);
+            else
+                mpz_add_ui(e.impl, e.impl, -digit);
+        }
+        digits.push_back(digit);
+        e >>= 1;
+    }
+    return digits;
+}
+
+// Lim-Lee comb table for a base that is raised to many exponents under one discriminant. With
+// spacing = ceil(max_bits / kCombTeeth), entries[m] is the product of base^(2^(i * spacing)) over
+// the set bits i of m, so base^e for e < 2^max_bits costs at most 'spacing' multiplications and no
+// squarings of its own. Never changed once built, so threads can share one.
+const int kCombTeeth = 8;
+
+struct FixedBaseTable {
+    form base;
+    int max_bits;
+    int spacing;
+    std::vector<form> entries;
+
+    // Column 'column' of e: bit i is bit i * spacing + column of e.
+    int CombDigit(const integer& e, int column) const {
+        int digit = 0;
+        for (int i = 0; i < kCombTeeth; i++) {
+            if (mpz_tstbit(e.impl, i * spacing + column))
+                digit |= 1 << i;
+        }
+        return digit;
+    }
+};
+
+std::shared_ptr<FixedBaseTable> BuildFixedBaseTable(form base, integer &D, integer &L, int max_bits, PulmarkReducer& reducer)
+{
+    int D_size = D.impl->_mp_size;
+    std::shared_ptr<FixedBaseTable> table(new FixedBaseTable);
+    table->base = base;
+    table->max_bits = max_bits;
+    table->spacing = (max_bits + kCombTeeth - 1) / kCombTeeth;
+    table->entries.resize(1 << kCombTeeth);
+    table->entries[0] = form::identity(D);
+    form tooth = base;
+    for (int i = 0; i < kCombTeeth; i++) {
+        if (i > 0) {
+            RepeatedSquareForm(tooth, D, L, table->spacing, reducer);
+            reducer.reduce(tooth);
+        }
+        table->entries[1 << i] = tooth;
+        for (int m = 1; m < (1 << i); m++) {
+            form& f = table->entries[(1 << i) | m];
+            nucomp_form(f, table->entries[m], tooth, D, L);
+            if (f.a.impl->_mp_size > D_size) {
+                reducer.reduce(f);
+            }
+        }
+    }
+    return table;
+}
 
-        num_iterations >>= 1;
-        if (num_iterations == 0) {
-            break;
+// Comb tables for the bases in use, e.g. recent checkpoints of the current challenge. Once there are
+// more than kFixedBaseCacheSize tables the oldest is dropped; callers holding it keep it alive.
+const int kFixedBaseCacheSize = 16;
+
+class FixedBaseCache {
+  public:
+    // The table for (D, base, max_bits), or NULL if nobody built it.
+    std::shared_ptr<const FixedBaseTable> Find(integer &D, form &base, int max_bits) {
+        // Most processes never build a table; they shouldn't pay for the key and the lock.
+        if (size.load(std::memory_order_acquire) == 0)
+            return NULL;
+        std::string key = Key(D, base, max_bits);
+        std::lock_guard<std::mutex> lk(lock);
+        for (auto& entry : tables) {
+            if (entry.first == key)
+                return entry.second;
         }
+        return NULL;
+    }
+
+    // Like Find, but builds the table if it's missing.
+    std::shared_ptr<const FixedBaseTable> Get(integer &D, integer &L, form &base, int max_bits) {
+        std::shared_ptr<const FixedBaseTable> table = Find(D, base, max_bits);
+        if (table != NULL)
+            return table;
+        // Built outside the lock; if two threads race, both tables are correct and one is kept.
+        PulmarkReducer reducer;
+        table = BuildFixedBaseTable(base, D, L, max_bits, reducer);
+        std::lock_guard<std::mutex> lk(lock);
+        tables.emplace_back(Key(D, base, max_bits), table);
+        if (tables.size() > kFixedBaseCacheSize)
+            tables.pop_front();
+        size.store(tables.size(), std::memory_order_release);
+        return table;
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lk(lock);
+        tables.clear();
+        size.store(0, std::memory_order_release);
+    }
 
-        nudupl_form(x, x, D, L);
-        if (x.a.impl->_mp_size > D_size) {
-            reducer.reduce(x);
+  private:
+    static std::string Key(integer &D, form &base, int max_bits) {
+        return D.to_string() + " " + base.a.to_string() + " " + base.b.to_string() + " " + std::to_string(max_bits);
+    }
+
+    std::mutex lock;
+    std::deque<std::pair<std::string, std::shared_ptr<const FixedBaseTable>>> tables;
+    std::atomic<size_t> size{0};
+};
+
+FixedBaseCache fixed_base_cache;
+
+// prod(bases[i] ^ exponents[i]) * prod(fixed[i]->base ^ fixed_exponents[i]) with one shared squaring
+// chain (Straus). Variable exponents are recoded to wNAF, so only odd powers are precomputed and
+// negative digits multiply by the inverse, which is the same form with b negated. Fixed bases
+// contribute one comb column per position in the last 'spacing' positions. Exponents must be
+// non-negative, and fixed_exponents[i] below 2^fixed[i]->max_bits.
+form MultiPowFormNucomp(std::vector<form>& bases, std::vector<integer>& exponents,
+                        std::vector<std::shared_ptr<const FixedBaseTable>>& fixed, std::vector<integer>& fixed_exponents,
+                        integer &D, integer &L, PulmarkReducer& reducer, int window = 5)
+{
+    int D_size = D.impl->_mp_size;
+    int table_size = 1 << (window - 2);
+    std::vector<std::vector<int>> digits;
+    int max_digits = 0;
+    for (integer& e : exponents) {
+        digits.push_back(WnafDigits(e, window));
+        max_digits = std::max(max_digits, (int)digits.back().size());
+    }
+    for (int i = 0; i < fixed.size(); i++) {
+        assert(fixed_exponents[i].num_bits() <= fixed[i]->max_bits);
+        max_digits = std::max(max_digits, fixed[i]->spacing);
+    }
+    // table[i * table_size + j] = bases[i] ^ (2 * j + 1), inverse_table has the inverses.
+    std::vector<form> table(bases.size() * table_size);
+    std::vector<form> inverse_table(bases.size() * table_size);
+    for (int i = 0; i < bases.size(); i++) {
+        form* row = &table[i * table_size];
+        row[0] = bases[i];
+        if (table_size > 1) {
+            form square = bases[i];
+            nudupl_form(square, square, D, L);
+            reducer.reduce(square);
+            for (int j = 1; j < table_size; j++) {
+                nucomp_form(row[j], row[j - 1], square, D, L);
+                if (row[j].a.impl->_mp_size > D_size) {
+                    reducer.reduce(row[j]);
+                }
+            }
+        }
+        for (int j = 0; j < table_size; j++) {
+            inverse_table[i * table_size + j] = row[j];
+            inverse_table[i * table_size + j].b = -row[j].b;
         }
     }
+
+    form res = form::identity(D);
+    bool started = false;
+    // Squarings owed to res, done in one run right before the next multiplication.
+    uint64_t squarings = 0;
+    auto multiply = [&](form& f) {
+        if (!started) {
+            res = f;
+            started = true;
+            return;
+        }
+        RepeatedSquareForm(res, D, L, squarings, reducer);
+        squarings = 0;
+        nucomp_form(res, res, f, D, L);
+        if (res.a.impl->_mp_size > D_size) {
+            reducer.reduce(res);
+        }
+    };
+    for (int pos = max_digits - 1; pos >= 0; pos--) {
+        if (started)
+            squarings++;
+        for (int i = 0; i < bases.size(); i++) {
+            if (pos >= digits[i].size() || digits[i][pos] == 0)
+                continue;
+            int digit = digits[i][pos];
+            multiply((digit > 0) ? table[i * table_size + (digit - 1) / 2] : inverse_table[i * table_size + (-digit - 1) / 2]);
+        }
+        for (int i = 0; i < fixed.size(); i++) {
+            if (pos >= fixed[i]->spacing)
+                continue;
+            int digit = fixed[i]->CombDigit(fixed_exponents[i], pos);
+            if (digit != 0) {
+                form f = fixed[i]->entries[digit];
+                multiply(f);
+            }
+        }
+    }
+    RepeatedSquareForm(res, D, L, squarings, reducer);
     return res;
 }
 
+form MultiPowFormNucomp(std::vector<form>& bases, std::vector<integer>& exponents, integer &D, integer &L, PulmarkReducer& reducer, int window = 5)
+{
+    std::vector<std::shared_ptr<const FixedBaseTable>> fixed;
+    std::vector<integer> fixed_exponents;
+    return MultiPowFormNucomp(bases, exponents, fixed, fixed_exponents, D, L, reducer, window);
+}
+
+// table->base ^ e using only the comb table: at most table->spacing squarings and multiplications.
+form FixedBasePowFormNucomp(std::shared_ptr<const FixedBaseTable> table, integer e, integer &D, integer &L, PulmarkReducer& reducer)
+{
+    std::vector<form> bases;
+    std::vector<integer> exponents;
+    std::vector<std::shared_ptr<const FixedBaseTable>> fixed = {table};
+    std::vector<integer> fixed_exponents = {e};
+    return MultiPowFormNucomp(bases, exponents, fixed, fixed_exponents, D, L, reducer);
+}
+
 # endif // PROOF_COMMON_H
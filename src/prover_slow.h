@@ -5,21 +5,12 @@
 #include "nucomp.h"
 #include "picosha2.h"
 #include "proof_common.h"
+#include "util.h"
+#include <atomic>
 
 
 // TODO: Refactor to use 'Prover' class once new_vdf is merged in.
 
-void ApproximateParameters(uint64_t T, int& l, int& k) {
-    double log_memory = 23.25349666;
-    double log_T = log2(T);
-    l = 1;
-    if (log_T - log_memory > 0.000001) {
-        l = ceil(pow(2, log_memory - 20));
-    }
-    double intermediate = T * (double)0.6931471 / (2.0 * l);
-    k = std::max(std::round(log(intermediate) - log(log(intermediate)) + 0.25), 1.0);
-}
-
 uint64_t GetBlock(uint64_t i, uint64_t k, uint64_t T, integer& B) {
     integer res = FastPow(2, T - k * (i + 1), B);
     mpz_mul_2exp(res.impl, res.impl, k);
@@ -28,76 +19,114 @@ uint64_t GetBlock(uint64_t i, uint64_t k, uint64_t T, integer& B) {
     return res_vector[0];
 }
 
-form GenerateWesolowski(form &y, form &x_init, 
-                        integer &D, PulmarkReducer& reducer, 
-                        std::vector<form>& intermediates,
-                        uint64_t num_iterations, 
-                        uint64_t k, uint64_t l) {
-    integer B = GetB(D, x_init, y);
-    integer L=root(-D, 4);
-
+// Row j of the proof (the blocks i * l + j), before it's raised to 2^(k * j).
+form GenerateWesolowskiRow(int64_t j, integer &D, integer &L, integer &B, PulmarkReducer& reducer,
+                           std::vector<form>& intermediates,
+                           uint64_t num_iterations, uint64_t k, uint64_t l) {
     uint64_t k1 = k / 2;
     uint64_t k0 = k - k1;
 
     form x = form::identity(D);
 
-    for (int64_t j = l - 1; j >= 0; j--) {
-        x = FastPowFormNucomp(x, D, integer(1 << k), L, reducer);
-
-        std::vector<form> ys((1 << k));
-        for (uint64_t i = 0; i < (1 << k); i++)
-            ys[i] = form::identity(D);
+    std::vector<form> ys((1 << k));
+    for (uint64_t i = 0; i < (1 << k); i++)
+        ys[i] = form::identity(D);
 
-        form *tmp;
-        for (uint64_t i = 0; i < ceil(1.0 * num_iterations / (k * l)); i++) {
-            if (num_iterations >= k * (i * l + j + 1)) {
-                uint64_t b = GetBlock(i*l + j, k, num_iterations, B);
-                tmp = &intermediates[i];
-                nucomp_form(ys[b], ys[b], *tmp, D, L);
-            }
-        }
-        for (uint64_t b1 = 0; b1 < (1 << k1); b1++) {
-            form z = form::identity(D);
-            for (uint64_t b0 = 0; b0 < (1 << k0); b0++) {
-                nucomp_form(z, z, ys[b1 * (1 << k0) + b0], D, L);
-            }
-            z = FastPowFormNucomp(z, D, integer(b1 * (1 << k0)), L, reducer);
-            nucomp_form(x, x, z, D, L);
+    form *tmp;
+    for (uint64_t i = 0; i < ceil(1.0 * num_iterations / (k * l)); i++) {
+        if (num_iterations >= k * (i * l + j + 1)) {
+            uint64_t b = GetBlock(i*l + j, k, num_iterations, B);
+            tmp = &intermediates[i];
+            nucomp_form(ys[b], ys[b], *tmp, D, L);
         }
+    }
+    for (uint64_t b1 = 0; b1 < (1 << k1); b1++) {
+        form z = form::identity(D);
         for (uint64_t b0 = 0; b0 < (1 << k0); b0++) {
-            form z = form::identity(D);
-            for (uint64_t b1 = 0; b1 < (1 << k1); b1++) {
-                nucomp_form(z, z, ys[b1 * (1 << k0) + b0], D, L);
-            }
-            z = FastPowFormNucomp(z, D, integer(b0), L, reducer);
-            nucomp_form(x, x, z, D, L);
+            nucomp_form(z, z, ys[b1 * (1 << k0) + b0], D, L);
         }
+        z = FastPowFormNucomp(z, D, integer(b1 * (1 << k0)), L, reducer);
+        nucomp_form(x, x, z, D, L);
+    }
+    for (uint64_t b0 = 0; b0 < (1 << k0); b0++) {
+        form z = form::identity(D);
+        for (uint64_t b1 = 0; b1 < (1 << k1); b1++) {
+            nucomp_form(z, z, ys[b1 * (1 << k0) + b0], D, L);
+        }
+        z = FastPowFormNucomp(z, D, integer(b0), L, reducer);
+        nucomp_form(x, x, z, D, L);
     }
-
     reducer.reduce(x);
     return x;
 }
 
+// The rows are independent, so up to 'threads' threads build them; they're then combined by
+// Horner's rule, x = x^(2^k) * row_j from the top row down.
+form GenerateWesolowski(form &y, form &x_init, 
+                        integer &D, PulmarkReducer& reducer, 
+                        std::vector<form>& intermediates,
+                        uint64_t num_iterations, 
+                        uint64_t k, uint64_t l, int threads = 1) {
+    integer B = GetB(D, x_init, y);
+    integer L=root(-D, 4);
+
+    std::vector<form> rows(l);
+    std::atomic<int64_t> next_row(0);
+    auto build_rows = [&] {
+        PulmarkReducer row_reducer;
+        int64_t j;
+        while ((j = next_row++) < (int64_t)l)
+            rows[j] = GenerateWesolowskiRow(j, D, L, B, row_reducer, intermediates, num_iterations, k, l);
+    };
+    threads = std::max(1, std::min(threads, (int)l));
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++)
+        workers.emplace_back(build_rows);
+    build_rows();
+    for (std::thread& worker : workers)
+        worker.join();
+
+    form x = form::identity(D);
+    for (int64_t j = l - 1; j >= 0; j--) {
+        RepeatedSquareForm(x, D, L, k, reducer);
+        nucomp_form(x, x, rows[j], D, L);
+        reducer.reduce(x);
+    }
+    return x;
+}
+
+// ProveSlow reports progress at most this often.
+const uint64_t kProveProgressInterval = 100000;
+
+// Proves num_iterations from the generator; returns y | proof. Squarings go through
+// RepeatedSquareForm, so binaries that install fast_square_engine square with it. 'progress', if
+// set, gets the number of iterations done so far, at least once at the end of the squarings;
+// returning false stops the proof, and an empty result is returned.
 std::vector<uint8_t> ProveSlow(std::vector<uint8_t>& challenge_hash, int discriminant_size_bits,
-                           uint64_t num_iterations) {
+                           uint64_t num_iterations, int threads = 1,
+                           std::function<bool(uint64_t)> progress = nullptr) {
     integer D = CreateDiscriminant(challenge_hash, discriminant_size_bits);
     integer L = root(-D, 4);
     PulmarkReducer reducer;
     form y = form::generator(D);
     std::vector<form> intermediates;
-    int k, l;
+    uint32_t k, l;
     int int_size = (D.num_bits() + 16) >> 4;
 
-    ApproximateParameters(num_iterations, l, k);
-    for (int i = 0; i < num_iterations; i++) {
-        if (i % (k * l) == 0) {
-            intermediates.push_back(y);
-        }
-        nudupl_form(y, y, D, L);
+    SingleProofReservation reservation(DefaultPlanner(), num_iterations, k, l);
+    uint64_t next_report = kProveProgressInterval;
+    for (uint64_t i = 0; i < num_iterations; i += k * l) {
+        intermediates.push_back(y);
+        RepeatedSquareForm(y, D, L, std::min((uint64_t)k * l, num_iterations - i), reducer);
         reducer.reduce(y);
-    } 
+        if (progress && (i + k * l >= next_report || i + k * l >= num_iterations)) {
+            if (!progress(std::min(i + k * l, num_iterations)))
+                return std::vector<uint8_t>();
+            next_report = i + k * l + kProveProgressInterval;
+        }
+    }
     form x = form::generator(D);
-    form proof = GenerateWesolowski(y, x, D, reducer, intermediates, num_iterations, k, l);
+    form proof = GenerateWesolowski(y, x, D, reducer, intermediates, num_iterations, k, l, threads);
     std::vector<uint8_t> result = SerializeForm(y, int_size);
     std::vector<uint8_t> proof_bytes = SerializeForm(proof, int_size);
     result.insert(result.end(), proof_bytes.begin(), proof_bytes.end());
@@ -23,14 +23,14 @@ Proof CreateProof(integer D, ProverManager& pm, uint64_t iteration) {
     return proof;
 }
 
-int gcd_base_bits=50;
-int gcd_128_max_iter=3;
+int gcd_base_bits=cel_gcd_base_bits;
+int gcd_128_max_iter=cel_gcd_128_max_iter;
 
 int main() {
     if(hasAVX2())
     {
-      gcd_base_bits=63;
-      gcd_128_max_iter=2;
+      gcd_base_bits=avx2_gcd_base_bits;
+      gcd_128_max_iter=avx2_gcd_128_max_iter;
     }
     std::vector<uint8_t> challenge_hash({0, 0, 1, 2, 3, 3, 4, 4});
     integer D = CreateDiscriminant(challenge_hash, 1024);
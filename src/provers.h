@@ -58,7 +58,7 @@ class Prover {
         form x = id;
 
         for (int64_t j = l - 1; j >= 0; j--) {
-            x = FastPowFormNucomp(x, D, integer(1 << k), L, reducer);
+            RepeatedSquareForm(x, D, L, k, reducer);
 
             std::vector<form> ys((1 << k));
             for (uint64_t i = 0; i < (1 << k); i++)
@@ -114,14 +114,13 @@ class Prover {
 
 class OneWesolowskiProver : public Prover {
   public:
-    OneWesolowskiProver(Segment segm, integer D, form* intermediates) : Prover(segm, D) {
+    // 'intermediates' are the forms every k * l iterations of the segment. If 'stop_signal' is
+    // given, setting it abandons the proof.
+    OneWesolowskiProver(Segment segm, integer D, form* intermediates, uint32_t k, uint32_t l, bool* stop_signal = NULL) : Prover(segm, D) {
         this->intermediates = intermediates;
-        if (num_iterations >= (1 << 16)) {
-            ApproximateParameters(num_iterations, k, l);
-        } else {
-            k = 10;
-            l = 1;
-        }
+        this->k = k;
+        this->l = l;
+        this->stop_signal = stop_signal;
     }
 
     form* GetForm(uint64_t iteration) {
@@ -136,7 +135,7 @@ class OneWesolowskiProver : public Prover {
     }
 
     bool PerformExtraStep() {
-        return true;
+        return stop_signal == NULL || !*stop_signal;
     }
 
     void OnFinish() {
@@ -145,31 +144,97 @@ class OneWesolowskiProver : public Prover {
 
   private:
     form* intermediates;
+    bool* stop_signal;
+};
+
+// Measured cost of the steps of Prover::GenerateProof under one discriminant. Used to pick k and l,
+// and to estimate how long a segment takes to prove.
+struct ProverCostModel {
+    ProverCostModel(integer& D) {
+        integer L = root(-D, 4);
+        PulmarkReducer reducer;
+        form x = form::generator(D);
+        for (int i = 0; i < 64; i++) {
+            nudupl_form(x, x, D, L);
+            reducer.reduce(x);
+        }
+        form y = x;
+        auto t1 = std::chrono::steady_clock::now();
+        for (int i = 0; i < kSamples; i++) {
+            nucomp_form(y, y, x, D, L);
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        nucomp_seconds = std::chrono::duration<double>(t2 - t1).count() / kSamples;
+
+        integer B = GetB(D, x, y);
+        uint64_t total = 0;
+        t1 = std::chrono::steady_clock::now();
+        for (int i = 0; i < kSamples; i++) {
+            integer res = FastPow(2, 100000000 - 10 * i, B);
+            mpz_mul_2exp(res.impl, res.impl, 10);
+            res = res / B;
+            total += res.to_vector()[0];
+        }
+        t2 = std::chrono::steady_clock::now();
+        block_seconds = std::chrono::duration<double>(t2 - t1).count() / kSamples;
+    }
+
+    // Time GenerateProof takes for 'length' iterations on one free core.
+    double ProvingSeconds(uint64_t length, uint32_t k, uint32_t l) {
+        return ParameterPlanner::ProvingCost(length, k, l, block_seconds / nucomp_seconds) * nucomp_seconds;
+    }
+
+    // Picks the fastest k and l for a segment whose intermediates are stored every 'stride'
+    // iterations. k * l has to be a multiple of the stride.
+    void ChooseParameters(uint64_t length, uint32_t stride, uint32_t& k, uint32_t& l) {
+        DefaultPlanner().Choose(length, length, stride, k, l, block_seconds / nucomp_seconds);
+    }
+
+    double ProvingSeconds(uint64_t length, uint32_t stride) {
+        uint32_t k, l;
+        ChooseParameters(length, stride, k, l);
+        return ProvingSeconds(length, k, l);
+    }
+
+    double nucomp_seconds;
+    double block_seconds;
+
+  private:
+    const int kSamples = 64;
 };
 
 class TwoWesolowskiProver : public Prover{
   public:
-    TwoWesolowskiProver(Segment segm, integer D, TwoWesolowskiCallback* weso, bool& stop_signal) : Prover(segm, D), stop_signal(stop_signal) {
+    TwoWesolowskiProver(Segment segm, integer D, TwoWesolowskiCallback* weso, bool& stop_signal, uint32_t k, uint32_t l) : Prover(segm, D), stop_signal(stop_signal) {
         this->weso = weso;
         this->done_iterations = segm.start;
-        k = 10;
-        l = (segm.length < 10000000) ? 1 : 10;
+        this->k = k;
+        this->l = l;
+        cancelled = false;
+    }
+
+    ~TwoWesolowskiProver() {
+        stop();
     }
 
     void start() {
-        std::thread t([=] { GenerateProof(); });
-        t.detach();
+        th = std::thread([=] { GenerateProof(); });
     }
 
     virtual form* GetForm(uint64_t i) {
         return weso->GetForm(done_iterations + i * k * l);
     }
     
+    // Cancels the proof if it is still running and waits for its thread.
     void stop() {
+        cancelled = true;
+        if (th.joinable()) {
+            th.join();
+        }
     }
 
     bool PerformExtraStep() {
-        return !stop_signal;
+        return !stop_signal && !cancelled;
     }
 
     void OnFinish() {
@@ -179,6 +244,8 @@ class TwoWesolowskiProver : public Prover{
   private:
     TwoWesolowskiCallback* weso;
     bool& stop_signal;
+    std::atomic<bool> cancelled;
+    std::thread th;
     uint64_t done_iterations;
 };
 
@@ -192,14 +259,7 @@ class InterruptableProver: public Prover {
         this->weso = weso;
         this->done_iterations = segm.start;
         this->bucket = segm.GetSegmentBucket();
-        if (segm.length <= (1 << 16))
-            k = 10;
-        else
-            k = 12;
-        if (segm.length <= (1 << 18)) 
-            l = 1;
-        else
-            l = (segm.length >> 18);
+        weso->GetBucketParameters(bucket, k, l);
         is_paused = false;
         is_fully_finished = false;
         joined = false;
@@ -1,23 +1,113 @@
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#ifdef CHIAVDF_FAST_SQUARE
+#include "../fast_square.h"
+#endif
 #include "../verifier.h"
 #include "../prover_slow.h"
 
 namespace py = pybind11;
 
+// Byte entry points take the discriminant as big endian two's complement (as returned by
+// create_discriminant_bytes) and each form as a | b, two big endian integers of equal size (as
+// returned by prove). They read the caller's buffers directly instead of going through strings.
+
+// A C contiguous view of a buffer's bytes, exported until this goes away. Buffers that can't give
+// one, e.g. a strided memoryview, raise BufferError.
+class BufferBytes {
+  public:
+    explicit BufferBytes(const py::buffer& buffer) {
+        if (PyObject_GetBuffer(buffer.ptr(), &view, PyBUF_C_CONTIGUOUS) != 0)
+            throw py::error_already_set();
+    }
+
+    ~BufferBytes() {
+        PyBuffer_Release(&view);
+    }
+
+    BufferBytes(const BufferBytes&) = delete;
+    BufferBytes& operator=(const BufferBytes&) = delete;
+
+    const uint8_t* data() const {
+        return (const uint8_t*)view.buf;
+    }
+
+    size_t size() const {
+        return view.len;
+    }
+
+  private:
+    Py_buffer view;
+};
+
+integer BufferToInteger(const py::buffer& buffer) {
+    BufferBytes bytes(buffer);
+    return ReadIntegerBytes(bytes.data(), bytes.size());
+}
+
+// False if the bytes aren't a form of discriminant D.
+bool BufferToForm(integer& D, const py::buffer& buffer, form& f) {
+    BufferBytes bytes(buffer);
+    if (bytes.size() == 0 || bytes.size() % 2 != 0)
+        return false;
+    try {
+        f = DeserializeForm(D, bytes.data(), bytes.size() / 2);
+    } catch (std::exception& e) {
+        return false;
+    }
+    return true;
+}
+
+#ifdef CHIAVDF_FAST_SQUARE
+// Built with the position independent asm gcd kernels (see CMakeLists.txt), so runs of squarings
+// go through fast_square_engine.
+int gcd_base_bits=cel_gcd_base_bits;
+int gcd_128_max_iter=cel_gcd_128_max_iter;
+#endif
+
 PYBIND11_MODULE(chiavdf, m) {
     m.doc() = "Chia proof of time";
 
+#ifdef CHIAVDF_FAST_SQUARE
+    init_gmp_shared();
+    if (hasAVX2()) {
+        gcd_base_bits=avx2_gcd_base_bits;
+        gcd_128_max_iter=avx2_gcd_128_max_iter;
+    }
+#endif
+
     // Creates discriminant.
     m.def("create_discriminant", [] (const py::bytes& challenge_hash, int discriminant_size_bits) {
         std::string challenge_hash_str(challenge_hash);
         auto challenge_hash_bits = std::vector<uint8_t>(challenge_hash_str.begin(), challenge_hash_str.end());
-        integer D = CreateDiscriminant(
-            challenge_hash_bits,
-            discriminant_size_bits
-        );
+        integer D;
+        {
+            py::gil_scoped_release release;
+            D = CreateDiscriminant(
+                challenge_hash_bits,
+                discriminant_size_bits
+            );
+        }
         return D.to_string();
     });
 
+    // Same discriminant as big endian two's complement bytes.
+    m.def("create_discriminant_bytes", [] (const py::bytes& challenge_hash, int discriminant_size_bits) {
+        std::string challenge_hash_str(challenge_hash);
+        auto challenge_hash_bits = std::vector<uint8_t>(challenge_hash_str.begin(), challenge_hash_str.end());
+        std::vector<uint8_t> result;
+        {
+            py::gil_scoped_release release;
+            integer D = CreateDiscriminant(
+                challenge_hash_bits,
+                discriminant_size_bits
+            );
+            result.resize((D.num_bits() + 8) / 8);
+            WriteIntegerBytes(D, result.data(), result.size());
+        }
+        return py::bytes(reinterpret_cast<char*>(result.data()), result.size());
+    });
+
     // Checks a simple wesolowski proof.
     m.def("verify_wesolowski", [] (const string& discriminant,
                                    const string& x_a, const string& x_b,
@@ -41,15 +131,102 @@ PYBIND11_MODULE(chiavdf, m) {
             D
         );
         bool is_valid = false;
+        py::gil_scoped_release release;
         VerifyWesolowskiProof(D, x, y, proof, num_iterations, is_valid);
         return is_valid;
     });
 
-    m.def("prove", [] (const py::bytes& challenge_hash, int discriminant_size_bits, uint64_t num_iterations) {
+    // Checks a simple wesolowski proof given as bytes. Forms that don't belong to D fail the check.
+    m.def("verify_wesolowski_bytes", [] (const py::buffer& discriminant, const py::buffer& x_s,
+                                         const py::buffer& y_s, const py::buffer& proof_s,
+                                         uint64_t num_iterations) {
+        integer D = BufferToInteger(discriminant);
+        form x, y, proof;
+        if (!BufferToForm(D, x_s, x) || !BufferToForm(D, y_s, y) || !BufferToForm(D, proof_s, proof))
+            return false;
+        bool is_valid = false;
+        py::gil_scoped_release release;
+        VerifyWesolowskiProof(D, x, y, proof, num_iterations, is_valid);
+        return is_valid;
+    });
+
+    // Checks an n-wesolowski proof blob (y | proof | (iters | y_i | proof_i) * recursion) from x.
+    // Segments are checked in parallel.
+    m.def("verify_n_wesolowski", [] (const py::buffer& discriminant, const py::buffer& x_s,
+                                     const py::buffer& proof_blob, uint64_t num_iterations,
+                                     int recursion) {
+        integer D = BufferToInteger(discriminant);
+        form x;
+        if (!BufferToForm(D, x_s, x))
+            return false;
+        // The blob is read in place; its buffer stays exported until 'blob' goes away.
+        BufferBytes blob(proof_blob);
+        py::gil_scoped_release release;
+        try {
+            return CheckProofOfTimeNWesolowski(D, x, (uint8_t*)blob.data(), blob.size(), num_iterations, recursion);
+        } catch (std::exception& e) {
+            return false;
+        }
+    });
+
+    // Checks a list of (discriminant, x, y, proof, num_iterations) simple wesolowski proofs, in
+    // bytes, and returns one verdict per proof. See VerifyWesolowskiBatch.
+    m.def("verify_batch", [] (const py::list& proofs, int threads) {
+        std::vector<bool> result(proofs.size(), false);
+        std::vector<WesolowskiInstance> instances;
+        std::vector<int> positions;
+        for (int i = 0; i < proofs.size(); i++) {
+            py::tuple proof = proofs[i].cast<py::tuple>();
+            if (proof.size() != 5)
+                throw std::invalid_argument("each proof is (discriminant, x, y, proof, num_iterations)");
+            WesolowskiInstance instance;
+            instance.D = BufferToInteger(proof[0].cast<py::buffer>());
+            instance.iters = proof[4].cast<uint64_t>();
+            if (!BufferToForm(instance.D, proof[1].cast<py::buffer>(), instance.x) ||
+                !BufferToForm(instance.D, proof[2].cast<py::buffer>(), instance.y) ||
+                !BufferToForm(instance.D, proof[3].cast<py::buffer>(), instance.proof))
+                continue;
+            instances.push_back(instance);
+            positions.push_back(i);
+        }
+        {
+            py::gil_scoped_release release;
+            std::vector<bool> valid = VerifyWesolowskiBatch(instances, threads);
+            for (int i = 0; i < instances.size(); i++)
+                result[positions[i]] = valid[i];
+        }
+        return result;
+    }, py::arg("proofs"), py::arg("threads") = 0);
+
+    // Proves num_iterations from the generator and returns y | proof, or None if 'progress' stopped
+    // it. 'progress', if given, is called with the iterations done so far and stops the proof by
+    // returning False; an exception it raises (e.g. KeyboardInterrupt) propagates. The proof is
+    // built on 'threads' threads (0 = all hardware threads). The squarings themselves stay on one
+    // thread, with fast_square_engine when the module has the asm kernels and nudupl_form otherwise.
+    m.def("prove", [] (const py::bytes& challenge_hash, int discriminant_size_bits, uint64_t num_iterations,
+                       int threads, py::object progress) -> py::object {
         std::string challenge_hash_str(challenge_hash);
         std::vector<uint8_t> challenge_hash_bytes(challenge_hash_str.begin(), challenge_hash_str.end());
-        auto result = ProveSlow(challenge_hash_bytes, discriminant_size_bits, num_iterations);
+        if (threads <= 0)
+            threads = std::max(1, (int)std::thread::hardware_concurrency());
+        std::function<bool(uint64_t)> on_progress = [&progress] (uint64_t done) {
+            py::gil_scoped_acquire acquire;
+            if (PyErr_CheckSignals() != 0)
+                throw py::error_already_set();
+            if (progress.is_none())
+                return true;
+            py::object keep_going = progress(done);
+            return keep_going.is_none() || keep_going.cast<bool>();
+        };
+        std::vector<uint8_t> result;
+        {
+            py::gil_scoped_release release;
+            result = ProveSlow(challenge_hash_bytes, discriminant_size_bits, num_iterations, threads, on_progress);
+        }
+        if (result.empty())
+            return py::none();
         py::bytes ret = py::bytes(reinterpret_cast<char*>(result.data()), result.size());
         return ret;
-    });
+    }, py::arg("challenge_hash"), py::arg("discriminant_size_bits"), py::arg("num_iterations"),
+       py::arg("threads") = 0, py::arg("progress") = py::none());
 }
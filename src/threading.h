@@ -2,6 +2,8 @@
 #define THREADING_H
 
 #include <boost/align/aligned_alloc.hpp>
+#include <mutex>
+#include <unordered_set>
 
 //mp_limb_t is an unsigned integer
 static_assert(sizeof(mp_limb_t)==8, "");
@@ -210,6 +212,55 @@ void init_gmp() {
     mp_set_memory_functions(mp_alloc_func, mp_realloc_func, mp_free_func);
 }
 
+//
+//
+
+//init_gmp_shared is for libraries, which get loaded after gmp may have allocated memory with other functions
+//(e.g. the python module). gmp keeps those functions, except for the data inside mpz class instances, which
+//they can't free or reallocate; the instances register it so it can be recognized
+bool gmp_shared=false;
+void* (*mp_prior_alloc_func)(size_t)=nullptr;
+void* (*mp_prior_realloc_func)(void*, size_t, size_t)=nullptr;
+void (*mp_prior_free_func)(void*, size_t)=nullptr;
+
+std::mutex mpz_inline_data_mutex;
+std::unordered_set<void*> mpz_inline_data;
+
+bool is_mpz_inline_data(void* ptr) {
+    //the mpz class data is 64-aligned
+    if ((uint64(ptr)&63)!=0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mpz_inline_data_mutex);
+    return mpz_inline_data.count(ptr)!=0;
+}
+
+void mp_shared_free_func(void* old_ptr, size_t old_bytes) {
+    if (!is_mpz_inline_data(old_ptr)) {
+        mp_prior_free_func(old_ptr, old_bytes);
+    }
+}
+
+void* mp_shared_realloc_func(void* old_ptr, size_t old_bytes, size_t new_bytes) {
+    if (!is_mpz_inline_data(old_ptr)) {
+        return mp_prior_realloc_func(old_ptr, old_bytes, new_bytes);
+    }
+
+    void* res=mp_prior_alloc_func(new_bytes);
+    memcpy(res, old_ptr, (old_bytes<new_bytes)? old_bytes : new_bytes);
+    return res;
+}
+
+//call this before making any mpz class instances. it can be called more than once
+void init_gmp_shared() {
+    if (gmp_shared) {
+        return;
+    }
+    mp_get_memory_functions(&mp_prior_alloc_func, &mp_prior_realloc_func, &mp_prior_free_func);
+    gmp_shared=true;
+    mp_set_memory_functions(mp_prior_alloc_func, mp_shared_realloc_func, mp_shared_free_func);
+}
+
 template<int d_expected_size, int d_padded_size> struct alignas(64) mpz;
 
 template<int expected_size_out, int padded_size_out, int expected_size_a, int padded_size_a, int expected_size_b, int padded_size_b>
@@ -261,6 +312,11 @@ template<int d_expected_size, int d_padded_size> struct alignas(64) mpz {
 
         //mp_free_func uses this to decide whether to free or not
         assert((uint64(c_mpz._mp_d)&63)==0);
+
+        if (gmp_shared) {
+            std::lock_guard<std::mutex> lock(mpz_inline_data_mutex);
+            mpz_inline_data.insert(data);
+        }
     }
 
     ~mpz() {
@@ -271,8 +327,13 @@ template<int d_expected_size, int d_padded_size> struct alignas(64) mpz {
 
         //if c_mpz.data wasn't reallocated, it has to point to this instance's data and not some other instance's data
         //if mpz_swap was used, this might be violated
-        assert((uint64(c_mpz._mp_d)&63)==16 || c_mpz._mp_d==data);
+        assert((uint64(c_mpz._mp_d)&63)==16 || c_mpz._mp_d==data || gmp_shared);
         mpz_clear(&c_mpz);
+
+        if (gmp_shared) {
+            std::lock_guard<std::mutex> lock(mpz_inline_data_mutex);
+            mpz_inline_data.erase(data);
+        }
     }
 
     mpz(const mpz& t)=delete;
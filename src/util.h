@@ -2,6 +2,8 @@
 #define UTIL_H
 
 #include "vdf_new.h"
+#include <atomic>
+#include <mutex>
 
 struct Segment {
     uint64_t start;
@@ -54,25 +56,184 @@ struct Segment {
 
 std::string BytesToStr(const std::vector<unsigned char> &in)
 {
-    std::vector<unsigned char>::const_iterator from = in.cbegin();
-    std::vector<unsigned char>::const_iterator to = in.cend();
-    std::ostringstream oss;
-    for (; from != to; ++from)
-       oss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(*from);
-    return oss.str();
+    static const char digits[] = "0123456789abcdef";
+    std::string res(2 * in.size(), '0');
+    for (size_t i = 0; i < in.size(); i++) {
+        res[2 * i] = digits[in[i] >> 4];
+        res[2 * i + 1] = digits[in[i] & 15];
+    }
+    return res;
 }
 
-void ApproximateParameters(uint64_t T, uint32_t& L, uint32_t& K) {
-    double log_memory = 23.25349666;
-    double log_T = log2(T);
-    L = 1;
-    if (log_T - log_memory > 0.000001) {
-        L = ceil(pow(2, log_memory - 20));
+// Rough RAM held by one stored form of a 1024 bit discriminant, limbs included.
+const uint64_t kFormBytes = 320;
+
+// Picks how often intermediates are stored (every k * l iterations) and the k and l of the proofs
+// built from them, for a RAM budget and the number of proofs generated at once. Each of those
+// proofs also holds 2^k partial products while it runs.
+class ParameterPlanner {
+  public:
+    ParameterPlanner(uint64_t memory_bytes, int threads) {
+        this->memory_forms = memory_bytes / kFormBytes;
+        this->threads = std::max(threads, 1);
+    }
+
+    uint64_t MemoryForms() {
+        return memory_forms;
+    }
+
+    // Proving time of T iterations in nucomp steps, when a block step costs 'block_cost' of them.
+    static double ProvingCost(uint64_t T, uint32_t k, uint32_t l, double block_cost = 1) {
+        uint32_t k1 = k / 2;
+        uint32_t k0 = k - k1;
+        // Every stored form is added into its block once, over all l rounds.
+        double blocks = double(T) / k;
+        // Each round folds the 2^k buckets and raises the partial sums to k1 and k0 bit powers.
+        double combine = double(k) + 2.0 * (1 << k) + 1.5 * (k0 * (1 << k1) + k1 * (1 << k0));
+        return blocks * (1 + block_cost) + l * combine;
+    }
+
+    // Fastest k and l for T iterations, with k * l a multiple of 'stride' and at most
+    // 'max_intermediates' forms stored. If no candidate fits, k = stride and l = 1.
+    void Choose(uint64_t T, uint64_t max_intermediates, uint32_t stride, uint32_t& k, uint32_t& l, double block_cost = 1) {
+        k = stride;
+        l = 1;
+        double best = -1;
+        max_intermediates = std::max(max_intermediates, (uint64_t)1);
+        for (uint32_t k_candidate = 1; k_candidate <= kMaxK; k_candidate++) {
+            if (k_candidate > 1 && ((uint64_t)threads << k_candidate) > memory_forms / 8)
+                break;
+            uint32_t l_step = 1;
+            while ((k_candidate * l_step) % stride != 0)
+                l_step++;
+            uint64_t min_kl = (T + max_intermediates - 1) / max_intermediates;
+            uint64_t l_candidate = (min_kl + k_candidate - 1) / k_candidate;
+            l_candidate = std::max((l_candidate + l_step - 1) / l_step, (uint64_t)1) * l_step;
+            // On a budget too small for T, store as sparsely as T allows.
+            if (k_candidate * l_candidate > T)
+                l_candidate = T / k_candidate / l_step * l_step;
+            if (l_candidate == 0)
+                continue;
+            double cost = ProvingCost(T, k_candidate, l_candidate, block_cost);
+            if (best < 0 || cost < best) {
+                best = cost;
+                k = k_candidate;
+                l = l_candidate;
+            }
+        }
+    }
+
+    // k and l of a single proof of T iterations over its own intermediates. Proofs planned at
+    // the same time share the budget: each one may store up to half of what the others haven't
+    // reserved. Returns the forms reserved for it, to be given back with Release() once its
+    // intermediates are freed.
+    uint64_t ChooseSingle(uint64_t T, uint32_t& k, uint32_t& l) {
+        std::lock_guard<std::mutex> lk(reserved_mutex);
+        uint64_t free_forms = memory_forms - reserved_forms;
+        Choose(T, free_forms / 2, 1, k, l);
+        uint64_t forms = std::min(T / ((uint64_t)k * l) + 1, free_forms);
+        reserved_forms += forms;
+        return forms;
+    }
+
+    void Release(uint64_t forms) {
+        std::lock_guard<std::mutex> lk(reserved_mutex);
+        reserved_forms -= std::min(forms, reserved_forms);
+    }
+
+    uint64_t ReservedForms() {
+        std::lock_guard<std::mutex> lk(reserved_mutex);
+        return reserved_forms;
     }
-    double intermediate = T * (double)0.6931471 / (2.0 * L);
-    K = std::max(std::round(log(intermediate) - log(log(intermediate)) + 0.25), 1.0);
+
+  private:
+    const uint32_t kMaxK = 20;
+    uint64_t memory_forms;
+    int threads;
+    // Forms held by the proofs planned with ChooseSingle that are still running.
+    uint64_t reserved_forms = 0;
+    std::mutex reserved_mutex;
+};
+
+uint64_t PhysicalMemoryBytes() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    if (pages <= 0 || page_size <= 0)
+        return (uint64_t)4 << 30;
+    return (uint64_t)pages * page_size;
+}
+
+// Planner shared by all callbacks and provers, for a quarter of the physical RAM or
+// VDF_MEMORY_BUDGET_MB if set. Processes that run side by side (e.g. bluebox clients) should each
+// be given their share that way.
+ParameterPlanner& DefaultPlanner() {
+    static ParameterPlanner planner(
+        (getenv("VDF_MEMORY_BUDGET_MB") != nullptr) ? (uint64_t)atoll(getenv("VDF_MEMORY_BUDGET_MB")) << 20
+                                                    : PhysicalMemoryBytes() / 4,
+        std::thread::hardware_concurrency());
+    return planner;
 }
 
+// The forms ChooseSingle reserves for one proof, given back when it goes out of scope, including
+// when the proof is abandoned by an exception.
+class SingleProofReservation {
+  public:
+    SingleProofReservation(ParameterPlanner& planner, uint64_t T, uint32_t& k, uint32_t& l) : planner(planner) {
+        forms = planner.ChooseSingle(T, k, l);
+    }
+
+    ~SingleProofReservation() {
+        planner.Release(forms);
+    }
+
+    SingleProofReservation(const SingleProofReservation&) = delete;
+    SingleProofReservation& operator=(const SingleProofReservation&) = delete;
+
+  private:
+    ParameterPlanner& planner;
+    uint64_t forms;
+};
+
+// Lock-free ring for exactly one producer and one consumer thread. Slots are filled and consumed
+// in place, so nothing is allocated or copied twice.
+template<class T, int N> class SpscRing {
+  public:
+    // Producer: returns the next free slot, or NULL if the ring is full. Call Push() once it's filled.
+    T* Reserve() {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= N)
+            return NULL;
+        return &slots[h % N];
+    }
+
+    void Push() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: returns the oldest filled slot, or NULL if the ring is empty. The slot stays valid
+    // until Pop().
+    T* Front() {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return NULL;
+        return &slots[t % N];
+    }
+
+    void Pop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // True once the consumer has popped everything pushed so far.
+    bool Empty() {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+
+  private:
+    T slots[N];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+};
+
 struct Proof {
     Proof() {
 
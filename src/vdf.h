@@ -1,40 +1,10 @@
 #ifndef VDF_H
 #define VDF_H
 
-#include "include.h"
-
-#include <x86intrin.h>
-
-#include "parameters.h"
-
-#include "bit_manipulation.h"
-#include "double_utility.h"
-#include "integer.h"
-
-#include "asm_main.h"
+#include "fast_square.h"
 
 #include "vdf_original.h"
 
-#include "vdf_new.h"
-#include "picosha2.h"
-
-#include "gpu_integer.h"
-#include "gpu_integer_divide.h"
-
-#include "gcd_base_continued_fractions.h"
-//#include "gcd_base_divide_table.h"
-#include "gcd_128.h"
-#include "gcd_unsigned.h"
-
-#include "gpu_integer_gcd.h"
-
-#include "asm_types.h"
-
-#include "threading.h"
-#include "avx512_integer.h"
-#include "nucomp.h"
-#include "vdf_fast.h"
-
 #include "vdf_test.h"
 #include <map>
 #include <algorithm>
@@ -49,6 +19,7 @@
 #include "util.h"
 #include "callback.h"
 #include "fast_storage.h"
+#include "metrics.h"
 #include <boost/asio.hpp>
 
 bool warn_on_corruption_in_production=false;
@@ -132,6 +103,7 @@ void repeated_square(form f, const integer& D, const integer& L, WesolowskiCallb
         // This works single threaded
         square_state_type square_state;
         square_state.pairindex=0;
+        square_state.profile_phases=true;
 
         uint64 actual_iterations=repeated_square_fast(square_state, f, D, L, num_iterations, batch_size, weso);
 
@@ -149,6 +121,9 @@ void repeated_square(form f, const integer& D, const integer& L, WesolowskiCallb
             //corruption; f is unchanged. do the entire batch with the slow algorithm
             repeated_square_original(*weso->vdfo, f, D, L, num_iterations, batch_size, weso);
             actual_iterations=batch_size;
+            vdf_metrics.corruptions.Add();
+            vdf_metrics.slow_fallbacks.Add();
+            vdf_metrics.slow_iterations.Add(batch_size);
 
             #ifdef VDF_TEST
                 num_iterations_slow+=batch_size;
@@ -164,6 +139,8 @@ void repeated_square(form f, const integer& D, const integer& L, WesolowskiCallb
             //it might terminate prematurely again (e.g. gcd quotient too large), so will do one iteration of the slow algorithm
             //this will also reduce f if the fast algorithm terminated because it was too big
             repeated_square_original(*weso->vdfo, f, D, L, num_iterations+actual_iterations, 1, weso);
+            vdf_metrics.slow_fallbacks.Add();
+            vdf_metrics.slow_iterations.Add();
 
 #ifdef VDF_TEST
                 ++num_iterations_slow;
@@ -177,14 +154,21 @@ void repeated_square(form f, const integer& D, const integer& L, WesolowskiCallb
         }
 
         num_iterations+=actual_iterations;
+        vdf_metrics.iterations.Add(actual_iterations);
         if (num_iterations >= last_checkpoint) {
+            weso->WaitForStoredForms();
             weso->iterations = num_iterations;
+            vdf_metrics.vdf_iteration.Set(num_iterations);
+            vdf_metrics.iteration_rate.Sample(vdf_metrics.iterations.Get());
 
             // n-weso specific logic.
             if (fast_algorithm) {
+                FastAlgorithmCallback* fast_weso = static_cast<FastAlgorithmCallback*> (weso);
                 if (fast_storage != NULL) {
-                    fast_storage->SubmitCheckpoint(static_cast<FastAlgorithmCallback*> (weso)->y_ret, last_checkpoint);
-                } else if (last_checkpoint % (1 << 16) == 0) {
+                    fast_storage->SubmitCheckpoint(fast_weso->y_ret, last_checkpoint);
+                }
+                if ((fast_storage == NULL && last_checkpoint % (1 << 16) == 0) ||
+                    fast_weso->iteration_waiters.load() > 0) {
                     // Notify prover event loop, we have a new segment with intermediates stored.
                     {
                         std::lock_guard<std::mutex> lk(new_event_mutex);
@@ -197,17 +181,20 @@ void repeated_square(form f, const integer& D, const integer& L, WesolowskiCallb
             // 2-weso specific logic.
             if (two_weso) {
                 TwoWesolowskiCallback* nweso = (TwoWesolowskiCallback*) weso;
-                if (num_iterations >= kSwitchIters && !nweso->LargeConstants()) {
+                if (num_iterations >= nweso->SwitchIters() && !nweso->LargeConstants()) {
                     uint64 round_up = (100 - num_iterations % 100) % 100;
                     if (round_up > 0) {
                         repeated_square_original(*weso->vdfo, f, D, L, num_iterations, round_up, weso);
                     }
                     num_iterations += round_up;
+                    vdf_metrics.iterations.Add(round_up);
                     nweso->IncreaseConstants(num_iterations);
+                    weso->WaitForStoredForms();
                     weso->iterations = num_iterations;
                 }
                 if (num_iterations >= kMaxItersAllowed - 500000) {
                     std::cout << "Maximum possible number of iterations reached!\n";
+                    weso->WaitForStoredForms();
                     return ;
                 }
             }
@@ -226,6 +213,7 @@ void repeated_square(form f, const integer& D, const integer& L, WesolowskiCallb
         #endif
     }
 
+    weso->WaitForStoredForms();
     std::cout << "VDF loop finished. Total iters: " << num_iterations << "\n" << std::flush;
     #ifdef VDF_TEST
         print( "fast average batch size", double(num_iterations_fast)/double(num_calls_fast) );
@@ -233,6 +221,43 @@ void repeated_square(form f, const integer& D, const integer& L, WesolowskiCallb
     #endif
 }
 
+// Squares f 'iterations' times outside of the main VDF loop, reporting every iteration to weso.
+// Uses the fast algorithm on a free counter pair if there is one, on two threads or interleaved on the
+// calling thread; batches it rejects (and everything, if no pair is free) are done with
+// repeated_square_original.
+// Returns false if 'stopped' was set before finishing.
+bool repeated_square_detached(form& f, const integer& D, const integer& L, uint64 base, uint64 iterations, WesolowskiCallback* weso, bool& stopped, bool two_threads) {
+    int pairindex = AcquirePairIndex();
+    uint64 done = 0;
+    while (done < iterations && !stopped) {
+        uint64 batch_size = std::min<uint64>(checkpoint_interval, iterations - done);
+        uint64 actual_iterations = ~uint64(0);
+
+        if (pairindex != -1) {
+            square_state_type square_state;
+            square_state.pairindex = pairindex;
+            if (two_threads) {
+                actual_iterations = repeated_square_fast_multithread(square_state, f, D, L, base + done, batch_size, weso);
+            } else {
+                actual_iterations = repeated_square_fast_single_thread(square_state, f, D, L, base + done, batch_size, weso);
+            }
+        }
+
+        if (actual_iterations == ~uint64(0)) {
+            repeated_square_original(*weso->vdfo, f, D, L, base + done, batch_size, weso);
+            actual_iterations = batch_size;
+        } else if (actual_iterations < batch_size) {
+            repeated_square_original(*weso->vdfo, f, D, L, base + done + actual_iterations, 1, weso);
+            ++actual_iterations;
+        }
+        done += actual_iterations;
+    }
+    if (pairindex != -1) {
+        ReleasePairIndex(pairindex);
+    }
+    return done >= iterations;
+}
+
 Proof ProveOneWesolowski(uint64_t iters, integer& D, OneWesolowskiCallback* weso, bool& stopped) {
     while (weso->iterations < iters) {
         this_thread::sleep_for(1s);
@@ -245,7 +270,7 @@ Proof ProveOneWesolowski(uint64_t iters, integer& D, OneWesolowskiCallback* weso
         /*x=*/f,
         /*y=*/weso->result
     );
-    OneWesolowskiProver prover(sg, D, weso->forms);
+    OneWesolowskiProver prover(sg, D, weso->forms, weso->k, weso->l);
     prover.start();
     while (!prover.IsFinished()) {
         this_thread::sleep_for(1s);
@@ -262,8 +287,87 @@ Proof ProveOneWesolowski(uint64_t iters, integer& D, OneWesolowskiCallback* weso
     return proof;
 }
 
-Proof ProveTwoWeso(integer& D, form x, uint64_t iters, uint64_t done_iterations, TwoWesolowskiCallback* weso, int depth, bool& stop_signal) {
+// Splits a 2-wesolowski proof so the provers of the first segments finish about when the prover
+// of the last segment does. Uses measured proving costs, the VDF speed and progress, and the
+// number of cores left next to the squaring threads. The costs are measured once, when it's
+// built, so one planner serves every proof of a callback; it can be shared by their threads.
+class TwoWesoPlanner {
+  public:
+    TwoWesoPlanner(integer& D, TwoWesolowskiCallback* weso) : model(D) {
+        this->weso = weso;
+        int free_cores = std::max(1, (int)std::thread::hardware_concurrency() - 2);
+        slowdown = std::max(1.0, 3.0 / free_cores);
+    }
+
+    // Length of the first segment of [start, start + length), a multiple of 100.
+    uint64_t Split(uint64_t start, uint64_t length, int depth) {
+        VdfProgress progress = {(uint64_t)weso->iterations, weso->IterationsPerSecond()};
+        uint64_t split = 0;
+        Finish(progress, start, length, depth, &split);
+        if (split == 0) {
+            split = length * 2 / 3;
+            split = split - split % 100;
+        }
+        return split;
+    }
+
+    void ChooseParameters(uint64_t start, uint64_t length, uint32_t& k, uint32_t& l) {
+        model.ChooseParameters(length, weso->GetStride(start, length), k, l);
+    }
+
+  private:
+    // Where the VDF was when Split was called, and how fast it goes.
+    struct VdfProgress {
+        uint64_t iterations;
+        double iterations_per_second;
+    };
+
+    double VdfSeconds(const VdfProgress& progress, uint64_t iteration) {
+        if (iteration <= progress.iterations)
+            return 0;
+        return (iteration - progress.iterations) / progress.iterations_per_second;
+    }
+
+    double SegmentFinish(const VdfProgress& progress, uint64_t start, uint64_t length) {
+        return VdfSeconds(progress, start + length) +
+               slowdown * model.ProvingSeconds(length, weso->GetStride(start, length));
+    }
+
+    // Seconds from now until [start, start + length) is proven.
+    double Finish(const VdfProgress& progress, uint64_t start, uint64_t length, int depth, uint64_t* split) {
+        if (depth == 2)
+            return SegmentFinish(progress, start, length);
+        double best = -1;
+        for (int i = 1; i < kSplitSteps; i++) {
+            uint64_t length1 = length * i / kSplitSteps;
+            length1 = length1 - length1 % 100;
+            if (length1 == 0)
+                continue;
+            double finish = std::max(
+                SegmentFinish(progress, start, length1),
+                Finish(progress, start + length1, length - length1, depth + 1, NULL)
+            );
+            if (best < 0 || finish < best) {
+                best = finish;
+                if (split != NULL)
+                    *split = length1;
+            }
+        }
+        if (best < 0)
+            return SegmentFinish(progress, start, length);
+        return best;
+    }
+
+    const int kSplitSteps = 20;
+    ProverCostModel model;
+    TwoWesolowskiCallback* weso;
+    // Up to 3 provers of a proof run at once; they share the cores left.
+    double slowdown;
+};
+
+Proof ProveTwoWeso(integer& D, form x, uint64_t iters, uint64_t done_iterations, TwoWesolowskiCallback* weso, TwoWesoPlanner& planner, int depth, bool& stop_signal) {
     integer L=root(-D, 4);
+    uint32_t k, l;
     if (depth == 2) {
         while (!stop_signal && weso->iterations < done_iterations + iters) {
             std::this_thread::sleep_for (std::chrono::milliseconds(200));
@@ -282,7 +386,8 @@ Proof ProveTwoWeso(integer& D, form x, uint64_t iters, uint64_t done_iterations,
             /*x=*/x,
             /*y=*/y
         );
-        TwoWesolowskiProver prover(sg, D, weso, stop_signal);
+        planner.ChooseParameters(done_iterations, iters, k, l);
+        TwoWesolowskiProver prover(sg, D, weso, stop_signal, k, l);
         prover.GenerateProof();
 
         if (stop_signal)
@@ -297,8 +402,7 @@ Proof ProveTwoWeso(integer& D, form x, uint64_t iters, uint64_t done_iterations,
     }
 
     uint64_t iterations1, iterations2;
-    iterations1 = iters * 2 / 3;
-    iterations1 = iterations1 - iterations1 % 100;
+    iterations1 = planner.Split(done_iterations, iters, depth);
     iterations2 = iters - iterations1;
     while (!stop_signal && weso->iterations < done_iterations + iterations1) {
         std::this_thread::sleep_for (std::chrono::milliseconds(100));
@@ -313,9 +417,10 @@ Proof ProveTwoWeso(integer& D, form x, uint64_t iters, uint64_t done_iterations,
         /*x=*/x,
         /*y=*/y1
     );
-    TwoWesolowskiProver prover(sg, D, weso, stop_signal);
+    planner.ChooseParameters(done_iterations, iterations1, k, l);
+    TwoWesolowskiProver prover(sg, D, weso, stop_signal, k, l);
     prover.start();
-    Proof proof2 = ProveTwoWeso(D, y1, iterations2, done_iterations + iterations1, weso, depth + 1, stop_signal);
+    Proof proof2 = ProveTwoWeso(D, y1, iterations2, done_iterations + iterations1, weso, planner, depth + 1, stop_signal);
 
     while (!stop_signal && !prover.IsFinished()) {
         std::this_thread::sleep_for (std::chrono::milliseconds(100));
@@ -328,14 +433,11 @@ Proof ProveTwoWeso(integer& D, form x, uint64_t iters, uint64_t done_iterations,
     Proof final_proof;
     final_proof.y = proof2.y;
     std::vector<unsigned char> proof_bytes(proof2.proof);
-    std::vector<unsigned char> tmp = ConvertIntegerToBytes(integer(iterations1), 8);
-    proof_bytes.insert(proof_bytes.end(), tmp.begin(), tmp.end());
-    tmp.clear();
-    tmp = SerializeForm(y1, int_size);
-    proof_bytes.insert(proof_bytes.end(), tmp.begin(), tmp.end());
-    tmp.clear();
-    tmp = SerializeForm(proof, int_size);
-    proof_bytes.insert(proof_bytes.end(), tmp.begin(), tmp.end());
+    size_t offset = proof_bytes.size();
+    proof_bytes.resize(offset + 8 + 4 * int_size);
+    WriteUint64Bytes(iterations1, proof_bytes.data() + offset, 8);
+    SerializeForm(y1, int_size, proof_bytes.data() + offset + 8);
+    SerializeForm(proof, int_size, proof_bytes.data() + offset + 8 + 2 * int_size);
     final_proof.proof = proof_bytes;
     if (depth == 0) {
         final_proof.witness_type = 2;
@@ -350,6 +452,7 @@ class ProverManager {
     ProverManager(integer& D, FastAlgorithmCallback* weso, FastStorage* fast_storage, int segment_count, int max_proving_threads) {
         this->segment_count = segment_count;
         this->max_proving_threads = max_proving_threads;
+        this->base_proving_threads = max_proving_threads;
         this->D = D;
         this->weso = weso;
         this->fast_storage = fast_storage;
@@ -359,14 +462,38 @@ class ProverManager {
             done_segments.push_back(tmp);
             last_appended.push_back(0);
         }
+        vdf_metrics.buckets.Set(segment_count);
     }
 
     ~ProverManager() {
+        if (main_loop == NULL)
+            return ;
+        bool active;
+        {
+            std::lock_guard<std::mutex> lk(loop_mutex);
+            active = loop_active;
+        }
+        if (active)
+            stop();
+        {
+            std::lock_guard<std::mutex> lk(loop_mutex);
+            loop_exit = true;
+        }
+        loop_cv.notify_all();
+        main_loop->join();
         delete(main_loop);
     }
 
+    // Runs the event loop for the current challenge. The thread is started on the first call and
+    // kept across Reset.
     void start() {
-        main_loop = new std::thread([=] {RunEventLoop();});
+        std::lock_guard<std::mutex> lk(loop_mutex);
+        loop_active = true;
+        if (main_loop == NULL) {
+            main_loop = new std::thread([=] {EventLoopThread();});
+        } else {
+            loop_cv.notify_all();
+        }
     }
 
     void stop() {        
@@ -376,18 +503,44 @@ class ProverManager {
             new_event = true;
         }
         new_event_cv.notify_all();
-        main_loop->join();
+        {
+            std::unique_lock<std::mutex> lk(loop_mutex);
+            loop_cv.wait(lk, [this] { return !loop_active; });
+        }
         std::cout << "Prover event loop finished.\n" << std::flush;
 
         for (int i = 0; i < provers.size(); i++) {
             provers[i].first->stop();
         }
+        provers.clear();
         std::cout << "Segment provers finished.\n" << std::flush;
+        for (int i = 0; i < segment_count; i++)
+            pending_segments[i].clear();
+        UpdateMetrics();
 
         proof_cv.notify_all();
         last_segment_cv.notify_all();
     }
 
+    // Readies a stopped manager for the next challenge of its (reset) weso and fast storage.
+    // Prove calls of the last challenge must have returned.
+    void Reset(integer& D) {
+        this->D = D;
+        stopped = false;
+        max_proving_threads = base_proving_threads;
+        for (int i = 0; i < segment_count; i++) {
+            pending_segments[i].clear();
+            done_segments[i].clear();
+            last_appended[i] = 0;
+        }
+        pending_iters.clear();
+        pending_iters_last_sg.clear();
+        max_proving_iteration = 0;
+        vdf_iteration = 0;
+        intermediates_iter = 0;
+        UpdateMetrics();
+    }
+
     Proof Prove(uint64_t iteration) {
         {
             std::lock_guard<std::mutex> lkg(proof_mutex);
@@ -415,31 +568,29 @@ class ProverManager {
         Segment last_segment;
         form y = weso->checkpoints[iteration / (1 << 16)];
         if (iteration % (1 << 16)) {
-            // Recalculate everything from the checkpoint, since there is no guarantee the iter didn't arrive late.
-            integer L = root(-D, 4);
-            PulmarkReducer reducer;
-            form* intermediates = (form*) calloc((iteration % (1 << 16)) / 10 + 100, sizeof(form));
-            for (int i = 0; i < iteration % (1 << 16); i++) {
-                if (i % 10 == 0) {
-                    intermediates[i / 10] = y;
-                }
-                nudupl_form(y, y, D, L);
-                reducer.reduce(y);   
+            uint64_t last_segment_start = iteration - iteration % (1 << 16);
+            std::vector<form> intermediates;
+            // The bucket 0 store normally still has every 10th form of this segment. If the iter
+            // arrived too late and they've been overwritten, recalculate them from the checkpoint.
+            if (!CopyStoredIntermediates(last_segment_start, iteration, intermediates, y)) {
                 if (stopped) {
                     return Proof();
                 }
+                y = weso->checkpoints[iteration / (1 << 16)];
+                if (!RecomputeIntermediates(last_segment_start, iteration, intermediates, y)) {
+                    return Proof();
+                }
             }
             Segment sg(
-                /*start=*/iteration - iteration % (1 << 16),
+                /*start=*/last_segment_start,
                 /*length=*/iteration % (1 << 16),
                 /*x=*/weso->checkpoints[iteration / (1 << 16)],
                 /*y=*/y
             );
-            // TODO: stop this prover as well in case stop signal arrives.
-            OneWesolowskiProver prover(sg, D, intermediates);
+            // The intermediates are every 10th form.
+            OneWesolowskiProver prover(sg, D, intermediates.data(), 10, 1, &stopped);
             prover.start();
             sg.proof = prover.GetProof();
-            free(intermediates);
             if (stopped) {
                 return Proof();
             }
@@ -491,16 +642,15 @@ class ProverManager {
         std::vector<unsigned char> proof_serialized;
         // Match ClassGroupElement type from the blockchain.
         y_serialized = SerializeForm(y, 129);
-        proof_serialized = SerializeForm(proof_segments[proof_segments.size() - 1].proof, int_size);
+        proof_serialized.resize(2 * int_size + (proof_segments.size() - 1) * (8 + 4 * int_size));
+        uint8_t* out = proof_serialized.data();
+        SerializeForm(proof_segments[proof_segments.size() - 1].proof, int_size, out);
+        out += 2 * int_size;
         for (int i = proof_segments.size() - 2; i >= 0; i--) {
-            std::vector<unsigned char> tmp = ConvertIntegerToBytes(integer(proof_segments[i].length), 8);
-            proof_serialized.insert(proof_serialized.end(), tmp.begin(), tmp.end());
-            tmp.clear();
-            tmp = SerializeForm(proof_segments[i].y, int_size);
-            proof_serialized.insert(proof_serialized.end(), tmp.begin(), tmp.end());
-            tmp.clear();
-            tmp = SerializeForm(proof_segments[i].proof, int_size);
-            proof_serialized.insert(proof_serialized.end(), tmp.begin(), tmp.end());
+            WriteUint64Bytes(proof_segments[i].length, out, 8);
+            SerializeForm(proof_segments[i].y, int_size, out + 8);
+            SerializeForm(proof_segments[i].proof, int_size, out + 8 + 2 * int_size);
+            out += 8 + 4 * int_size;
         }
         Proof proof(y_serialized, proof_serialized);
         proof.witness_type = proof_segments.size() - 1;
@@ -514,6 +664,69 @@ class ProverManager {
         return proof;
     }
 
+    // The bucket 0 store only keeps the last 'window_size' 2^16 segments. weso->iterations lags
+    // the VDF by less than 2^16, so keep one segment of margin.
+    bool SegmentInWindow(uint64_t start) {
+        return weso->iterations + (1 << 16) < start + weso->window_size * (1 << 16);
+    }
+
+    bool IntermediatesStored(uint64_t start, uint64_t iteration) {
+        if (weso->iterations < iteration)
+            return false;
+        if (fast_storage != NULL) {
+            return fast_storage->HasIntermediates(start) &&
+                   fast_storage->HasIntermediates(iteration - iteration % 10);
+        }
+        return true;
+    }
+
+    // Copies every 10th form of [start, iteration] out of the bucket 0 store and squares the
+    // last one up to 'iteration'. Waits for the VDF (and fast storage) to get there first; the
+    // event loop wakes it on every checkpoint and stored block while it waits.
+    // Returns false if the forms are no longer in the store.
+    bool CopyStoredIntermediates(uint64_t start, uint64_t iteration, std::vector<form>& intermediates, form& y) {
+        {
+            std::unique_lock<std::mutex> lk(last_segment_mutex);
+            weso->iteration_waiters++;
+            last_segment_cv.wait(lk, [this, start, iteration] {
+                return stopped || !SegmentInWindow(start) || IntermediatesStored(start, iteration);
+            });
+            weso->iteration_waiters--;
+        }
+        if (stopped || !SegmentInWindow(start))
+            return false;
+
+        uint64_t length = iteration - start;
+        intermediates.reserve(length / 10 + 1);
+        for (uint64_t power = 0; power <= length; power += 10) {
+            intermediates.push_back(*weso->GetForm(start + power, 0));
+        }
+        y = intermediates[intermediates.size() - 1];
+        PulmarkReducer reducer;
+        for (uint64_t i = 0; i < length % 10; i++) {
+            nudupl_form(y, y, D, weso->L);
+            reducer.reduce(y);
+        }
+
+        // The VDF might have wrapped around the window while we were copying.
+        if (!SegmentInWindow(start)) {
+            intermediates.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Recalculates the intermediates of [start, iteration] from the checkpoint 'y' with the
+    // fast squaring algorithm. On return, y is the form at 'iteration'.
+    bool RecomputeIntermediates(uint64_t start, uint64_t iteration, std::vector<form>& intermediates, form& y) {
+        TrailingSegmentCallback callback(D, start, iteration - start, intermediates);
+        intermediates[0] = y;
+        if (!repeated_square_detached(y, D, weso->L, start, iteration - start, &callback, stopped, enable_threads))
+            return false;
+        y = callback.result;
+        return true;
+    }
+
     void RunEventLoop() {
         const bool multi_proc_machine = (std::thread::hardware_concurrency() >= 16) ? true : false;
         bool warned = false;
@@ -544,6 +757,9 @@ class ProverManager {
                 if (pending_iters_last_sg.size() > 0 && vdf_iteration >= *pending_iters_last_sg.begin()) {
                     new_last_segment = true;
                 }
+                // CopyStoredIntermediates waits on the same cv for the VDF or fast storage to move.
+                if (weso->iteration_waiters.load() > 0)
+                    new_last_segment = true;
             }
             if (new_last_segment) {
                 last_segment_cv.notify_all();
@@ -718,15 +934,52 @@ class ProverManager {
                     }
                 }
             }
+            UpdateMetrics();
         }
     }
 
   private:
+    // Runs RunEventLoop once per start(), until the manager is destroyed.
+    void EventLoopThread() {
+        std::unique_lock<std::mutex> lk(loop_mutex);
+        while (true) {
+            loop_cv.wait(lk, [this] { return loop_active || loop_exit; });
+            if (loop_exit)
+                return ;
+            lk.unlock();
+            RunEventLoop();
+            lk.lock();
+            loop_active = false;
+            loop_cv.notify_all();
+        }
+    }
+
+    void UpdateMetrics() {
+        for (int i = 0; i < segment_count && i < kMaxMetricBuckets; i++)
+            vdf_metrics.pending_segments[i].Set(pending_segments[i].size());
+        int active = 0, paused = 0;
+        for (int i = 0; i < provers.size(); i++) {
+            if (!provers[i].first->IsRunning())
+                paused++;
+            else if (!provers[i].first->IsFinished())
+                active++;
+        }
+        vdf_metrics.active_provers.Set(active);
+        vdf_metrics.paused_provers.Set(paused);
+    }
+
     bool stopped = false;
     int segment_count;
     // Maximum amount of proving threads running at once.
     int max_proving_threads;
-    std::thread* main_loop;
+    // What max_proving_threads starts at for each challenge.
+    int base_proving_threads;
+    std::thread* main_loop = NULL;
+    // The event loop thread runs RunEventLoop while loop_active, and exits once loop_exit is set.
+    std::mutex loop_mutex;
+    std::condition_variable loop_cv;
+    bool loop_active = false;
+    bool loop_exit = false;
     FastAlgorithmCallback* weso;
     FastStorage* fast_storage;
     // The discriminant used.
@@ -754,7 +1007,7 @@ class ProverManager {
     // Where the VDF thread is at.
     uint64_t vdf_iteration = 0;
     bool proof_done;
-    uint64_t intermediates_iter;
+    uint64_t intermediates_iter = 0;
 };
 
 #endif // VDF_H
@@ -1,42 +1,429 @@
-#include "include.h"
-#include "bit_manipulation.h"
-#include "double_utility.h"
-#include "parameters.h"
-#include "asm_main.h"
-#include "integer.h"
-#include "vdf_new.h"
-#include "nucomp.h"
-#include "picosha2.h"
-#include "proof_common.h"
-
-#include "threading.h"
-#include "avx512_integer.h"
-#include "vdf_fast.h"
+#include "vdf.h"
 #include "create_discriminant.h"
+#include "verifier.h"
+#include "prover_slow.h"
 
 #include <cstdlib>
+#include <fstream>
+#include <numeric>
+#include <sched.h>
 
 #define CH_SIZE 32
 
+// For the provers of the end to end benchmark, as in prover_test.
+int segments = 7;
+int thread_count = 3;
+int gcd_base_bits=cel_gcd_base_bits;
+int gcd_128_max_iter=cel_gcd_128_max_iter;
+
 static void usage(const char *progname)
 {
-    fprintf(stderr, "Usage: %s {square_asm|square|discr} N\n", progname);
+    fprintf(stderr, "Usage: %s {square_asm|square|discr|compress} N\n"
+                    "       %s suite [-w WARMUP] [-r REPS] [-c CPU] [-f FILTER] [-j OUT.json] [-b BASE.json] [-t PCT]\n"
+                    "       %s compare BASE.json NEW.json [PCT]\n", progname, progname, progname);
+}
+
+// The suite: each benchmark does 'ops' operations per repetition, after 'warmup' unmeasured
+// repetitions, and is reported as the median time per operation over 'reps' repetitions.
+// Single threaded benchmarks run pinned to one CPU when one is given.
+struct Benchmark {
+    std::string name;
+    uint64_t ops;
+    bool threaded;
+    std::function<void()> run;
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t ops;
+    double median_ns;
+    double min_ns;
+    double mean_ns;
+    double stddev_ns;
+};
+
+// Proves 'iters' squarings from x, returning y and the proof.
+form ProveSegment(form x, integer& D, integer& L, uint64_t iters, form& y) {
+    PulmarkReducer reducer;
+    uint32_t k, l;
+    SingleProofReservation reservation(DefaultPlanner(), iters, k, l);
+    std::vector<form> intermediates;
+    y = x;
+    for (uint64_t i = 0; i < iters; i += k * l) {
+        intermediates.push_back(y);
+        RepeatedSquareForm(y, D, L, std::min((uint64_t)k * l, iters - i), reducer);
+        reducer.reduce(y);
+    }
+    return GenerateWesolowski(y, x, D, reducer, intermediates, iters, k, l);
+}
+
+// The n-wesolowski blob (y | proof | iters_1 | y_1 | proof_1) of two segments from the generator.
+std::vector<uint8_t> NWesolowskiBlob(integer& D, integer& L, uint64_t iters_1, uint64_t iters_2) {
+    int int_size = (D.num_bits() + 16) >> 4;
+    form y_1, y;
+    form proof_1 = ProveSegment(form::generator(D), D, L, iters_1, y_1);
+    form proof = ProveSegment(y_1, D, L, iters_2, y);
+    std::vector<uint8_t> blob = SerializeForm(y, 129);
+    std::vector<uint8_t> bytes = SerializeForm(proof, int_size);
+    blob.insert(blob.end(), bytes.begin(), bytes.end());
+    blob.resize(blob.size() + 8);
+    WriteUint64Bytes(iters_1, blob.data() + blob.size() - 8, 8);
+    for (form* f : {&y_1, &proof_1}) {
+        bytes = SerializeForm(*f, int_size);
+        blob.insert(blob.end(), bytes.begin(), bytes.end());
+    }
+    return blob;
+}
+
+std::vector<Benchmark> SuiteBenchmarks(integer& D, integer& L) {
+    std::vector<Benchmark> benchmarks;
+    PulmarkReducer* reducer = new PulmarkReducer();
+    int int_size = (D.num_bits() + 16) >> 4;
+
+    // A spread of reduced forms, and the squares of some of them before reduction.
+    std::vector<form>* forms = new std::vector<form>();
+    std::vector<form>* unreduced = new std::vector<form>();
+    form f = form::generator(D);
+    for (int i = 0; i < 64; i++) {
+        RepeatedSquareForm(f, D, L, 1000, *reducer);
+        forms->push_back(f);
+        form g;
+        nudupl_form(g, f, D, L);
+        unreduced->push_back(g);
+    }
+
+    benchmarks.push_back({"square_fast", 100000, false, [=, &D, &L] {
+        form y = (*forms)[0];
+        for (uint64_t i = 0; i < 100000; ) {
+            square_state_type sq_state;
+            sq_state.pairindex = 0;
+            uint64_t done = repeated_square_fast(sq_state, y, D, L, 0, 100000 - i, NULL);
+            if (done == 0 || done == ~0ULL) {
+                nudupl_form(y, y, D, L);
+                reducer->reduce(y);
+                i++;
+            } else {
+                i += done;
+            }
+        }
+    }});
+    benchmarks.push_back({"square_slow", 20000, false, [=, &D, &L] {
+        form y = (*forms)[0];
+        for (int i = 0; i < 20000; i++) {
+            nudupl_form(y, y, D, L);
+            if (__GMP_ABS(y.a.impl->_mp_size) > 8)
+                reducer->reduce(y);
+        }
+    }});
+    benchmarks.push_back({"nucomp", 20000, false, [=, &D, &L] {
+        form r;
+        for (int i = 0; i < 20000; i++)
+            nucomp_form(r, (*forms)[i % 64], (*forms)[(i + 1) % 64], D, L);
+    }});
+    // Includes copying the form it reduces.
+    benchmarks.push_back({"reduce", 20000, false, [=] {
+        form r;
+        for (int i = 0; i < 20000; i++) {
+            r = (*unreduced)[i % 64];
+            reducer->reduce(r);
+        }
+    }});
+    benchmarks.push_back({"xgcd_partial", 20000, false, [=, &L] {
+        integer co2, co1, r2, r1;
+        for (int i = 0; i < 20000; i++) {
+            form& g = (*forms)[i % 64];
+            mpz_set(r2.impl, g.a.impl);
+            mpz_fdiv_r(r1.impl, g.b.impl, g.a.impl);
+            mpz_xgcd_partial(co2.impl, co1.impl, r2.impl, r1.impl, L.impl);
+        }
+    }});
+    for (int log_t : {14, 16, 18}) {
+        // The squarings are done once here; only the proof is timed.
+        uint64_t iters = 1 << log_t;
+        uint32_t k, l;
+        // The intermediates are kept for the whole run, and so is their reservation.
+        DefaultPlanner().ChooseSingle(iters, k, l);
+        std::vector<form>* intermediates = new std::vector<form>();
+        form* y = new form(form::generator(D));
+        for (uint64_t i = 0; i < iters; i += k * l) {
+            intermediates->push_back(*y);
+            RepeatedSquareForm(*y, D, L, std::min((uint64_t)k * l, iters - i), *reducer);
+            reducer->reduce(*y);
+        }
+        benchmarks.push_back({"prove_2^" + to_string(log_t), 1, false, [=, &D] {
+            form x = form::generator(D);
+            GenerateWesolowski(*y, x, D, *reducer, *intermediates, iters, k, l);
+        }});
+    }
+    {
+        form* y = new form();
+        form* proof = new form(ProveSegment(form::generator(D), D, L, 1 << 16, *y));
+        benchmarks.push_back({"verify_weso", 100, false, [=, &D] {
+            for (int i = 0; i < 100; i++) {
+                bool is_valid;
+                VerifyWesolowskiProof(D, form::generator(D), *y, *proof, 1 << 16, is_valid);
+                if (!is_valid)
+                    throw std::runtime_error("verify_weso: invalid proof");
+            }
+        }});
+    }
+    {
+        std::vector<uint8_t>* blob = new std::vector<uint8_t>(NWesolowskiBlob(D, L, 1 << 16, 1 << 15));
+        benchmarks.push_back({"verify_nweso", 20, true, [=, &D] {
+            for (int i = 0; i < 20; i++) {
+                if (!CheckProofOfTimeNWesolowski(D, form::generator(D), blob->data(), blob->size(), 3 << 15, 1))
+                    throw std::runtime_error("verify_nweso: invalid proof");
+            }
+        }});
+    }
+    benchmarks.push_back({"hash_prime", 200, false, [] {
+        std::vector<uint8_t> seed(32);
+        for (int i = 0; i < 200; i++) {
+            seed[i % 32]++;
+            HashPrime(seed, 264, {263});
+        }
+    }});
+    benchmarks.push_back({"create_discriminant", 5, false, [] {
+        std::vector<uint8_t> seed(32);
+        for (int i = 0; i < 5; i++) {
+            seed[i]++;
+            CreateDiscriminant(seed, 1024);
+        }
+    }});
+    benchmarks.push_back({"serialize", 20000, false, [=, &D] {
+        std::vector<uint8_t> raw(2 * int_size);
+        for (int i = 0; i < 20000; i++) {
+            SerializeForm((*forms)[i % 64], int_size, raw.data());
+            DeserializeForm(D, raw.data(), int_size);
+        }
+    }});
+    benchmarks.push_back({"compress", 2000, false, [=, &D] {
+        std::vector<uint8_t> compressed;
+        form g;
+        for (int i = 0; i < 2000; i++) {
+            compressed.clear();
+            CompressForm((*forms)[i % 64], D, compressed);
+            DecompressForm(compressed.data(), compressed.size(), D, g);
+        }
+    }});
+    // The n-wesolowski client path: the VDF loop, its stores and the prover manager, from the
+    // start of the VDF to the proof of 2^18 iterations.
+    benchmarks.push_back({"prove_e2e_2^18", 1, true, [&D, &L] {
+        // The prover logs every proof; keep that out of the report.
+        std::ostringstream log;
+        std::streambuf* stdout_buf = std::cout.rdbuf(log.rdbuf());
+        fast_algorithm = true;
+        bool stopped = false;
+        WesolowskiCallback* weso = new FastAlgorithmCallback(segments, D, false);
+        std::thread vdf_worker(repeated_square, form::generator(D), std::ref(D), std::ref(L), weso, (FastStorage*)NULL, std::ref(stopped));
+        ProverManager pm(D, (FastAlgorithmCallback*)weso, NULL, segments, thread_count);
+        pm.start();
+        Proof proof = pm.Prove(1 << 18);
+        pm.stop();
+        stopped = true;
+        vdf_worker.join();
+        delete(weso);
+        fast_algorithm = false;
+        std::cout.rdbuf(stdout_buf);
+        if (proof.y.empty())
+            throw std::runtime_error("prove_e2e: no proof");
+    }});
+    return benchmarks;
+}
+
+std::string FormatNs(double ns) {
+    char buf[32];
+    if (ns >= 1e9)
+        snprintf(buf, sizeof(buf), "%.3f s", ns / 1e9);
+    else if (ns >= 1e6)
+        snprintf(buf, sizeof(buf), "%.3f ms", ns / 1e6);
+    else if (ns >= 1e3)
+        snprintf(buf, sizeof(buf), "%.3f us", ns / 1e3);
+    else
+        snprintf(buf, sizeof(buf), "%.1f ns", ns);
+    return buf;
+}
+
+void PinToCpu(int cpu, cpu_set_t& all_cpus) {
+    if (cpu < 0) {
+        sched_setaffinity(0, sizeof(all_cpus), &all_cpus);
+        return;
+    }
+    cpu_set_t one_cpu;
+    CPU_ZERO(&one_cpu);
+    CPU_SET(cpu, &one_cpu);
+    sched_setaffinity(0, sizeof(one_cpu), &one_cpu);
+}
+
+BenchResult RunBenchmark(Benchmark& benchmark, int warmup, int reps) {
+    for (int i = 0; i < warmup; i++)
+        benchmark.run();
+    std::vector<double> samples;
+    for (int i = 0; i < reps; i++) {
+        auto t1 = std::chrono::high_resolution_clock::now();
+        benchmark.run();
+        auto t2 = std::chrono::high_resolution_clock::now();
+        samples.push_back(std::chrono::duration<double, std::nano>(t2 - t1).count() / benchmark.ops);
+    }
+    std::sort(samples.begin(), samples.end());
+    BenchResult result = {benchmark.name, benchmark.ops};
+    result.median_ns = samples[samples.size() / 2];
+    if (samples.size() % 2 == 0)
+        result.median_ns = (result.median_ns + samples[samples.size() / 2 - 1]) / 2;
+    result.min_ns = samples[0];
+    result.mean_ns = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+    double variance = 0;
+    for (double sample : samples)
+        variance += (sample - result.mean_ns) * (sample - result.mean_ns);
+    result.stddev_ns = std::sqrt(variance / samples.size());
+    return result;
+}
+
+std::string CpuModel() {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos)
+            return line.substr(line.find(':') + 2);
+    }
+    return "unknown";
+}
+
+std::string ResultsToJson(std::vector<BenchResult>& results, int warmup, int reps, int cpu) {
+    std::ostringstream out;
+    out << std::setprecision(6);
+    out << "{\n  \"cpu_model\": \"" << CpuModel() << "\",\n"
+        << "  \"pinned_cpu\": " << cpu << ",\n  \"warmup\": " << warmup << ",\n  \"reps\": " << reps << ",\n"
+        << "  \"benchmarks\": [\n";
+    for (int i = 0; i < results.size(); i++) {
+        BenchResult& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"ops\": " << r.ops << ", \"median_ns\": " << r.median_ns
+            << ", \"min_ns\": " << r.min_ns << ", \"mean_ns\": " << r.mean_ns << ", \"stddev_ns\": " << r.stddev_ns
+            << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return out.str();
+}
+
+// Reads back the name and median_ns of each benchmark from ResultsToJson's output.
+std::map<std::string, double> ReadBaseline(const std::string& path) {
+    std::ifstream in(path);
+    if (!in)
+        throw std::runtime_error("can't read " + path);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string json = buffer.str();
+    std::map<std::string, double> medians;
+    size_t pos = 0;
+    while ((pos = json.find("\"name\": \"", pos)) != std::string::npos) {
+        pos += 9;
+        size_t end = json.find('"', pos);
+        size_t median = json.find("\"median_ns\": ", end);
+        if (end == std::string::npos || median == std::string::npos)
+            break;
+        medians[json.substr(pos, end - pos)] = atof(json.c_str() + median + 13);
+        pos = end;
+    }
+    return medians;
+}
+
+// Prints how each benchmark moved from 'base' and returns the number slower by more than 'pct'
+// percent.
+int CompareResults(std::map<std::string, double>& base, std::map<std::string, double>& current, double pct) {
+    int regressions = 0;
+    for (auto& entry : current) {
+        if (!base.count(entry.first)) {
+            printf("%-22s %12s  (not in baseline)\n", entry.first.c_str(), FormatNs(entry.second).c_str());
+            continue;
+        }
+        double change = 100 * (entry.second / base[entry.first] - 1);
+        bool regressed = change > pct;
+        regressions += regressed;
+        printf("%-22s %12s  %+7.1f%%%s\n", entry.first.c_str(), FormatNs(entry.second).c_str(), change,
+               regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int RunSuite(int argc, char **argv, integer& D) {
+    int warmup = 1, reps = 5, cpu = -1;
+    double pct = 5;
+    std::string filter, json_path, baseline_path;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "w:r:c:f:j:b:t:")) != -1) {
+        switch (opt) {
+            case 'w': warmup = atoi(optarg); break;
+            case 'r': reps = std::max(1, atoi(optarg)); break;
+            case 'c': cpu = atoi(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'j': json_path = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            case 't': pct = atof(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    cpu_set_t all_cpus;
+    sched_getaffinity(0, sizeof(all_cpus), &all_cpus);
+
+    integer L = root(-D, 4);
+    std::vector<Benchmark> benchmarks = SuiteBenchmarks(D, L);
+    std::vector<BenchResult> results;
+    for (Benchmark& benchmark : benchmarks) {
+        if (!filter.empty() && benchmark.name.find(filter) == std::string::npos)
+            continue;
+        PinToCpu(benchmark.threaded ? -1 : cpu, all_cpus);
+        BenchResult r = RunBenchmark(benchmark, warmup, reps);
+        PinToCpu(-1, all_cpus);
+        printf("%-22s %12s/op  (min %s, stddev %.1f%%)\n", r.name.c_str(), FormatNs(r.median_ns).c_str(),
+               FormatNs(r.min_ns).c_str(), 100 * r.stddev_ns / r.mean_ns);
+        fflush(stdout);
+        results.push_back(r);
+    }
+    if (!json_path.empty()) {
+        std::ofstream out(json_path);
+        out << ResultsToJson(results, warmup, reps, cpu);
+    }
+    if (!baseline_path.empty()) {
+        std::map<std::string, double> base = ReadBaseline(baseline_path), current;
+        for (BenchResult& r : results)
+            current[r.name] = r.median_ns;
+        printf("\nAgainst %s:\n", baseline_path.c_str());
+        return CompareResults(base, current, pct) > 0 ? 2 : 0;
+    }
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
+    if(hasAVX2())
+    {
+      gcd_base_bits=avx2_gcd_base_bits;
+      gcd_128_max_iter=avx2_gcd_128_max_iter;
+    }
     assert(is_vdf_test); //assertions should be disabled in VDF_MODE==0
     init_gmp();
     allow_integer_constructor=true; //make sure the old gmp allocator isn't used
     set_rounding_mode();
 
-    if (argc < 3) {
+    if (argc >= 2 && !strcmp(argv[1], "compare")) {
+        if (argc < 4) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::map<std::string, double> base = ReadBaseline(argv[2]), current = ReadBaseline(argv[3]);
+        return CompareResults(base, current, argc > 4 ? atof(argv[4]) : 5) > 0 ? 2 : 0;
+    }
+    if (argc < 3 && !(argc == 2 && !strcmp(argv[1], "suite"))) {
         usage(argv[0]);
         return 1;
     }
-    int iters = atoi(argv[2]);
+    int iters = argc > 2 ? atoi(argv[2]) : 0;
     auto D = integer("-141140317794792668862943332656856519378482291428727287413318722089216448567155737094768903643716404517549715385664163360316296284155310058980984373770517398492951860161717960368874227473669336541818575166839209228684755811071416376384551902149780184532086881683576071479646499601330824259260645952517205526679");
 
+    if (!strcmp(argv[1], "suite"))
+        return RunSuite(argc, argv, D);
+
     form y = form::generator(D);
     integer L = root(-D, 4);
     int i, n_slow = 0;
@@ -47,12 +434,15 @@ int main(int argc, char **argv)
     auto t1 = std::chrono::high_resolution_clock::now();
     if (!strcmp(argv[1], "square_asm")) {
         is_asm = true;
+        if (getenv("VDF_PHASE_PROFILE"))
+            phase_profiler.Enable(std::max(atoi(getenv("VDF_PHASE_PROFILE")), 1));
         for (i = 0; i < iters; ) {
             square_state_type sq_state;
             sq_state.pairindex = 0;
+            sq_state.profile_phases = true;
             uint64_t done;
 
-            done = repeated_square_fast(sq_state, y, D, L, 0, iters - i, NULL);
+            done = repeated_square_fast(sq_state, y, D, L, i, iters - i, NULL);
             if (!done) {
                 nudupl_form(y, y, D, L);
                 reducer.reduce(y);
@@ -87,6 +477,38 @@ int main(int argc, char **argv)
             ch_vec[i % CH_SIZE] += 1;
             integer discr = CreateDiscriminant(ch_vec, 1024);
         }
+    } else if (!strcmp(argv[1], "compress")) {
+        int int_size = (D.num_bits() + 16) >> 4;
+        std::vector<form> forms;
+        for (i = 0; i < 100; i++) {
+            nudupl_form(y, y, D, L);
+            reducer.reduce(y);
+            forms.push_back(y);
+        }
+        std::vector<uint8_t> raw(2 * int_size), compressed;
+        form f;
+        size_t compressed_size = 0;
+        auto t_start = std::chrono::high_resolution_clock::now();
+        for (i = 0; i < iters; i++) {
+            SerializeForm(forms[i % forms.size()], int_size, raw.data());
+            f = DeserializeForm(D, raw.data(), int_size);
+        }
+        auto t_mid = std::chrono::high_resolution_clock::now();
+        for (i = 0; i < iters; i++) {
+            compressed.clear();
+            CompressForm(forms[i % forms.size()], D, compressed);
+            compressed_size += compressed.size();
+            if (!DecompressForm(compressed.data(), compressed.size(), D, f) || !(f == forms[i % forms.size()])) {
+                printf("Fail\n");
+                return 1;
+            }
+        }
+        auto t_end = std::chrono::high_resolution_clock::now();
+        double raw_us = std::chrono::duration<double, std::micro>(t_mid - t_start).count() / iters;
+        double compressed_us = std::chrono::duration<double, std::micro>(t_end - t_mid).count() / iters;
+        printf("raw: %d bytes, %.2f us/form; compressed: %.1f bytes, %.2f us/form\n",
+               2 * int_size, raw_us, (double)compressed_size / iters, compressed_us);
+        return 0;
     } else {
         fprintf(stderr, "Unknown command\n");
         usage(argv[0]);
@@ -111,6 +533,8 @@ int main(int argc, char **argv)
         printf("a = %s\n", y.a.to_string().c_str());
         printf("b = %s\n", y.b.to_string().c_str());
         printf("c = %s\n", y.c.to_string().c_str());
+        if (phase_profiler.Enabled())
+            printf("%s", phase_profiler.Report().c_str());
     } else {
         printf("speed: %d.%d ms/discr\n", duration/iters, duration*10/iters % 10);
     }
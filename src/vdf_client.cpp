@@ -1,16 +1,19 @@
 #include <boost/asio.hpp>
+#include <poll.h>
 #include "vdf.h"
 
 using boost::asio::ip::tcp;
 
 const int max_length = 2048;
-std::mutex socket_mutex;
 
 int process_number;
 // Segments are 2^16, 2^18, ..., 2^30
 // Best case it'll be able to proof for up to 2^36 due to 64-wesolowski restriction.
 int segments = 8;
 int thread_count = 3;
+// Threads running proof tasks. A task spends most of its time waiting for the VDF to pass its
+// iteration, so this bounds outstanding requests rather than matching the core count.
+const int kProofTaskThreads = 16;
 
 void PrintInfo(std::string input) {
     std::cout << "VDF Client: " << input << "\n";
@@ -21,52 +24,311 @@ char disc[350];
 char disc_size[5];
 int disc_int_size;
 
-void WriteProof(uint64_t iteration, Proof& result, tcp::socket& sock) {
-    // Writes the number of iterations
-    std::vector<unsigned char> bytes = ConvertIntegerToBytes(integer(iteration), 8);
+// Set when the timelord asked for binary framing: iterations come in as
+// count (4) | iteration (8) * count and proofs go out as length (4) | raw payload, all integers
+// little endian. Otherwise iterations are 2 ASCII digits of length then decimal digits, and proofs
+// are hex with a 4 byte big endian length.
+bool binary_framing = false;
+// Set when the timelord asked for a persistent session: after STOP / ACK the connection stays open
+// for the next challenge, which starts again with the prover type.
+bool persistent = false;
+// In a persistent session, the n-weso stores, the fast storage threads and the prover manager are
+// kept for the next challenge, along with the machine type they were made for.
+FastAlgorithmCallback* warm_weso = NULL;
+FastStorage* warm_fast_storage = NULL;
+ProverManager* warm_prover_manager = NULL;
+bool warm_weso_multi_proc = false;
+
+void DeleteWarmProver() {
+    delete(warm_prover_manager);
+    delete(warm_fast_storage);
+    delete(warm_weso);
+    warm_prover_manager = NULL;
+    warm_fast_storage = NULL;
+    warm_weso = NULL;
+}
+
+// Largest number of iterations in one binary framing request.
+const uint64_t kMaxIterationBatch = 1 << 16;
+
+void WriteLittleEndian(uint64_t x, uint8_t* out, int num_bytes) {
+    for (int i = 0; i < num_bytes; i++) {
+        out[i] = x & 255;
+        x >>= 8;
+    }
+}
+
+uint64_t ReadLittleEndian(const uint8_t* bytes, int num_bytes) {
+    uint64_t x = 0;
+    for (int i = num_bytes - 1; i >= 0; i--)
+        x = (x << 8) | bytes[i];
+    return x;
+}
 
-    // Writes the y, with prepended size
-    std::vector<unsigned char> y_size = ConvertIntegerToBytes(integer(result.y.size()), 8);
-    bytes.insert(bytes.end(), y_size.begin(), y_size.end());
-    bytes.insert(bytes.end(), result.y.begin(), result.y.end());
-    
-    // Writes the witness type.
-    std::vector<unsigned char> witness_type = ConvertIntegerToBytes(integer(result.witness_type), 1);
-    bytes.insert(bytes.end(), witness_type.begin(), witness_type.end());
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
 
-    bytes.insert(bytes.end(), result.proof.begin(), result.proof.end());
+// Serves vdf_metrics in the Prometheus text format to any HTTP request on localhost:port, from its
+// own thread for the life of the process.
+void ServeMetrics(int port) {
+    std::thread([port] {
+        try {
+            boost::asio::io_service io_service;
+            tcp::acceptor acceptor(io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+            PrintInfo("Serving metrics on 127.0.0.1:" + to_string(port));
+            while (true) {
+                tcp::socket sock(io_service);
+                acceptor.accept(sock);
+                // Wait at most 2 seconds for each part of the request (asio's blocking read has no
+                // timeout), so a scraper that never finishes its request can't hold up the next one.
+                std::string request;
+                char buf[1024];
+                ssize_t got;
+                struct pollfd readable = {sock.native_handle(), POLLIN, 0};
+                while (request.find("\r\n\r\n") == std::string::npos && request.size() < (1 << 16) &&
+                       poll(&readable, 1, 2000) > 0 &&
+                       (got = recv(sock.native_handle(), buf, sizeof(buf), 0)) > 0) {
+                    request.append(buf, got);
+                }
+                if (request.find("\r\n\r\n") == std::string::npos)
+                    continue;
+                boost::system::error_code error;
+                std::string body = vdf_metrics.Render();
+                if (phase_profiler.Enabled())
+                    body += phase_profiler.RenderMetrics();
+                std::string response = "HTTP/1.0 200 OK\r\n"
+                                       "Content-Type: text/plain; version=0.0.4\r\n"
+                                       "Content-Length: " + to_string(body.size()) + "\r\n"
+                                       "Connection: close\r\n\r\n" + body;
+                boost::asio::write(sock, boost::asio::buffer(response), error);
+            }
+        } catch (std::exception& e) {
+            PrintInfo("Metrics endpoint stopped: " + to_string(e.what()));
+        }
+    }).detach();
+}
+
+// Binary framing version of the proof message.
+std::string EncodeProofBinary(uint64_t iteration, Proof& result) {
+    // length (4) | iterations (8) | y size (8) | y | witness type (1) | proof
+    size_t payload_size = 8 + 8 + result.y.size() + 1 + result.proof.size();
+    std::string bytes(4 + payload_size, 0);
+    uint8_t* out = (uint8_t*)&bytes[0];
+    WriteLittleEndian(payload_size, out, 4);
+    WriteLittleEndian(iteration, out + 4, 8);
+    WriteLittleEndian(result.y.size(), out + 12, 8);
+    out += 20;
+    memcpy(out, result.y.data(), result.y.size());
+    out += result.y.size();
+    out[0] = result.witness_type;
+    memcpy(out + 1, result.proof.data(), result.proof.size());
+    return bytes;
+}
+
+// The message sent to the timelord for a proof, length prefix included.
+std::string EncodeProof(uint64_t iteration, Proof& result) {
+    if (binary_framing)
+        return EncodeProofBinary(iteration, result);
+
+    // iterations (8) | y size (8) | y | witness type (1) | proof
+    std::vector<unsigned char> bytes(8 + 8 + result.y.size() + 1 + result.proof.size());
+    uint8_t* out = bytes.data();
+    WriteUint64Bytes(iteration, out, 8);
+    WriteUint64Bytes(result.y.size(), out + 8, 8);
+    out += 16;
+    memcpy(out, result.y.data(), result.y.size());
+    out += result.y.size();
+    WriteUint64Bytes(result.witness_type, out, 1);
+    memcpy(out + 1, result.proof.data(), result.proof.size());
     std::string str_result = BytesToStr(bytes);
 
-    const uint32_t length = str_result.size();
-    std::vector<unsigned char> prefix_bytes = ConvertIntegerToBytes(integer(length), 4);
-    std::string prefix = BytesToStr(prefix_bytes);
+    uint8_t prefix_bytes[4];
+    WriteUint64Bytes(str_result.size(), prefix_bytes, 4);
+    return std::string((char*)prefix_bytes, 4) + str_result;
+}
 
-    PrintInfo("Sending proof");
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        boost::asio::write(sock, boost::asio::buffer(prefix_bytes, 4));
-        boost::asio::write(sock, boost::asio::buffer(str_result.c_str(), str_result.size()));
+// Runs tasks on a fixed set of threads, lowest iteration first.
+class ProofExecutor {
+  public:
+    ProofExecutor(int num_threads) {
+        for (int i = 0; i < num_threads; i++)
+            workers.emplace_back([this] { Run(); });
     }
-    PrintInfo("Sended proof");
-}
 
-void CreateAndWriteProof(ProverManager& pm, uint64_t iteration, bool& stop_signal, tcp::socket& sock) {
-    Proof result = pm.Prove(iteration);
-    if (stop_signal == true) {
-        PrintInfo("Got stop signal before completing the proof!");
-        return ;
+    ~ProofExecutor() {
+        Join();
     }
-    WriteProof(iteration, result, sock);
-}
 
-void CreateAndWriteProofTwoWeso(integer& D, form f, uint64_t iters, TwoWesolowskiCallback* weso, bool& stop_signal, tcp::socket& sock) {
-    Proof result = ProveTwoWeso(D, f, iters, 0, weso, 0, stop_signal);
-    if (stop_signal) {
-        PrintInfo("Got stop signal before completing the proof!");
-        return ;
+    void Submit(uint64_t iteration, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lk(tasks_mutex);
+            tasks.emplace(iteration, std::move(task));
+        }
+        tasks_cv.notify_one();
+    }
+
+    // Runs the queued tasks to completion and stops the threads.
+    void Join() {
+        {
+            std::lock_guard<std::mutex> lk(tasks_mutex);
+            joining = true;
+        }
+        tasks_cv.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+  private:
+    void Run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lk(tasks_mutex);
+                tasks_cv.wait(lk, [this] { return joining || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.begin()->second);
+                tasks.erase(tasks.begin());
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::multimap<uint64_t, std::function<void()>> tasks;
+    std::mutex tasks_mutex;
+    std::condition_variable tasks_cv;
+    bool joining = false;
+};
+
+// Socket I/O of a session once the handshake is done, on the io_service thread: one read
+// outstanding at a time, and a write queue so messages from proof tasks never interleave.
+class SessionIO {
+  public:
+    SessionIO(boost::asio::io_service& io, tcp::socket& sock) : io(io), sock(sock) {}
+
+    // Queues a proof message for the socket. Safe to call from any thread.
+    void Send(std::string message) {
+        PrintInfo("Sending proof");
+        io.post([this, message] {
+            write_queue.push_back(message);
+            if (write_queue.size() == 1)
+                WriteNext();
+        });
+    }
+
+    // Calls on_iteration, on the io_service thread, for each iteration the timelord sends, up to
+    // and including the 0 that ends the session. A read error counts as that 0.
+    void ReadIterations(std::function<void(uint64_t)> on_iteration) {
+        this->on_iteration = on_iteration;
+        ReadIterationSize();
+    }
+
+    // Runs until the session has nothing left to read or write.
+    void Run() {
+        io.run();
+        io.restart();
+    }
+
+  private:
+    void WriteNext() {
+        boost::asio::async_write(sock, boost::asio::buffer(write_queue.front()),
+            [this] (const boost::system::error_code& error, size_t) {
+                if (error) {
+                    PrintInfo("Write failed: " + error.message());
+                    write_queue.clear();
+                    return;
+                }
+                PrintInfo("Sended proof");
+                write_queue.pop_front();
+                if (!write_queue.empty())
+                    WriteNext();
+            });
+    }
+
+    void ReadIterationSize() {
+        if (binary_framing) {
+            ReadIterationBatch();
+            return;
+        }
+        boost::asio::async_read(sock, boost::asio::buffer(read_buf, 2),
+            [this] (const boost::system::error_code& error, size_t) {
+                if (error) {
+                    PrintInfo("Read failed: " + error.message());
+                    on_iteration(0);
+                    return;
+                }
+                int size = (read_buf[0] - '0') * 10 + (read_buf[1] - '0');
+                if (size < 0 || size > (int)sizeof(read_buf)) {
+                    PrintInfo("Bad iteration size");
+                    on_iteration(0);
+                    return;
+                }
+                ReadIteration(size);
+            });
+    }
+
+    void ReadIteration(int size) {
+        boost::asio::async_read(sock, boost::asio::buffer(read_buf, size),
+            [this, size] (const boost::system::error_code& error, size_t) {
+                if (error) {
+                    PrintInfo("Read failed: " + error.message());
+                    on_iteration(0);
+                    return;
+                }
+                uint64_t iters = 0;
+                for (int i = 0; i < size; i++)
+                    iters = iters * 10 + read_buf[i] - '0';
+                on_iteration(iters);
+                if (iters != 0)
+                    ReadIterationSize();
+            });
     }
-    WriteProof(iters, result, sock);
-}
+
+    // Binary framing: a count, then that many iterations.
+    void ReadIterationBatch() {
+        boost::asio::async_read(sock, boost::asio::buffer(read_buf, 4),
+            [this] (const boost::system::error_code& error, size_t) {
+                if (error) {
+                    PrintInfo("Read failed: " + error.message());
+                    on_iteration(0);
+                    return;
+                }
+                uint64_t count = ReadLittleEndian((uint8_t*)read_buf, 4);
+                if (count == 0 || count > kMaxIterationBatch) {
+                    PrintInfo("Bad iteration batch size");
+                    on_iteration(0);
+                    return;
+                }
+                batch_buf.resize(8 * count);
+                boost::asio::async_read(sock, boost::asio::buffer(batch_buf),
+                    [this, count] (const boost::system::error_code& error, size_t) {
+                        if (error) {
+                            PrintInfo("Read failed: " + error.message());
+                            on_iteration(0);
+                            return;
+                        }
+                        for (uint64_t i = 0; i < count; i++) {
+                            uint64_t iters = ReadLittleEndian(batch_buf.data() + 8 * i, 8);
+                            on_iteration(iters);
+                            // 0 ends the session, anything after it is ignored.
+                            if (iters == 0)
+                                return;
+                        }
+                        ReadIterationBatch();
+                    });
+            });
+    }
+
+    boost::asio::io_service& io;
+    tcp::socket& sock;
+    std::deque<std::string> write_queue;
+    char read_buf[20];
+    std::vector<uint8_t> batch_buf;
+    std::function<void(uint64_t)> on_iteration;
+};
 
 void InitSession(tcp::socket& sock) {
     boost::system::error_code error;
@@ -104,8 +366,13 @@ void FinishSession(tcp::socket& sock) {
         boost::system::error_code error;
 
         PrintInfo("Stopped everything! Ready for the next challenge.");
+        if (phase_profiler.Enabled()) {
+            std::istringstream report(phase_profiler.Report());
+            std::string line;
+            while (std::getline(report, line))
+                PrintInfo("Phase profile: " + line);
+        }
 
-        std::lock_guard<std::mutex> lock(socket_mutex);
         boost::asio::write(sock, boost::asio::buffer("STOP", 4));
 
         char ack[5];
@@ -117,21 +384,7 @@ void FinishSession(tcp::socket& sock) {
     }
 }
 
-uint64_t ReadIteration(tcp::socket& sock) {
-    boost::system::error_code error;
-    char data[20];
-    memset(data, 0, sizeof(data));
-    boost::asio::read(sock, boost::asio::buffer(data, 2), error);
-    int size = (data[0] - '0') * 10 + (data[1] - '0');
-    memset(data, 0, sizeof(data));
-    boost::asio::read(sock, boost::asio::buffer(data, size), error);
-    uint64_t iters = 0;
-    for (int i = 0; i < size; i++)
-        iters = iters * 10 + data[i] - '0';       
-    return iters;
-}
-
-void SessionFastAlgorithm(tcp::socket& sock) {
+void SessionFastAlgorithm(boost::asio::io_service& io_service, tcp::socket& sock) {
     InitSession(sock);
     try {
         integer D(disc);
@@ -139,47 +392,81 @@ void SessionFastAlgorithm(tcp::socket& sock) {
         form f=form::generator(D);
         PrintInfo("Discriminant = " + to_string(D.impl));
 
-        std::vector<std::thread> threads;
         const bool multi_proc_machine = (std::thread::hardware_concurrency() >= 16) ? true : false;
-        WesolowskiCallback* weso = new FastAlgorithmCallback(segments, D, multi_proc_machine);
+        WesolowskiCallback* weso;
         FastStorage* fast_storage = NULL;
-        if (multi_proc_machine) {
-            fast_storage = new FastStorage((FastAlgorithmCallback*)weso);   
+        ProverManager* pm;
+        if (warm_weso != NULL && warm_weso_multi_proc == multi_proc_machine) {
+            // The fast storage was reset when the last challenge stopped.
+            warm_weso->Reset(D);
+            weso = warm_weso;
+            fast_storage = warm_fast_storage;
+            pm = warm_prover_manager;
+            pm->Reset(D);
+        } else {
+            DeleteWarmProver();
+            weso = new FastAlgorithmCallback(segments, D, multi_proc_machine);
+            if (multi_proc_machine) {
+                fast_storage = new FastStorage((FastAlgorithmCallback*)weso);   
+            }
+            pm = new ProverManager(D, (FastAlgorithmCallback*)weso, fast_storage, segments, thread_count);
         }
+        warm_weso = NULL;
+        warm_fast_storage = NULL;
+        warm_prover_manager = NULL;
         bool stopped = false;
         std::thread vdf_worker(repeated_square, f, std::ref(D), std::ref(L), weso, fast_storage, std::ref(stopped));
-        ProverManager pm(D, (FastAlgorithmCallback*)weso, fast_storage, segments, thread_count);        
-        pm.start();
+        pm->start();
 
         // Tell client that I'm ready to get the challenges.
         boost::asio::write(sock, boost::asio::buffer("OK", 2));
 
-        while (!stopped) {
-            uint64_t iters = ReadIteration(sock);
+        SessionIO session(io_service, sock);
+        ProofExecutor executor(kProofTaskThreads);
+        session.ReadIterations([&] (uint64_t iters) {
             if (iters == 0) {
                 PrintInfo("Got stop signal!");
                 stopped = true;
-                pm.stop();
+                pm->stop();
                 vdf_worker.join();
-                for (int t = 0; t < threads.size(); t++) {
-                    threads[t].join();
-                }
-                if (fast_storage != NULL) {
-                    delete(fast_storage);
+                executor.Join();
+                if (persistent) {
+                    if (fast_storage != NULL) {
+                        fast_storage->Reset();
+                    }
+                    warm_weso = (FastAlgorithmCallback*)weso;
+                    warm_fast_storage = fast_storage;
+                    warm_prover_manager = pm;
+                    warm_weso_multi_proc = multi_proc_machine;
+                } else {
+                    delete(pm);
+                    if (fast_storage != NULL) {
+                        delete(fast_storage);
+                    }
+                    delete(weso);
                 }
-                delete(weso);
             } else {
                 PrintInfo("Received iteration: " + to_string(iters));
-                threads.push_back(std::thread(CreateAndWriteProof, std::ref(pm), iters, std::ref(stopped), std::ref(sock)));
+                auto received = std::chrono::steady_clock::now();
+                executor.Submit(iters, [&, iters, received] {
+                    Proof result = pm->Prove(iters);
+                    if (stopped) {
+                        PrintInfo("Got stop signal before completing the proof!");
+                        return;
+                    }
+                    session.Send(EncodeProof(iters, result));
+                    vdf_metrics.proof_latency.Observe(SecondsSince(received));
+                });
             }
-        }
+        });
+        session.Run();
     } catch (std::exception& e) {
         PrintInfo("Exception in thread: " + to_string(e.what()));
     }
     FinishSession(sock);
 }
 
-void SessionOneWeso(tcp::socket& sock) {
+void SessionOneWeso(boost::asio::io_service& io_service, tcp::socket& sock) {
     InitSession(sock);
     try {
         integer D(disc);
@@ -190,30 +477,43 @@ void SessionOneWeso(tcp::socket& sock) {
         // Tell client that I'm ready to get the challenges.
         boost::asio::write(sock, boost::asio::buffer("OK", 2));
 
-        uint64_t iter = ReadIteration(sock);
         bool stopped = false;
-        WesolowskiCallback* weso = new OneWesolowskiCallback(D, iter);
+        WesolowskiCallback* weso = NULL;
         FastStorage* fast_storage = NULL;
-        std::thread vdf_worker(repeated_square, f, std::ref(D), std::ref(L), weso, fast_storage, std::ref(stopped));
-
-        Proof proof = ProveOneWesolowski(iter, D, (OneWesolowskiCallback*)weso, stopped);
-        WriteProof(iter, proof, sock);
-
-        iter = ReadIteration(sock);
-        while (iter != 0) {
-            std::cout << "Warning: did not receive stop signal\n";
-            iter = ReadIteration(sock);
-        }
-        stopped = true;
-        vdf_worker.join();
-        delete(weso);
+        std::thread vdf_worker;
+
+        SessionIO session(io_service, sock);
+        ProofExecutor executor(1);
+        session.ReadIterations([&] (uint64_t iter) {
+            if (iter == 0) {
+                // The proof stops the VDF itself once it has the result.
+                executor.Join();
+                stopped = true;
+                if (weso != NULL) {
+                    vdf_worker.join();
+                    delete(weso);
+                }
+            } else if (weso != NULL) {
+                std::cout << "Warning: did not receive stop signal\n";
+            } else {
+                weso = new OneWesolowskiCallback(D, iter);
+                vdf_worker = std::thread(repeated_square, f, std::ref(D), std::ref(L), weso, fast_storage, std::ref(stopped));
+                auto received = std::chrono::steady_clock::now();
+                executor.Submit(iter, [&, iter, received] {
+                    Proof proof = ProveOneWesolowski(iter, D, (OneWesolowskiCallback*)weso, stopped);
+                    session.Send(EncodeProof(iter, proof));
+                    vdf_metrics.proof_latency.Observe(SecondsSince(received));
+                });
+            }
+        });
+        session.Run();
     } catch (std::exception& e) {
         PrintInfo("Exception in thread: " + to_string(e.what()));
     }
     FinishSession(sock);
 }
 
-void SessionTwoWeso(tcp::socket& sock) {
+void SessionTwoWeso(boost::asio::io_service& io_service, tcp::socket& sock) {
     const int kMaxProcessesAllowed = 3;
     InitSession(sock);
     try {
@@ -226,75 +526,86 @@ void SessionTwoWeso(tcp::socket& sock) {
         boost::asio::write(sock, boost::asio::buffer("OK", 2));
 
         bool stopped = false;
-        bool stop_vector[100];
-        std::vector<std::thread> threads;
-        // (iteration, thread_id)
+        // One flag per started proof; a deque so references to them stay valid.
+        std::deque<bool> stop_vector;
+        // (iteration, proof id)
         std::set<std::pair<uint64_t, uint64_t> > seen_iterations;
         WesolowskiCallback* weso = new TwoWesolowskiCallback(D);
         FastStorage* fast_storage = NULL;
         std::thread vdf_worker(repeated_square, f, std::ref(D), std::ref(L), weso, fast_storage, std::ref(stopped));
+        // Measures the proving costs once for all the proofs of this challenge.
+        TwoWesoPlanner planner(D, (TwoWesolowskiCallback*)weso);
 
-        while (!stopped) {
-            uint64_t iters = ReadIteration(sock);
+        SessionIO session(io_service, sock);
+        // One more than allowed: a proof that was just told to stop may still be winding down.
+        ProofExecutor executor(kMaxProcessesAllowed + 1);
+        session.ReadIterations([&] (uint64_t iters) {
             if (iters == 0) {
                 PrintInfo("Got stop signal!");
                 stopped = true;
-                for (int i = 0; i < threads.size(); i++)
-                    stop_vector[i] = true;
-                for (int t = 0; t < threads.size(); t++) {
-                    threads[t].join();
-                }
+                for (bool& stop : stop_vector)
+                    stop = true;
+                executor.Join();
                 vdf_worker.join();
                 delete(weso);
-            } else {
-                uint64_t max_iter = 0;
-                uint64_t max_iter_thread_id = -1;
-                uint64_t min_iter = 1ULL << 62;
-                bool unique = true;
-                for (auto active_iter: seen_iterations) {
-                    if (active_iter.first > max_iter) {
-                        max_iter = active_iter.first;
-                        max_iter_thread_id = active_iter.second;
-                    }
-                    if (active_iter.first < min_iter) {
-                        min_iter = active_iter.first;
-                    }
-                    if (active_iter.first == iters) {
-                        unique = false;
-                        break;
-                    }
+                return;
+            }
+            uint64_t max_iter = 0;
+            uint64_t max_iter_thread_id = -1;
+            uint64_t min_iter = 1ULL << 62;
+            bool unique = true;
+            for (auto active_iter: seen_iterations) {
+                if (active_iter.first > max_iter) {
+                    max_iter = active_iter.first;
+                    max_iter_thread_id = active_iter.second;
                 }
-                if (!unique) {
-                    PrintInfo("Duplicate iteration " + to_string(iters) + "... Ignoring.");
-                    continue;
+                if (active_iter.first < min_iter) {
+                    min_iter = active_iter.first;
                 }
-                if (iters >= kMaxProcessesAllowed - 500000) {
-                    PrintInfo("Too big iter... ignoring");
-                    continue;
+                if (active_iter.first == iters) {
+                    unique = false;
+                    break;
                 }
-                if (threads.size() < kMaxProcessesAllowed || iters < min_iter) {
-                    seen_iterations.insert({iters, threads.size()});
-                    PrintInfo("Running proving for iter: " + to_string(iters));
-                    stop_vector[threads.size()] = false;
-                    threads.push_back(std::thread(CreateAndWriteProofTwoWeso, std::ref(D), f, iters,
-                                      (TwoWesolowskiCallback*)weso, std::ref(stop_vector[threads.size()]), 
-                                      std::ref(sock)));
-                    if (threads.size() > kMaxProcessesAllowed) {
-                        PrintInfo("Stopping proving for iter: " + to_string(max_iter));
-                        stop_vector[max_iter_thread_id] = true;
-                        seen_iterations.erase({max_iter, max_iter_thread_id});
+            }
+            if (!unique) {
+                PrintInfo("Duplicate iteration " + to_string(iters) + "... Ignoring.");
+                return;
+            }
+            if (iters >= kMaxProcessesAllowed - 500000) {
+                PrintInfo("Too big iter... ignoring");
+                return;
+            }
+            if (stop_vector.size() < kMaxProcessesAllowed || iters < min_iter) {
+                seen_iterations.insert({iters, stop_vector.size()});
+                PrintInfo("Running proving for iter: " + to_string(iters));
+                stop_vector.push_back(false);
+                bool* stop_signal = &stop_vector.back();
+                auto received = std::chrono::steady_clock::now();
+                executor.Submit(iters, [&, iters, stop_signal, received] {
+                    Proof result = ProveTwoWeso(D, f, iters, 0, (TwoWesolowskiCallback*)weso, planner, 0, *stop_signal);
+                    if (*stop_signal) {
+                        PrintInfo("Got stop signal before completing the proof!");
+                        return;
                     }
+                    session.Send(EncodeProof(iters, result));
+                    vdf_metrics.proof_latency.Observe(SecondsSince(received));
+                });
+                if (stop_vector.size() > kMaxProcessesAllowed) {
+                    PrintInfo("Stopping proving for iter: " + to_string(max_iter));
+                    stop_vector[max_iter_thread_id] = true;
+                    seen_iterations.erase({max_iter, max_iter_thread_id});
                 }
             }
-        }
+        });
+        session.Run();
     } catch (std::exception& e) {
         PrintInfo("Exception in thread: " + to_string(e.what()));
     }
     FinishSession(sock);
 }
 
-int gcd_base_bits=50;
-int gcd_128_max_iter=3;
+int gcd_base_bits=cel_gcd_base_bits;
+int gcd_128_max_iter=cel_gcd_128_max_iter;
 
 int main(int argc, char* argv[])
 {
@@ -308,8 +619,21 @@ int main(int argc, char* argv[])
 
     if(hasAVX2())
     {
-      gcd_base_bits=63;
-      gcd_128_max_iter=2;
+      gcd_base_bits=avx2_gcd_base_bits;
+      gcd_128_max_iter=avx2_gcd_128_max_iter;
+    }
+
+    // With VDF_PHASE_PROFILE=N, one squaring in N is measured with the CPU's performance counters,
+    // per phase and thread. The means are printed after each challenge and served with the metrics.
+    if (getenv("VDF_PHASE_PROFILE") != nullptr) {
+        phase_profiler.Enable(std::max(atoi(getenv("VDF_PHASE_PROFILE")), 1));
+    }
+
+    // With VDF_CLIENT_METRICS_PORT set, each client serves its metrics on that port plus its
+    // process number, so several clients on one machine don't collide.
+    process_number = atoi(argv[3]);
+    if (getenv("VDF_CLIENT_METRICS_PORT") != nullptr) {
+        ServeMetrics(atoi(getenv("VDF_CLIENT_METRICS_PORT")) + process_number);
     }
 
     boost::asio::io_service io_service;
@@ -320,23 +644,44 @@ int main(int argc, char* argv[])
 
     tcp::socket s(io_service);
     boost::asio::connect(s, iterator);
-    fast_algorithm = false;
-    two_weso = false;
     boost::system::error_code error;
     char prover_type_buf[5];
-    boost::asio::read(s, boost::asio::buffer(prover_type_buf, 1), error);
-    // Check for "S" (simple weso), "N" (n-weso), or "T" (2-weso)
-    if (prover_type_buf[0] == 'S') {
-        SessionOneWeso(s);
-    }
-    if (prover_type_buf[0] == 'N') {
-        fast_algorithm = true;
-        SessionFastAlgorithm(s);
-    }
-    if (prover_type_buf[0] == 'T') {
-        two_weso = true;
-        SessionTwoWeso(s);
+    while (true) {
+        fast_algorithm = false;
+        two_weso = false;
+        boost::asio::read(s, boost::asio::buffer(prover_type_buf, 1), error);
+        if (error)
+            break;
+        // Before the prover type, a timelord can ask for binary framing with "B" and for a
+        // persistent session with "P". Each is confirmed by echoing it back. Clients that don't
+        // know them close the connection instead.
+        while (!error && (prover_type_buf[0] == 'B' || prover_type_buf[0] == 'P')) {
+            if (prover_type_buf[0] == 'B')
+                binary_framing = true;
+            else
+                persistent = true;
+            boost::asio::write(s, boost::asio::buffer(prover_type_buf, 1));
+            boost::asio::read(s, boost::asio::buffer(prover_type_buf, 1), error);
+        }
+        if (error)
+            break;
+        // Check for "S" (simple weso), "N" (n-weso), or "T" (2-weso)
+        if (prover_type_buf[0] == 'S') {
+            SessionOneWeso(io_service, s);
+        }
+        if (prover_type_buf[0] == 'N') {
+            fast_algorithm = true;
+            SessionFastAlgorithm(io_service, s);
+        }
+        if (prover_type_buf[0] == 'T') {
+            two_weso = true;
+            SessionTwoWeso(io_service, s);
+        }
+        if (!persistent)
+            break;
+        PrintInfo("Waiting for the next challenge.");
     }
+    DeleteWarmProver();
   } catch (std::exception& e) {
     std::cerr << "Exception: " << e.what() << "\n";
   } 
@@ -1,6 +1,8 @@
 #ifndef VDF_FAST_H
 #define VDF_FAST_H
 
+#include "phase_profiler.h"
+
 typedef mpz< 9, 14> mpz_9 ; //2 cache lines
 typedef mpz<17, 22> mpz_17; //3 cache lines
 typedef mpz<25, 30> mpz_25; //4 cache lines
@@ -39,6 +41,8 @@ typedef gcd_results_type<int2x> gcd_results_int2x;
 //all divisions are exact
 struct square_state_type {
     int pairindex;
+    //only the main vdf loop sets this, so phase_profiler samples by its iteration numbers
+    bool profile_phases=false;
 
     //running the gcd will advance the counter value by this much on both the master and slave threads
     //it is then advanced by 1 after the gcd results are consumed
@@ -1013,6 +1017,7 @@ void repeated_square_fast_work(square_state_type &square_state,bool is_slave, ui
 
     for (uint64 iter=0;iter<iterations;++iter) {
         TRACK_CYCLES //master: 35895; slave: 35905
+        bool profile=square_state.profile_phases && phase_profiler.Sampled(base+iter);
 
         for (int phase=0;phase<square_state_type::num_phases;++phase) {
             if (!c_thread_state.advance(square_state.get_counter_start(phase))) {
@@ -1021,7 +1026,9 @@ void repeated_square_fast_work(square_state_type &square_state,bool is_slave, ui
                 break;
             }
 
+            PhaseProfileScope c_profile(profile, is_slave, phase);
             if (!square_state.call_phase(phase, is_slave)) {
+                c_profile.Abort();
                 c_thread_state.raise_error();
                 has_error=true;
                 break;
@@ -1097,6 +1104,7 @@ uint64 repeated_square_fast_single_thread(square_state_type &square_state, form&
 
     for (uint64 iter=0;iter<iterations;++iter) {
         TRACK_CYCLES
+        bool profile=square_state.profile_phases && phase_profiler.Sampled(base+iter);
 
         for (int phase=0;phase<square_state_type::num_phases;++phase) {
             if (!thread_state_master.advance(square_state.get_counter_start(phase))) {
@@ -1116,7 +1124,9 @@ uint64 repeated_square_fast_single_thread(square_state_type &square_state, form&
             for (bool is_slave : {!master_first, master_first}) {
                 c_thread_state=(is_slave)? thread_state_slave : thread_state_master;
 
+                PhaseProfileScope c_profile(profile, is_slave, phase);
                 if (!square_state.call_phase(phase, is_slave)) {
+                    c_profile.Abort();
                     c_thread_state.raise_error();
                     has_error=true;
                     break;
@@ -0,0 +1,368 @@
+// Stands in for a timelord: serves challenges to vdf_client over the timelord protocol, sends
+// iterations on a schedule, checks every proof that comes back and reports the latency from
+// sending an iteration to receiving its proof.
+#include <boost/asio.hpp>
+#include <poll.h>
+#include <sys/wait.h>
+#include <fstream>
+#include "verifier.h"
+#include "create_discriminant.h"
+
+using boost::asio::ip::tcp;
+
+char mode = 'N';
+int port = 0;
+int challenges = 1;
+int disc_bits = 1024;
+// The built-in schedule: 'num_requests' iterations, evenly spaced up to 'total_iters'.
+uint64_t total_iters = 1 << 20;
+int num_requests = 8;
+// If set, each request is sent when a VDF going this fast is one request behind it. Otherwise
+// all requests are sent as soon as the client is ready.
+double expected_ips = 0;
+// If set, replaces the built-in schedule: one "<milliseconds after OK> <iterations>" per line.
+std::string schedule_file;
+// Seconds to wait for proofs once the last request is sent.
+int timeout_seconds = 600;
+bool binary_framing = false;
+bool persistent = false;
+std::string seed = "vdf_loadgen";
+// If set, this vdf_client is started (once per challenge unless persistent) with its output
+// going to 'client_log'.
+std::string client_path;
+std::string client_log = "/dev/null";
+
+struct Request {
+    uint64_t send_ms;
+    uint64_t iters;
+};
+
+struct Reply {
+    uint64_t iters;
+    double latency;
+    std::vector<uint8_t> payload;
+};
+
+// A 2-wesolowski session proves at most this many iterations at once (kMaxProcessesAllowed in
+// vdf_client); it ignores larger ones that come after, and stops its largest for a smaller one.
+const int kMaxTwoWesoRequests = 3;
+
+std::vector<Request> LoadSchedule() {
+    std::vector<Request> schedule;
+    if (!schedule_file.empty()) {
+        std::ifstream in(schedule_file);
+        if (!in)
+            throw std::runtime_error("can't read " + schedule_file);
+        Request request;
+        while (in >> request.send_ms >> request.iters) {
+            if (request.iters == 0)
+                throw std::runtime_error("0 iterations would end the session");
+            schedule.push_back(request);
+        }
+    } else {
+        for (int i = 1; i <= num_requests; i++) {
+            uint64_t iters = total_iters * i / num_requests;
+            uint64_t previous = total_iters * (i - 1) / num_requests;
+            uint64_t send_ms = expected_ips > 0 ? previous * 1000 / expected_ips : 0;
+            schedule.push_back({send_ms, iters});
+        }
+    }
+    std::sort(schedule.begin(), schedule.end(), [] (const Request& a, const Request& b) {
+        return a.send_ms < b.send_ms;
+    });
+    // A 1-wesolowski session proves only the first iteration it gets.
+    if (mode == 'S' && schedule.size() > 1)
+        schedule.resize(1);
+    // Requests a 2-wesolowski session wouldn't serve aren't sent, so they don't count as missing.
+    if (mode == 'T' && schedule.size() > kMaxTwoWesoRequests) {
+        std::cout << "vdf_client proves at most " << kMaxTwoWesoRequests << " iterations of a 2-wesolowski "
+                  << "challenge; sending the first " << kMaxTwoWesoRequests << " of " << schedule.size()
+                  << " requests.\n";
+        schedule.resize(kMaxTwoWesoRequests);
+    }
+    if (schedule.empty())
+        throw std::runtime_error("empty schedule");
+    return schedule;
+}
+
+std::string ZeroPad(uint64_t x, int width) {
+    std::string digits = to_string(x);
+    return std::string(std::max(width - (int)digits.size(), 0), '0') + digits;
+}
+
+void ReadExactly(tcp::socket& sock, void* data, size_t size) {
+    boost::asio::read(sock, boost::asio::buffer(data, size));
+}
+
+void Expect(tcp::socket& sock, const std::string& expected) {
+    std::string got(expected.size(), 0);
+    ReadExactly(sock, &got[0], got.size());
+    if (got != expected)
+        throw std::runtime_error("expected " + expected + ", got " + got);
+}
+
+void SendIteration(tcp::socket& sock, uint64_t iters) {
+    std::string message;
+    if (binary_framing) {
+        // count (4) | iteration (8), little endian.
+        message.resize(12);
+        for (int i = 0; i < 4; i++)
+            message[i] = (i == 0);
+        for (int i = 0; i < 8; i++)
+            message[4 + i] = (iters >> (8 * i)) & 255;
+    } else {
+        std::string digits = to_string(iters);
+        message = ZeroPad(digits.size(), 2) + digits;
+    }
+    boost::asio::write(sock, boost::asio::buffer(message));
+}
+
+// Reads one proof message, or returns false if none arrives before 'deadline'.
+bool ReadProof(tcp::socket& sock, std::chrono::steady_clock::time_point deadline, std::vector<uint8_t>& payload) {
+    int wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    struct pollfd readable = {sock.native_handle(), POLLIN, 0};
+    if (wait_ms <= 0 || poll(&readable, 1, wait_ms) <= 0)
+        return false;
+    uint8_t size_bytes[4];
+    ReadExactly(sock, size_bytes, 4);
+    uint64_t size = 0;
+    for (int i = 0; i < 4; i++) {
+        if (binary_framing)
+            size |= (uint64_t)size_bytes[i] << (8 * i);
+        else
+            size = (size << 8) | size_bytes[i];
+    }
+    std::string message(size, 0);
+    ReadExactly(sock, &message[0], size);
+    if (binary_framing) {
+        payload.assign(message.begin(), message.end());
+    } else {
+        if (size % 2 != 0)
+            throw std::runtime_error("odd length hex proof");
+        payload.resize(size / 2);
+        for (size_t i = 0; i < payload.size(); i++)
+            payload[i] = std::stoi(message.substr(2 * i, 2), nullptr, 16);
+    }
+    return true;
+}
+
+uint64_t ReadField(const uint8_t* bytes, int num_bytes) {
+    if (!binary_framing)
+        return ReadUint64Bytes(bytes, num_bytes);
+    uint64_t x = 0;
+    for (int i = num_bytes - 1; i >= 0; i--)
+        x = (x << 8) | bytes[i];
+    return x;
+}
+
+// iterations (8) | y size (8) | y | witness type (1) | proof, checked against 'iters' from the
+// generator of D.
+bool CheckReply(integer& D, Reply& reply) {
+    std::vector<uint8_t>& payload = reply.payload;
+    if (payload.size() < 17)
+        return false;
+    uint64_t y_size = ReadField(payload.data() + 8, 8);
+    if (ReadField(payload.data(), 8) != reply.iters || payload.size() < 17 + y_size)
+        return false;
+    int witness_type = payload[16 + y_size];
+    std::vector<uint8_t> blob(payload.begin() + 16, payload.begin() + 16 + y_size);
+    blob.insert(blob.end(), payload.begin() + 17 + y_size, payload.end());
+    try {
+        return CheckProofOfTimeNWesolowski(D, form::generator(D), blob.data(), blob.size(), reply.iters, witness_type);
+    } catch (std::exception& e) {
+        return false;
+    }
+}
+
+pid_t StartClient() {
+    // Otherwise the child writes out our buffered output a second time.
+    std::cout << std::flush;
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen(client_log.c_str(), "a", stdout);
+        dup2(fileno(stdout), fileno(stderr));
+        std::string port_str = to_string(port);
+        execl(client_path.c_str(), client_path.c_str(), "localhost", port_str.c_str(), "0", (char*)NULL);
+        perror("execl");
+        _exit(1);
+    }
+    return pid;
+}
+
+// Runs one challenge on 'sock', which the handshake has already been done on. Returns the
+// number of requests that got no proof or an invalid one.
+int RunChallenge(tcp::socket& sock, int index, const std::vector<Request>& schedule, std::vector<Reply>& replies) {
+    std::vector<uint8_t> challenge_hash(32);
+    picosha2::hash256(seed + "/" + to_string(index), challenge_hash);
+    integer D = CreateDiscriminant(challenge_hash, disc_bits);
+    std::string disc = D.to_string();
+    // Every proof of the challenge starts from the generator.
+    form generator = form::generator(D);
+    PrecomputeFixedBase(D, generator);
+
+    auto begin = std::chrono::steady_clock::now();
+    std::string start = std::string(1, mode) + ZeroPad(disc.size(), 3) + disc;
+    boost::asio::write(sock, boost::asio::buffer(start));
+    Expect(sock, "OK");
+    auto ready = std::chrono::steady_clock::now();
+
+    // iteration -> when it was sent; the sender thread fills it in.
+    std::map<uint64_t, std::chrono::steady_clock::time_point> sent;
+    std::mutex sent_mutex;
+    std::thread sender([&] {
+        for (const Request& request : schedule) {
+            std::this_thread::sleep_until(ready + std::chrono::milliseconds(request.send_ms));
+            {
+                std::lock_guard<std::mutex> lk(sent_mutex);
+                if (sent.count(request.iters))
+                    continue;
+                sent[request.iters] = std::chrono::steady_clock::now();
+            }
+            SendIteration(sock, request.iters);
+        }
+    });
+
+    std::set<uint64_t> wanted;
+    for (const Request& request : schedule)
+        wanted.insert(request.iters);
+    auto deadline = ready + std::chrono::milliseconds(schedule.back().send_ms) + std::chrono::seconds(timeout_seconds);
+    int first_reply = replies.size();
+    Reply reply;
+    while (!wanted.empty() && ReadProof(sock, deadline, reply.payload)) {
+        auto now = std::chrono::steady_clock::now();
+        reply.iters = reply.payload.size() >= 8 ? ReadField(reply.payload.data(), 8) : 0;
+        std::lock_guard<std::mutex> lk(sent_mutex);
+        if (!sent.count(reply.iters)) {
+            std::cout << "Challenge " << index << ": proof for unrequested iteration " << reply.iters << "\n";
+            continue;
+        }
+        reply.latency = std::chrono::duration<double>(now - sent[reply.iters]).count();
+        wanted.erase(reply.iters);
+        replies.push_back(reply);
+    }
+    sender.join();
+    SendIteration(sock, 0);
+    Expect(sock, "STOP");
+    boost::asio::write(sock, boost::asio::buffer("ACK", 3));
+
+    int valid = 0;
+    for (int i = first_reply; i < replies.size(); i++) {
+        if (CheckReply(D, replies[i]))
+            valid++;
+        else
+            std::cout << "Challenge " << index << ": INVALID proof for iteration " << replies[i].iters << "\n";
+    }
+    std::cout << "Challenge " << index << ": " << valid << "/" << schedule.size() << " valid proofs, "
+              << wanted.size() << " missing. Client ready after "
+              << std::chrono::duration<double>(ready - begin).count() << "s.\n";
+    return wanted.size() + (replies.size() - first_reply - valid);
+}
+
+double Percentile(std::vector<double>& sorted, double p) {
+    int rank = std::ceil(p / 100 * sorted.size());
+    return sorted[std::max(rank, 1) - 1];
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+        "Usage: %s [options] {S|N|T}\n"
+        "  -p PORT    port to listen on (default: any free one)\n"
+        "  -c N       challenges to run (default 1)\n"
+        "  -d BITS    discriminant size (default 1024)\n"
+        "  -t ITERS   last iteration of the built-in schedule (default 2^20)\n"
+        "  -n N       requests in the built-in schedule, evenly spaced (default 8)\n"
+        "  -i IPS     send each request when a VDF at IPS is one request behind it\n"
+        "             (default: send them all at once)\n"
+        "  -f FILE    replay a schedule of \"<ms after OK> <iterations>\" lines instead\n"
+        "  -w SECS    wait this long for proofs after the last request (default 600)\n"
+        "  -b         binary framing\n"
+        "  -P         persistent session: all challenges on one connection\n"
+        "  -s SEED    seed of the challenges (default vdf_loadgen)\n"
+        "  -x PATH    start the vdf_client at PATH against us\n"
+        "  -l FILE    where the started vdf_client's output goes (default /dev/null)\n",
+        progname);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "p:c:d:t:n:i:f:w:bPs:x:l:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'c': challenges = atoi(optarg); break;
+            case 'd': disc_bits = atoi(optarg); break;
+            case 't': total_iters = strtoull(optarg, NULL, 10); break;
+            case 'n': num_requests = atoi(optarg); break;
+            case 'i': expected_ips = atof(optarg); break;
+            case 'f': schedule_file = optarg; break;
+            case 'w': timeout_seconds = atoi(optarg); break;
+            case 'b': binary_framing = true; break;
+            case 'P': persistent = true; break;
+            case 's': seed = optarg; break;
+            case 'x': client_path = optarg; break;
+            case 'l': client_log = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || strlen(argv[optind]) != 1 || !strchr("SNT", argv[optind][0]) ||
+        challenges < 1 || num_requests < 1 || total_iters < num_requests) {
+        usage(argv[0]);
+        return 1;
+    }
+    mode = argv[optind][0];
+
+    int failures = 0;
+    std::vector<Reply> replies;
+    try {
+        std::vector<Request> schedule = LoadSchedule();
+        boost::asio::io_service io_service;
+        tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v6(), port));
+        port = acceptor.local_endpoint().port();
+        std::cout << "Listening on port " << port << ".\n" << std::flush;
+
+        std::unique_ptr<tcp::socket> sock;
+        pid_t client = 0;
+        for (int i = 0; i < challenges; i++) {
+            if (sock == NULL || !persistent) {
+                if (!client_path.empty())
+                    client = StartClient();
+                sock.reset(new tcp::socket(io_service));
+                acceptor.accept(*sock);
+                // Ask for the optional modes first; a client that knows them echoes each one.
+                for (const char* request : {binary_framing ? "B" : "", persistent ? "P" : ""}) {
+                    if (request[0] != 0) {
+                        boost::asio::write(*sock, boost::asio::buffer(request, 1));
+                        Expect(*sock, request);
+                    }
+                }
+            }
+            failures += RunChallenge(*sock, i, schedule, replies);
+            if (!persistent) {
+                sock->close();
+                if (client != 0)
+                    waitpid(client, NULL, 0);
+            }
+        }
+        if (persistent && sock != NULL) {
+            sock->close();
+            if (client != 0)
+                waitpid(client, NULL, 0);
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+
+    std::vector<double> latencies;
+    for (Reply& reply : replies)
+        latencies.push_back(reply.latency);
+    std::sort(latencies.begin(), latencies.end());
+    if (!latencies.empty()) {
+        std::cout << std::fixed << std::setprecision(3)
+                  << "Latency over " << latencies.size() << " proofs: p50 " << Percentile(latencies, 50)
+                  << "s, p90 " << Percentile(latencies, 90) << "s, p99 " << Percentile(latencies, 99)
+                  << "s, max " << latencies.back() << "s.\n";
+    }
+    return failures == 0 ? 0 : 2;
+}
@@ -8,17 +8,50 @@
 #include "nucomp.h"
 #include "proof_common.h"
 #include "create_discriminant.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 
+// Bits of the x exponent in one Wesolowski check, r = 2^iters mod B.
+const int kFixedBaseVerifyBits = 264;
+
+// True if f is the reduced form of its class, the only representation proofs serialize.
+bool IsReducedForm(const form& f)
+{
+    form g = f;
+    g.reduce();
+    return g == f;
+}
+
+// y must be given reduced: an equivalent but unreduced y is rejected, so that a proof has one
+// accepted encoding.
 void VerifyWesolowskiProof(integer &D, form x, form y, form proof, uint64_t iters, bool &is_valid)
 {
+    if (!IsReducedForm(y)) {
+        is_valid = false;
+        return;
+    }
     PulmarkReducer reducer;
     int int_size = (D.num_bits() + 16) >> 4;
     integer L = root(-D, 4);
     integer B = GetB(D, x, y);
     integer r = FastPow(2, iters, B);
-    form f1 = FastPowFormNucomp(proof, D, B, L, reducer);
-    form f2 = FastPowFormNucomp(x, D, r, L, reducer);
-    if (f1 * f2 == y)
+    std::vector<form> bases = {proof};
+    std::vector<integer> exponents = {B};
+    std::vector<std::shared_ptr<const FixedBaseTable>> fixed;
+    std::vector<integer> fixed_exponents;
+    std::shared_ptr<const FixedBaseTable> x_table = fixed_base_cache.Find(D, x, kFixedBaseVerifyBits);
+    if (x_table != NULL) {
+        fixed.push_back(x_table);
+        fixed_exponents.push_back(r);
+    } else {
+        bases.push_back(x);
+        exponents.push_back(r);
+    }
+    form f = MultiPowFormNucomp(bases, exponents, fixed, fixed_exponents, D, L, reducer);
+    reducer.reduce(f);
+    f.reduce();
+    if (f == y)
     {
         is_valid = true;
     }
@@ -28,34 +61,251 @@ void VerifyWesolowskiProof(integer &D, form x, form y, form proof, uint64_t iter
     }
 }
 
-// Used only to verify 'Proof' objects in tests. This is not used by chia-blockchain.
+// One Wesolowski proof for VerifyWesolowskiBatch.
+struct WesolowskiInstance {
+    integer D;
+    form x;
+    form y;
+    form proof;
+    uint64_t iters;
+};
 
-integer ConvertBytesToInt(uint8_t *bytes, int start_index, int end_index)
+// Bits of the random exponents proofs are combined with. The exponents are random odd numbers, so
+// an error of order q in the class group survives the combined check with probability about 1/q. A
+// batch with an invalid proof passes with probability about 2^-kBatchExponentBits only if the class
+// group has no elements of small order, which is assumed for prime -D (where there are no elements
+// of order 2). Other discriminants aren't combined.
+const int kBatchExponentBits = 128;
+// Largest number of proofs combined into one check.
+const int kMaxBatchSize = 32;
+
+// Bits of the x exponent in a combined check: a sum of up to kMaxBatchSize (2^5) terms r_i * e_i.
+const int kFixedBaseBatchBits = kFixedBaseVerifyBits + kBatchExponentBits + 5;
+
+// Builds the comb tables VerifyWesolowskiProof and VerifyWesolowskiBatch look for, for a base that
+// many proofs under D start from, e.g. the generator or a checkpoint. Worth it once the base is in a
+// few dozen checks. The tables stay in fixed_base_cache until newer ones push them out.
+void PrecomputeFixedBase(integer &D, form &base)
 {
-    integer res(0);
-    bool negative = false;
-    if (bytes[start_index] & (1 << 7))
-        negative = true;
-    for (int i = start_index; i < end_index; i++)
-    {
-        res = res * integer(256);
-        if (!negative)
-            res = res + integer(bytes[i]);
-        else
-            res = res + integer(bytes[i] ^ 255);
+    integer L = root(-D, 4);
+    fixed_base_cache.Get(D, L, base, kFixedBaseVerifyBits);
+    fixed_base_cache.Get(D, L, base, kFixedBaseBatchBits);
+}
+
+// Threads shared by the batch verifiers, so that a call doesn't start threads of its own. They are
+// started on first use, one per hardware thread but the caller's, and live as long as the process.
+class VerifierThreads {
+  public:
+    static VerifierThreads& Get() {
+        static VerifierThreads* threads = new VerifierThreads();
+        return *threads;
     }
-    if (negative)
-    {
-        res = res + integer(1);
-        res = res * integer(-1);
+
+    // Calls task(i) for every i < n, on the calling thread and up to 'threads' - 1 shared ones
+    // (0 = all of them), and returns once all calls are done.
+    void Run(int n, int threads, const std::function<void(int)>& task) {
+        Job job{task, n};
+        int helpers = std::min(n, threads <= 0 ? (int)workers.size() + 1 : threads) - 1;
+        helpers = std::min(helpers, (int)workers.size());
+        {
+            std::lock_guard<std::mutex> lk(m);
+            for (int i = 0; i < helpers; i++)
+                jobs.push_back(&job);
+        }
+        for (int i = 0; i < helpers; i++)
+            cv.notify_one();
+        job.Work();
+        std::unique_lock<std::mutex> lk(m);
+        // Helpers that didn't get to the job yet aren't needed anymore.
+        jobs.erase(std::remove(jobs.begin(), jobs.end(), &job), jobs.end());
+        job_done.wait(lk, [&] { return job.active == 0; });
     }
-    return res;
+
+  private:
+    struct Job {
+        const std::function<void(int)>& task;
+        int n;
+        std::atomic<int> next{0};
+        int active = 0;
+
+        void Work() {
+            int i;
+            while ((i = next++) < n)
+                task(i);
+        }
+    };
+
+    VerifierThreads() {
+        int n = std::max(1, (int)std::thread::hardware_concurrency()) - 1;
+        for (int i = 0; i < n; i++)
+            workers.emplace_back([this] { WorkerLoop(); });
+    }
+
+    void WorkerLoop() {
+        std::unique_lock<std::mutex> lk(m);
+        while (true) {
+            cv.wait(lk, [&] { return !jobs.empty(); });
+            Job* job = jobs.front();
+            jobs.pop_front();
+            job->active++;
+            lk.unlock();
+            job->Work();
+            lk.lock();
+            if (--job->active == 0)
+                job_done.notify_all();
+        }
+    }
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::condition_variable job_done;
+    std::deque<Job*> jobs;
+    std::vector<std::thread> workers;
+};
+
+// Checks prod(proof_i^(B_i * e_i) * x_i^(r_i * e_i) * y_i^-e_i) == 1 for random e_i, which holds for
+// all valid proofs and, with overwhelming probability, fails if any of them is invalid.
+// Instances sharing x add up their x exponents. All instances must share D.
+bool VerifyWesolowskiCombined(std::vector<WesolowskiInstance*>& instances, std::mt19937_64& rng, PulmarkReducer& reducer)
+{
+    integer& D = instances[0]->D;
+    integer L = root(-D, 4);
+    std::vector<form> bases;
+    std::vector<integer> exponents;
+    std::vector<form> x_bases;
+    std::vector<integer> x_exponents;
+    for (WesolowskiInstance* instance : instances) {
+        std::vector<uint64> words(kBatchExponentBits / 64);
+        for (uint64& word : words)
+            word = rng();
+        integer e(words);
+        e.set_bit(0, true);
+        integer B = GetB(D, instance->x, instance->y);
+        integer r = FastPow(2, instance->iters, B);
+        bases.push_back(instance->proof);
+        exponents.push_back(B * e);
+        int x_index = 0;
+        while (x_index < x_bases.size() && !(x_bases[x_index] == instance->x))
+            x_index++;
+        if (x_index == x_bases.size()) {
+            x_bases.push_back(instance->x);
+            x_exponents.push_back(integer(0));
+        }
+        x_exponents[x_index] += r * e;
+        bases.push_back(instance->y.inverse());
+        exponents.push_back(e);
+    }
+    std::vector<std::shared_ptr<const FixedBaseTable>> fixed;
+    std::vector<integer> fixed_exponents;
+    for (int i = 0; i < x_bases.size(); i++) {
+        std::shared_ptr<const FixedBaseTable> x_table = fixed_base_cache.Find(D, x_bases[i], kFixedBaseBatchBits);
+        if (x_table != NULL) {
+            fixed.push_back(x_table);
+            fixed_exponents.push_back(x_exponents[i]);
+        } else {
+            bases.push_back(x_bases[i]);
+            exponents.push_back(x_exponents[i]);
+        }
+    }
+    form res = MultiPowFormNucomp(bases, exponents, fixed, fixed_exponents, D, L, reducer);
+    reducer.reduce(res);
+    res.reduce();
+    return res == form::identity(D);
+}
+
+// Fills is_valid for 'instances', bisecting combined checks that fail down to single proofs.
+void VerifyWesolowskiGroup(std::vector<WesolowskiInstance*> instances, std::vector<bool*> is_valid, std::mt19937_64& rng, PulmarkReducer& reducer)
+{
+    if (instances.size() == 1) {
+        bool valid;
+        VerifyWesolowskiProof(instances[0]->D, instances[0]->x, instances[0]->y, instances[0]->proof, instances[0]->iters, valid);
+        *is_valid[0] = valid;
+        return;
+    }
+    if (VerifyWesolowskiCombined(instances, rng, reducer)) {
+        for (bool* v : is_valid)
+            *v = true;
+        return;
+    }
+    int half = instances.size() / 2;
+    VerifyWesolowskiGroup(
+        std::vector<WesolowskiInstance*>(instances.begin(), instances.begin() + half),
+        std::vector<bool*>(is_valid.begin(), is_valid.begin() + half), rng, reducer);
+    VerifyWesolowskiGroup(
+        std::vector<WesolowskiInstance*>(instances.begin() + half, instances.end()),
+        std::vector<bool*>(is_valid.begin() + half, is_valid.end()), rng, reducer);
+}
+
+// Verifies many Wesolowski proofs at once. result[i] is the verdict VerifyWesolowskiProof gives
+// for instances[i], up to the low order assumption above. Proofs are grouped by discriminant and
+// combined up to kMaxBatchSize at a time, so the squarings are shared; proofs under a D whose -D
+// isn't a probable prime are verified one by one. Groups are checked on up to 'threads' threads
+// (0 = all hardware threads) of VerifierThreads.
+std::vector<bool> VerifyWesolowskiBatch(std::vector<WesolowskiInstance>& instances, int threads = 0)
+{
+    std::vector<bool> result(instances.size());
+    std::unique_ptr<bool[]> is_valid(new bool[instances.size()]);
+
+    // Forms that don't belong to their discriminant, and y or proof forms that aren't reduced, are
+    // left to VerifyWesolowskiProof alone: the combined check would take any form of the class.
+    std::vector<std::pair<std::vector<WesolowskiInstance*>, std::vector<bool*>>> groups;
+    std::map<std::string, std::vector<int>> by_discriminant;
+    for (int i = 0; i < instances.size(); i++) {
+        WesolowskiInstance& instance = instances[i];
+        if (instance.x.check_valid(instance.D) && instance.y.check_valid(instance.D) &&
+            instance.proof.check_valid(instance.D) && IsReducedForm(instance.y) &&
+            IsReducedForm(instance.proof)) {
+            by_discriminant[instance.D.to_string()].push_back(i);
+        } else {
+            groups.push_back({{&instance}, {&is_valid[i]}});
+        }
+    }
+    for (auto& it : by_discriminant) {
+        std::vector<int>& indexes = it.second;
+        // With a composite -D, e.g. two proofs off by the same element of order 2 cancel out.
+        // 25 rounds is a BPSW test and one Miller-Rabin round in GMP.
+        integer minus_D = -instances[indexes[0]].D;
+        if (indexes.size() > 1 && mpz_probab_prime_p(minus_D.impl, 25) == 0) {
+            for (int i : indexes)
+                groups.push_back({{&instances[i]}, {&is_valid[i]}});
+            continue;
+        }
+        for (int begin = 0; begin < indexes.size(); begin += kMaxBatchSize) {
+            int end = std::min(begin + kMaxBatchSize, (int)indexes.size());
+            groups.emplace_back();
+            for (int j = begin; j < end; j++) {
+                groups.back().first.push_back(&instances[indexes[j]]);
+                groups.back().second.push_back(&is_valid[indexes[j]]);
+            }
+        }
+    }
+
+    std::random_device seed;
+    std::vector<uint64_t> seeds(groups.size());
+    for (uint64_t& s : seeds)
+        s = ((uint64_t)seed() << 32) | seed();
+    VerifierThreads::Get().Run(groups.size(), threads, [&](int g) {
+        std::mt19937_64 rng(seeds[g]);
+        PulmarkReducer reducer;
+        VerifyWesolowskiGroup(groups[g].first, groups[g].second, rng, reducer);
+    });
+
+    for (int i = 0; i < instances.size(); i++)
+        result[i] = is_valid[i];
+    return result;
 }
 
-form DeserializeForm(integer &d, uint8_t *bytes, int int_size)
+// Used only to verify 'Proof' objects in tests. This is not used by chia-blockchain.
+
+integer ConvertBytesToInt(uint8_t *bytes, int start_index, int end_index)
 {
-    integer a = ConvertBytesToInt(bytes, 0, int_size);
-    integer b = ConvertBytesToInt(bytes, int_size, 2 * int_size);
+    return ReadIntegerBytes(bytes + start_index, end_index - start_index);
+}
+
+form DeserializeForm(integer &d, const uint8_t *bytes, int int_size)
+{
+    integer a = ReadIntegerBytes(bytes, int_size);
+    integer b = ReadIntegerBytes(bytes + int_size, int_size);
     form f = form::from_abd(a, b, d);
     return f;
 }
@@ -64,83 +314,132 @@ std::vector<form> DeserializeProof(uint8_t *proof_bytes, int proof_len, integer
 {
     int int_size = (D.num_bits() + 16) >> 4;
     std::vector<form> proof;
-    for (int i = 0; i < proof_len; i += 2 * int_size)
+    for (int i = 0; i + 2 * int_size <= proof_len; i += 2 * int_size)
     {
-        std::vector<uint8_t> tmp_bytes;
-        for (int j = 0; j < 2 * int_size; j++)
-            tmp_bytes.push_back(proof_bytes[i + j]);
-        proof.emplace_back(DeserializeForm(D, tmp_bytes.data(), int_size));
+        proof.emplace_back(DeserializeForm(D, proof_bytes + i, int_size));
     }
     return proof;
 }
 
-bool CheckProofOfTimeNWesolowskiInner(integer &D, form x, uint8_t *proof_blob,
-                                      int blob_len, int iters, int int_size,
-                                      std::vector<int> iter_list, int recursion)
+// One segment of an n-wesolowski proof: y = x^(2^iters), proven by 'proof'.
+struct WesolowskiSegment {
+    form x;
+    form y;
+    form proof;
+    uint64_t iters;
+};
+
+// Splits an n-wesolowski blob into its segments, in VDF order. The blob is
+// y (2 * 129 bytes) | proof | (iters (8 bytes) | y_i | proof_i) * recursion, where the last
+// (y_i, proof_i) pair is the first segment from x and the final proof covers the remaining iters.
+bool ParseNWesolowskiProof(integer &D, form x, uint8_t *proof_blob, int proof_blob_len, uint64_t iters,
+                           int recursion, std::vector<WesolowskiSegment>& segments)
 {
-    uint8_t* result_bytes = new uint8_t[2 * 129];
-    uint8_t* proof_bytes = new uint8_t[blob_len - 2 * 129];
-    memcpy(result_bytes, proof_blob, 2 * 129);
-    memcpy(proof_bytes, proof_blob + 2 * 129, blob_len - 2 * 129);
-    form y = DeserializeForm(D, result_bytes, 129);
-    std::vector<form> proof = DeserializeProof(proof_bytes, blob_len - 2 * 129, D);
-    if (recursion * 2 + 1 != proof.size())
+    int int_size = (D.num_bits() + 16) >> 4;
+    int head_size = 2 * 129 + 2 * int_size;
+    int segment_size = 8 + 4 * int_size;
+    if (proof_blob_len < head_size || (proof_blob_len - head_size) % segment_size != 0)
         return false;
-    if (proof.size() == 1)
-    {
-        bool is_valid;
-        VerifyWesolowskiProof(D, x, y, proof[0], iters, is_valid);
-        delete[] result_bytes;
-        delete[] proof_bytes;
-        return is_valid;
-    }
-    else
-    {
-        if (!(proof.size() % 2 == 1 && proof.size() > 2)) {
-            delete[] result_bytes;
-            delete[] proof_bytes;
-            return false;
-        }
-        int iters1 = iter_list[iter_list.size() - 1];
-        int iters2 = iters - iters1;
-        bool ver_outer;
-        VerifyWesolowskiProof(D, x, proof[proof.size() - 2], proof[proof.size() - 1], iters1, ver_outer);
-        if (!ver_outer) {
-            delete[] result_bytes;
-            delete[] proof_bytes;
+    if ((proof_blob_len - head_size) / segment_size != recursion)
+        return false;
+    form y = DeserializeForm(D, proof_blob, 129);
+    form proof = DeserializeForm(D, proof_blob + 2 * 129, int_size);
+    for (int i = recursion - 1; i >= 0; i--) {
+        uint8_t* bytes = proof_blob + head_size + i * segment_size;
+        uint64_t segment_iters = ReadUint64Bytes(bytes, 8);
+        if (segment_iters > iters)
             return false;
+        form segment_y = DeserializeForm(D, bytes + 8, int_size);
+        form segment_proof = DeserializeForm(D, bytes + 8 + 2 * int_size, int_size);
+        segments.push_back({x, segment_y, segment_proof, segment_iters});
+        x = segment_y;
+        iters -= segment_iters;
+    }
+    segments.push_back({x, y, proof, iters});
+    return true;
+}
+
+// Re-encodes an n-wesolowski blob with compressed forms, same layout otherwise:
+// y | proof | (iters (8 bytes) | y_i | proof_i) * recursion. Returns an empty vector if the blob
+// is malformed, or has a form that isn't serialized reduced, so that decompressing gives the blob
+// back.
+std::vector<uint8_t> CompressNWesolowskiProof(integer &D, uint8_t *proof_blob, int proof_blob_len)
+{
+    int int_size = (D.num_bits() + 16) >> 4;
+    int head_size = 2 * 129 + 2 * int_size;
+    int segment_size = 8 + 4 * int_size;
+    std::vector<uint8_t> res;
+    if (proof_blob_len < head_size || (proof_blob_len - head_size) % segment_size != 0)
+        return res;
+    auto compress = [&](uint8_t* bytes, int size) {
+        form f = DeserializeForm(D, bytes, size);
+        std::vector<uint8_t> serialized = SerializeForm(f, size);
+        if (memcmp(serialized.data(), bytes, 2 * size) != 0)
+            throw std::runtime_error("Form isn't serialized reduced.");
+        CompressForm(f, D, res);
+    };
+    try {
+        compress(proof_blob, 129);
+        compress(proof_blob + 2 * 129, int_size);
+        for (int i = head_size; i < proof_blob_len; i += segment_size) {
+            res.insert(res.end(), proof_blob + i, proof_blob + i + 8);
+            compress(proof_blob + i + 8, int_size);
+            compress(proof_blob + i + 8 + 2 * int_size, int_size);
         }
-        uint8_t* new_proof_bytes = new uint8_t[blob_len - 4 * int_size];
-        for (int i = 0; i < blob_len - 4 * int_size; i++)
-            new_proof_bytes[i] = proof_blob[i];
-        iter_list.pop_back();
-        bool ver_inner = CheckProofOfTimeNWesolowskiInner(D, proof[proof.size() - 2], new_proof_bytes, blob_len - 4 * int_size, iters2, int_size, iter_list, recursion - 1);
-        delete[] result_bytes;
-        delete[] proof_bytes;
-        delete[] new_proof_bytes;
-        if (ver_inner)
-            return true;
-        return false;
+    } catch (std::exception& e) {
+        res.clear();
     }
+    return res;
 }
 
-bool CheckProofOfTimeNWesolowski(integer D, form x, uint8_t *proof_blob, int proof_blob_len, int iters, int recursion)
+// Inverse of CompressNWesolowskiProof. Returns an empty vector if 'bytes' is malformed; since
+// DecompressForm only takes canonical encodings, a blob has one compressed form.
+std::vector<uint8_t> DecompressNWesolowskiProof(integer &D, uint8_t *bytes, int len)
 {
     int int_size = (D.num_bits() + 16) >> 4;
-    uint8_t* new_proof_blob = new uint8_t[proof_blob_len];
-    int new_cnt = 2 * 129 + 2 * int_size;
-    memcpy(new_proof_blob, proof_blob, new_cnt);
-    std::vector<int> iter_list;
-    for (int i = new_cnt; i < proof_blob_len; i += 4 * int_size + 8)
-    {
-        auto iter_vector = ConvertBytesToInt(proof_blob, i, i + 8).to_vector();
-        iter_list.push_back(iter_vector[0]);
-        memcpy(new_proof_blob + new_cnt, proof_blob + i + 8, 4 * int_size);
-        new_cnt += 4 * int_size;
-    }
-    bool is_valid = CheckProofOfTimeNWesolowskiInner(D, x, new_proof_blob, new_cnt, iters, int_size, iter_list, recursion);
-    delete[] new_proof_blob;
-    return is_valid;
+    std::vector<uint8_t> res;
+    form f;
+    int pos = 0;
+    for (int i = 0; pos < len; i++) {
+        // Forms 0 and 1 are y and the proof; then each segment is iters, y_i and proof_i.
+        if (i >= 2 && i % 2 == 0) {
+            if (len - pos < 8)
+                return std::vector<uint8_t>();
+            res.insert(res.end(), bytes + pos, bytes + pos + 8);
+            pos += 8;
+        }
+        int used = DecompressForm(bytes + pos, len - pos, D, f);
+        if (used == 0)
+            return std::vector<uint8_t>();
+        pos += used;
+        int size = (i == 0) ? 129 : int_size;
+        res.resize(res.size() + 2 * size);
+        SerializeForm(f, size, res.data() + res.size() - 2 * size);
+    }
+    if (res.size() < 2 * 129 + 2 * int_size || (res.size() - 2 * 129 - 2 * int_size) % (8 + 4 * int_size) != 0)
+        return std::vector<uint8_t>();
+    return res;
+}
+
+// Checks the segments of an n-wesolowski proof concurrently, on up to 'threads' threads (0 = all
+// hardware threads) of VerifierThreads. Segments not started yet are skipped once one fails.
+bool CheckProofOfTimeNWesolowski(integer D, form x, uint8_t *proof_blob, int proof_blob_len, uint64_t iters, int recursion,
+                                 int threads = 0)
+{
+    std::vector<WesolowskiSegment> segments;
+    if (!ParseNWesolowskiProof(D, x, proof_blob, proof_blob_len, iters, recursion, segments))
+        return false;
+
+    std::atomic<bool> failed(false);
+    VerifierThreads::Get().Run(segments.size(), threads, [&](int i) {
+        if (failed)
+            return;
+        bool is_valid;
+        VerifyWesolowskiProof(D, segments[i].x, segments[i].y, segments[i].proof, segments[i].iters, is_valid);
+        if (!is_valid)
+            failed = true;
+    });
+    return !failed;
 }
 
 #endif // VERIFIER_H
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "verifier.h"
 #include "create_discriminant.h"
+#include "prover_slow.h"
 
 void assertm(bool expr, std::string msg, bool verbose=false) {
     if (expr && verbose) {
@@ -22,6 +23,44 @@ std::vector<uint8_t> HexToBytes(char *hex_proof) {
     return result;
 }
 
+// Proves 'iters' squarings from x, returning y and the proof, built on 'threads' threads.
+form ProveSegment(integer& D, form x, uint64_t iters, form& y, uint64_t k = 10, uint64_t l = 1, int threads = 1) {
+    integer L = root(-D, 4);
+    PulmarkReducer reducer;
+    std::vector<form> intermediates;
+    y = x;
+    for (uint64_t i = 0; i < iters; i += k * l) {
+        intermediates.push_back(y);
+        RepeatedSquareForm(y, D, L, std::min(k * l, iters - i), reducer);
+        reducer.reduce(y);
+    }
+    return GenerateWesolowski(y, x, D, reducer, intermediates, iters, k, l, threads);
+}
+
+// The n-wesolowski blob of segments of 'iters' squarings each from the generator: the last
+// segment's y and proof, then iters_i | y_i | proof_i for the others, latest first.
+std::vector<uint8_t> NWesolowskiBlob(integer& D, std::vector<uint64_t> iters) {
+    int int_size = (D.num_bits() + 16) >> 4;
+    std::vector<form> ys(iters.size()), proofs(iters.size());
+    form x = form::generator(D);
+    for (int i = 0; i < iters.size(); i++) {
+        proofs[i] = ProveSegment(D, x, iters[i], ys[i]);
+        x = ys[i];
+    }
+    std::vector<uint8_t> blob = SerializeForm(ys.back(), 129);
+    std::vector<uint8_t> bytes = SerializeForm(proofs.back(), int_size);
+    blob.insert(blob.end(), bytes.begin(), bytes.end());
+    for (int i = (int)iters.size() - 2; i >= 0; i--) {
+        blob.resize(blob.size() + 8);
+        WriteUint64Bytes(iters[i], blob.data() + blob.size() - 8, 8);
+        for (form* f : {&ys[i], &proofs[i]}) {
+            bytes = SerializeForm(*f, int_size);
+            blob.insert(blob.end(), bytes.begin(), bytes.end());
+        }
+    }
+    return blob;
+}
+
 int main()
 {
     auto challenge_hash1 = HexToBytes(string("a4bb1461ade74ac602e9ae511af68bb254dfe65d61b7faf9fab82d0b4364a30b").data());
@@ -38,5 +77,216 @@ int main()
         assertm(P.prime(), "P should be psuedoprime");
     }
 
+    // Batch verification tests
+    std::vector<WesolowskiInstance> instances;
+    for (auto seed: {challenge_hash1, challenge_hash2, challenge_hash3}) {
+        integer D = CreateDiscriminant(seed, 1024);
+        int int_size = (D.num_bits() + 16) >> 4;
+        for (uint64_t iters: {1000, 2500}) {
+            std::vector<uint8_t> result = ProveSlow(seed, 1024, iters);
+            instances.push_back({D, form::generator(D), DeserializeForm(D, result.data(), int_size),
+                                 DeserializeForm(D, result.data() + 2 * int_size, int_size), iters});
+        }
+    }
+    std::vector<bool> valid = VerifyWesolowskiBatch(instances);
+    for (int i = 0; i < instances.size(); i++) {
+        assertm(valid[i], "batch proof " + to_string(i) + " should be valid");
+    }
+    std::swap(instances[1].proof, instances[0].proof);
+    instances[4].iters++;
+    valid = VerifyWesolowskiBatch(instances, 2);
+    for (int i = 0; i < instances.size(); i++) {
+        assertm(valid[i] == (i != 0 && i != 1 && i != 4), "batch proof " + to_string(i) + " verdict");
+    }
+
+    // Unreduced y tests: the same class as a valid y, but not the encoding proofs use.
+    {
+        WesolowskiInstance instance = instances[2];
+        instance.y.b += integer(2) * instance.y.a;
+        instance.y.c = (instance.y.b * instance.y.b - instance.D) / (integer(4) * instance.y.a);
+        assertm(instance.y.check_valid(instance.D) && !IsReducedForm(instance.y), "y should be unreduced");
+        bool is_valid;
+        VerifyWesolowskiProof(instance.D, instance.x, instance.y, instance.proof, instance.iters, is_valid);
+        assertm(!is_valid, "proof with unreduced y should be rejected");
+        std::vector<WesolowskiInstance> unreduced = {instance, instances[3], instances[5]};
+        valid = VerifyWesolowskiBatch(unreduced);
+        assertm(!valid[0] && valid[1] && valid[2], "batch with unreduced y verdict");
+    }
+
+    // Composite discriminant tests: -D = p * q has an ambiguous form g of order 2. Two proofs each
+    // multiplied by g cancel out in a combined check, so they must be verified one by one.
+    {
+        integer p(1), q(1);
+        p <<= 199;
+        q <<= 823;
+        do { mpz_nextprime(p.impl, p.impl); } while (p % integer(8) != integer(1));
+        do { mpz_nextprime(q.impl, q.impl); } while (q % integer(8) != integer(7));
+        integer D = -(p * q);
+        integer L = root(-D, 4);
+        form g = form::from_abd(p, p, D);
+        form g2;
+        nucomp_form(g2, g, g, D, L);
+        g2.reduce();
+        assertm(!(g == form::identity(D)) && g2 == form::identity(D), "g should have order 2");
+
+        std::vector<WesolowskiInstance> composite;
+        for (uint64_t iters : {1000, 2500}) {
+            form x = form::generator(D), y;
+            form proof = ProveSegment(D, x, iters, y);
+            composite.push_back({D, x, y, proof, iters});
+        }
+        valid = VerifyWesolowskiBatch(composite);
+        assertm(valid[0] && valid[1], "proofs under a composite D should be valid");
+        for (WesolowskiInstance& instance : composite) {
+            nucomp_form(instance.proof, instance.proof, g, D, L);
+            instance.proof.reduce();
+            bool is_valid;
+            VerifyWesolowskiProof(D, instance.x, instance.y, instance.proof, instance.iters, is_valid);
+            assertm(!is_valid, "proof times g should be rejected");
+        }
+        valid = VerifyWesolowskiBatch(composite);
+        assertm(!valid[0] && !valid[1], "proofs times g under a composite D should be rejected in a batch");
+    }
+
+    // Threaded prove tests: the rows of a proof built on several threads give the same proof.
+    {
+        integer D = CreateDiscriminant(challenge_hash3, 1024);
+        form x = form::generator(D);
+        uint64_t iters = 20000;
+        form y, serial_y;
+        form serial = ProveSegment(D, x, iters, serial_y, 6, 4, 1);
+        for (int threads : {2, 4}) {
+            form proof = ProveSegment(D, x, iters, y, 6, 4, threads);
+            assertm(proof == serial && y == serial_y, "proof on " + to_string(threads) + " threads should match the serial one");
+            bool is_valid;
+            VerifyWesolowskiProof(D, x, y, proof, iters, is_valid);
+            assertm(is_valid, "proof on " + to_string(threads) + " threads should be valid");
+        }
+        uint64_t reported = 0;
+        std::vector<uint8_t> result = ProveSlow(challenge_hash3, 1024, iters, 2, [&](uint64_t done) {
+            reported = done;
+            return true;
+        });
+        int int_size = (D.num_bits() + 16) >> 4;
+        assertm(reported == iters, "progress should end at " + to_string(iters));
+        assertm(result.size() == 4 * int_size && DeserializeForm(D, result.data(), int_size) == serial_y,
+                "ProveSlow on 2 threads should reach y");
+        assertm(ProveSlow(challenge_hash3, 1024, iters, 2, [](uint64_t done) { return false; }).empty(),
+                "a cancelled proof should be empty");
+        uint64_t reserved = DefaultPlanner().ReservedForms();
+        bool thrown = false;
+        try {
+            ProveSlow(challenge_hash3, 1024, iters, 2, [](uint64_t done) -> bool { throw std::runtime_error("interrupted"); });
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assertm(thrown && DefaultPlanner().ReservedForms() == reserved,
+                "a proof interrupted by an exception should give its forms back");
+    }
+
+    // Fixed-base tests
+    {
+        WesolowskiInstance& instance = instances[0];
+        integer L = root(-instance.D, 4);
+        PulmarkReducer reducer;
+        integer e = GetB(instance.D, instance.x, instance.y);
+        std::shared_ptr<const FixedBaseTable> table = BuildFixedBaseTable(instance.y, instance.D, L, e.num_bits(), reducer);
+        form f1 = FixedBasePowFormNucomp(table, e, instance.D, L, reducer);
+        form f2 = FastPowFormNucomp(instance.y, instance.D, e, L, reducer);
+        reducer.reduce(f1);
+        reducer.reduce(f2);
+        assertm(f1 == f2, "comb exponentiation should match FastPowFormNucomp");
+        PrecomputeFixedBase(instance.D, instance.x);
+        valid = VerifyWesolowskiBatch(instances);
+        for (int i = 0; i < instances.size(); i++) {
+            assertm(valid[i] == (i != 0 && i != 1 && i != 4), "batch proof " + to_string(i) + " verdict with fixed base");
+        }
+        fixed_base_cache.Clear();
+    }
+
+    // N-wesolowski tests
+    {
+        integer D = CreateDiscriminant(challenge_hash1, 1024);
+        int int_size = (D.num_bits() + 16) >> 4;
+        form x = form::generator(D);
+        std::vector<uint8_t> blob = NWesolowskiBlob(D, {700, 1200, 900});
+        std::vector<WesolowskiSegment> segments;
+        assertm(ParseNWesolowskiProof(D, x, blob.data(), blob.size(), 2800, 2, segments), "n-wesolowski proof should parse");
+        assertm(segments.size() == 3 && segments[0].x == x && segments[1].x == segments[0].y &&
+                segments[2].x == segments[1].y, "segments should chain from x");
+        assertm(segments.size() == 3 && segments[0].iters == 700 && segments[1].iters == 1200 &&
+                segments[2].iters == 900, "segment iters");
+        for (int threads : {1, 0}) {
+            std::string name = " (threads: " + to_string(threads) + ")";
+            assertm(CheckProofOfTimeNWesolowski(D, x, blob.data(), blob.size(), 2800, 2, threads), "n-wesolowski proof should be valid" + name);
+            assertm(!CheckProofOfTimeNWesolowski(D, x, blob.data(), blob.size(), 2801, 2, threads), "wrong total iters" + name);
+            assertm(!CheckProofOfTimeNWesolowski(D, x, blob.data(), blob.size(), 2800, 1, threads), "wrong recursion" + name);
+            assertm(!CheckProofOfTimeNWesolowski(D, x, blob.data(), blob.size(), 600, 2, threads), "segment iters above the total" + name);
+            assertm(!CheckProofOfTimeNWesolowski(D, x, blob.data(), blob.size() - 1, 2800, 2, threads), "truncated blob" + name);
+            std::vector<uint8_t> longer = blob;
+            longer.push_back(0);
+            assertm(!CheckProofOfTimeNWesolowski(D, x, longer.data(), longer.size(), 2800, 2, threads), "oversized blob" + name);
+            longer.resize(blob.size() + 8 + 4 * int_size);
+            assertm(!CheckProofOfTimeNWesolowski(D, x, longer.data(), longer.size(), 2800, 2, threads), "extra segment" + name);
+            // The first segment (last in the blob) gets the final proof in place of its own.
+            std::vector<uint8_t> corrupted = blob;
+            std::copy(blob.begin() + 2 * 129, blob.begin() + 2 * 129 + 2 * int_size, corrupted.end() - 2 * int_size);
+            assertm(!CheckProofOfTimeNWesolowski(D, x, corrupted.data(), corrupted.size(), 2800, 2, threads), "corrupted segment" + name);
+            corrupted = blob;
+            corrupted[2 * 129 + 2 * int_size]++;
+            assertm(!CheckProofOfTimeNWesolowski(D, x, corrupted.data(), corrupted.size(), 2800, 2, threads), "corrupted segment iters" + name);
+        }
+        segments.clear();
+        assertm(!ParseNWesolowskiProof(D, x, blob.data(), 2 * 129 + 2 * int_size - 1, 2800, 0, segments), "blob shorter than its head");
+    }
+
+    // Compressed n-wesolowski tests
+    {
+        integer D = CreateDiscriminant(challenge_hash2, 1024);
+        int int_size = (D.num_bits() + 16) >> 4;
+        form x = form::generator(D);
+        std::vector<uint8_t> blob = NWesolowskiBlob(D, {600, 800});
+        std::vector<uint8_t> compressed = CompressNWesolowskiProof(D, blob.data(), blob.size());
+        assertm(!compressed.empty() && compressed.size() < blob.size(), "n-wesolowski proof should compress");
+        std::vector<uint8_t> decompressed = DecompressNWesolowskiProof(D, compressed.data(), compressed.size());
+        assertm(decompressed == blob, "compressed n-wesolowski proof should round-trip");
+        assertm(CheckProofOfTimeNWesolowski(D, x, decompressed.data(), decompressed.size(), 1400, 1),
+                "decompressed n-wesolowski proof should be valid");
+        compressed.push_back(0);
+        assertm(DecompressNWesolowskiProof(D, compressed.data(), compressed.size()).empty(), "trailing byte");
+        compressed.pop_back();
+
+        // Any one bit flipped in y gives a different form or no form at all.
+        form y = DeserializeForm(D, blob.data(), 129);
+        int y_size = DecompressForm(compressed.data(), compressed.size(), D, y);
+        for (int bit = 0; bit < 8 * y_size; bit++) {
+            std::vector<uint8_t> tampered(compressed.begin(), compressed.begin() + y_size);
+            tampered[bit / 8] ^= 1 << (bit % 8);
+            form f;
+            assertm(!DecompressForm(tampered.data(), tampered.size(), D, f) || !(f == y),
+                    "tampered bit " + to_string(bit) + " should not decode to y");
+        }
+
+        // The same y with b + 2a: the same form, but not serialized reduced.
+        std::vector<uint8_t> unreduced = blob;
+        form f = y;
+        f.b += integer(2) * f.a;
+        assertm(!IsReducedForm(f), "b + 2a should be unreduced");
+        WriteIntegerBytes(f.b, unreduced.data() + 129, 129);
+        assertm(DeserializeForm(D, unreduced.data(), 129) == y, "unreduced y should deserialize to y");
+        assertm(CompressNWesolowskiProof(D, unreduced.data(), unreduced.size()).empty(), "unreduced y should not compress");
+    }
+
+    // Compressed form tests
+    for (WesolowskiInstance& instance: instances) {
+        std::vector<uint8_t> bytes;
+        CompressForm(instance.y, instance.D, bytes);
+        form f;
+        assertm(DecompressForm(bytes.data(), bytes.size(), instance.D, f) == bytes.size(), "compressed form should decode");
+        assertm(f == instance.y, "compressed form should round-trip");
+        bytes.back() ^= 1;
+        assertm(!DecompressForm(bytes.data(), bytes.size(), instance.D, f) || !(f == instance.y), "tampered form should not decode to y");
+    }
+
     return 0;
 }
@@ -1,5 +1,14 @@
-from chiavdf import prove, verify_wesolowski, create_discriminant
+from chiavdf import (
+    prove,
+    verify_wesolowski,
+    create_discriminant,
+    create_discriminant_bytes,
+    verify_wesolowski_bytes,
+    verify_n_wesolowski,
+    verify_batch,
+)
 import secrets
+import threading
 import time
 
 
@@ -50,3 +59,100 @@ def test_prove_and_verify():
         iters,
     )
     assert is_valid
+
+
+def test_bytes_entry_points():
+    discriminant_challenge = secrets.token_bytes(10)
+    discriminant_size = 512
+    discriminant = create_discriminant_bytes(discriminant_challenge, discriminant_size)
+    # create_discriminant returns D in hex.
+    assert int.from_bytes(discriminant, "big", signed=True) == int(
+        create_discriminant(discriminant_challenge, discriminant_size), 16
+    )
+    int_size = (discriminant_size + 16) >> 4
+
+    iters = 10000
+    result = prove(discriminant_challenge, discriminant_size, iters)
+    x = (2).to_bytes(int_size, "big", signed=True) + (1).to_bytes(int_size, "big", signed=True)
+    y = result[: 2 * int_size]
+    proof = result[2 * int_size:]
+    assert verify_wesolowski_bytes(discriminant, x, y, proof, iters)
+    assert not verify_wesolowski_bytes(discriminant, x, y, proof, iters + 1)
+    assert not verify_wesolowski_bytes(discriminant, x, y, b"\x01" * len(proof), iters)
+
+    # n-wesolowski blobs store y with 129-byte integers.
+    y_a = int.from_bytes(y[:int_size], "big", signed=True)
+    y_b = int.from_bytes(y[int_size:], "big", signed=True)
+    blob = y_a.to_bytes(129, "big", signed=True) + y_b.to_bytes(129, "big", signed=True) + proof
+    assert verify_n_wesolowski(discriminant, x, blob, iters, 0)
+    assert not verify_n_wesolowski(discriminant, x, blob, iters + 1, 0)
+    assert not verify_n_wesolowski(discriminant, x, blob[:-1], iters, 0)
+
+    assert verify_batch(
+        [
+            (discriminant, x, y, proof, iters),
+            (discriminant, x, y, proof, iters + 1),
+            (discriminant, x, bytearray(y), memoryview(proof), iters),
+        ]
+    ) == [True, False, True]
+
+    # Buffers are read in place, so they must be C contiguous; a strided view of y is refused.
+    strided_y = memoryview(bytes(b for pair in zip(y, y) for b in pair))[::2]
+    assert bytes(strided_y) == y
+    try:
+        verify_wesolowski_bytes(discriminant, x, strided_y, proof, iters)
+        assert False, "a strided buffer should raise"
+    except BufferError:
+        pass
+
+
+def test_prove_progress_and_cancel():
+    discriminant_challenge = secrets.token_bytes(10)
+    reported = []
+    result = prove(discriminant_challenge, 512, 250000, threads=2, progress=reported.append)
+    assert result is not None
+    assert reported == sorted(reported) and reported[-1] == 250000
+
+    assert prove(discriminant_challenge, 512, 250000, progress=lambda done: done < 100000) is None
+
+
+def test_gil_released():
+    # A Python thread keeps running while prove and verify_batch work, since they drop the GIL.
+    # Holding it, the thread could only tick near the ends of a call, so look in the middle half.
+    discriminant_size = 1024
+    int_size = (discriminant_size + 16) >> 4
+    x = (2).to_bytes(int_size, "big", signed=True) + (1).to_bytes(int_size, "big", signed=True)
+    iters = 1000
+
+    ticks = []
+    stop = threading.Event()
+
+    def tick():
+        while not stop.is_set():
+            ticks.append(time.monotonic())
+            time.sleep(0.001)
+
+    def ticked_during(start, end):
+        quarter = (end - start) / 4
+        return any(start + quarter < t < end - quarter for t in ticks)
+
+    ticker = threading.Thread(target=tick)
+    ticker.start()
+    try:
+        proofs = []
+        for _ in range(8):
+            discriminant_challenge = secrets.token_bytes(10)
+            discriminant = create_discriminant_bytes(discriminant_challenge, discriminant_size)
+            result = prove(discriminant_challenge, discriminant_size, iters)
+            proofs.append((discriminant, x, result[: 2 * int_size], result[2 * int_size:], iters))
+        t1 = time.monotonic()
+        prove(discriminant_challenge, discriminant_size, 100000)
+        t2 = time.monotonic()
+        valid = verify_batch(proofs)
+        t3 = time.monotonic()
+    finally:
+        stop.set()
+        ticker.join()
+    assert valid == [True] * 8
+    assert ticked_during(t1, t2)
+    assert ticked_during(t2, t3)